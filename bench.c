@@ -0,0 +1,432 @@
+/*
+ * bench.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Benchmarks for the shell, linked from the same objects as the shell
+ *			 itself. Micro benchmarks time the tokenizer and the dispatch path,
+ *			 macro benchmarks run cp, cp -u, cat, ls, mkdir and rm through parse_line
+ *			 and parseCommand over generated files in a scratch directory.
+ *			 spawn runs an external program through the shell (posix_spawn)
+ *			 and fork_exec starts the same one with fork and exec, with a
+ *			 resident heap the size of a busy shell's so fork has pages to copy.
+ *			 Every benchmark prints one JSON line (ops/s, MB/s where bytes
+ *			 are moved, and latency percentiles) and, given a baseline from
+ *			 an earlier run, how far it moved. Run with "make bench", save a
+ *			 baseline with "make bench-baseline".
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "dispatch.h"
+#include "external.h"
+#include "output.h"
+#include "string_parser.h"
+#include "tree.h"
+#include "workers.h"
+
+#define BENCH_MICRO_BATCH 1000  // Micro ops timed together, a single one is below the clock's resolution
+#define BENCH_MAX_BASELINE 64
+#define BENCH_LINE_MAX 256
+#define BENCH_SPAWN_RESIDENT (64L * 1024 * 1024)  // Heap touched before the spawn benchmarks
+
+// Settings from the command line
+typedef struct
+{
+    int iterations;         // Timed samples per benchmark
+    long file_size;         // Bytes in the file cp and cat work on
+    int dir_entries;        // Files in the directory ls lists
+    const char *only;       // Run just this benchmark, NULL for all
+}bench_options;
+
+// What an operation counts as moved data, which MB/s is printed for
+typedef enum
+{
+    MOVES_NOTHING = 0,
+    MOVES_LINE,             // The command line it tokenizes
+    MOVES_FILE              // One generated file of bench_file_size bytes
+}bench_bytes;
+
+typedef struct
+{
+    const char *name;
+    int (*setup)(const bench_options *opts);   // NULL if there is nothing to prepare
+    void (*op)(int index);                      // One operation
+    int batch;                                  // Operations per timed sample
+    bench_bytes moves;
+}bench_case;
+
+typedef struct
+{
+    char name[64];
+    double ops_per_s;
+}baseline_entry;
+
+static parse_arena arena;
+static long bench_file_size;
+static output_stream sink;      // Where command output normally goes, /dev/null
+static output_stream cat_out;   // cat writes into a real file, /dev/null would take it for free
+
+// Command lines used by the micro benchmarks, in the mix a script would have
+static const char *sample_lines[] = {
+    "ls -l\n",
+    "cp notes.txt backup/notes.txt ; cat notes.txt\n",
+    "mkdir build ; cd build ; pwd\n",
+    "mv draft.txt final.txt\n",
+    "cat a.txt b.txt c.txt d.txt ; rm -r old_build\n",
+};
+#define NUM_SAMPLES (int)(sizeof(sample_lines) / sizeof(sample_lines[0]))
+
+static command_line pwd_command;
+
+// Tokenizes and runs text, which is copied first since parse_line writes into it
+static void runLine(const char *text) {
+    char buf[BENCH_LINE_MAX];
+    size_t len = strlen(text);
+    memcpy(buf, text, len + 1);
+    parsed_line line = parse_line(&arena, buf, len);
+    for (int i = 0; i < line.num_commands; i++) {
+        parseCommand(line.commands[i]);
+    }
+}
+
+static void opTokenize(int index) {
+    char buf[BENCH_LINE_MAX];
+    const char *text = sample_lines[index % NUM_SAMPLES];
+    size_t len = strlen(text);
+    memcpy(buf, text, len + 1);
+    parse_line(&arena, buf, len);
+}
+
+static int setupDispatch(const bench_options *opts) {
+    (void)opts;
+    static char *argv[] = {"pwd", NULL};
+    pwd_command.command_list = argv;
+    pwd_command.num_token = 2;
+    return 0;
+}
+
+static void opDispatch(int index) {
+    (void)index;
+    parseCommand(pwd_command);
+}
+
+// Writes size bytes of varied data to name
+static int writeFile(const char *name, long size) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    char block[64 * 1024];
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = (char)(i * 131 + (i >> 8));
+    }
+    long left = size;
+    while (left > 0) {
+        long chunk = left < (long)sizeof(block) ? left : (long)sizeof(block);
+        if (write(fd, block, chunk) != chunk) {
+            close(fd);
+            return -1;
+        }
+        left -= chunk;
+    }
+    return close(fd);
+}
+
+static int setupFile(const bench_options *opts) {
+    bench_file_size = opts->file_size;
+    return writeFile("bench_src.dat", opts->file_size);
+}
+
+static void opCp(int index) {
+    (void)index;
+    runLine("cp bench_src.dat bench_dst.dat");
+}
+
+// After the first run the destination matches, so this measures the skip
+static void opCpUpdate(int index) {
+    (void)index;
+    runLine("cp -u bench_src.dat bench_upd.dat");
+}
+
+static int setupCat(const bench_options *opts) {
+    int fd = open("bench_cat.out", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    outInit(&cat_out, fd, OUTPUT_FULL);
+    return setupFile(opts);
+}
+
+static void opCat(int index) {
+    (void)index;
+    if (ftruncate(cat_out.fd, 0) != 0 || lseek(cat_out.fd, 0, SEEK_SET) != 0) {
+        return;
+    }
+    outUse(&cat_out);
+    runLine("cat bench_src.dat");
+    outFlush();
+    outUse(&sink);
+}
+
+static int setupLs(const bench_options *opts) {
+    if (mkdir("bench_ls", 0755) != 0) {
+        return -1;
+    }
+    char name[64];
+    for (int i = 0; i < opts->dir_entries; i++) {
+        snprintf(name, sizeof(name), "bench_ls/entry_%06d", i);
+        if (writeFile(name, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void opLs(int index) {
+    (void)index;
+    runLine("ls bench_ls");
+}
+
+// mkdir leaves its directories behind for rm, so the two always run as a pair
+static void opMkdir(int index) {
+    char line[64];
+    snprintf(line, sizeof(line), "mkdir bench_mk_%d", index);
+    runLine(line);
+}
+
+static void opRm(int index) {
+    char line[64];
+    snprintf(line, sizeof(line), "rm -r bench_mk_%d", index);
+    runLine(line);
+}
+
+static char true_path[4096];   // Where PATH has true, for fork_exec
+static char *resident;          // Kept touched so fork has page tables to copy
+
+static int setupSpawn(const bench_options *opts) {
+    (void)opts;
+    if (resident == NULL) {
+        resident = malloc(BENCH_SPAWN_RESIDENT);
+        if (resident == NULL) {
+            return -1;
+        }
+        memset(resident, 1, BENCH_SPAWN_RESIDENT);
+    }
+    return resolveExternal("true", true_path, sizeof(true_path));
+}
+
+static void opSpawn(int index) {
+    (void)index;
+    runLine("true");
+}
+
+static void opForkExec(int index) {
+    (void)index;
+    pid_t pid = fork();
+    if (pid == 0) {
+        char *argv[] = {"true", NULL};
+        execv(true_path, argv);
+        _exit(127);
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+static const bench_case cases[] = {
+    {"tokenize", NULL, opTokenize, BENCH_MICRO_BATCH, MOVES_LINE},
+    {"dispatch", setupDispatch, opDispatch, BENCH_MICRO_BATCH, MOVES_NOTHING},
+    {"cp", setupFile, opCp, 1, MOVES_FILE},
+    // Writes nothing once the copy matches, the file size would flatter it
+    {"cp_update", setupFile, opCpUpdate, 1, MOVES_NOTHING},
+    {"cat", setupCat, opCat, 1, MOVES_FILE},
+    {"ls", setupLs, opLs, 1, MOVES_NOTHING},
+    {"mkdir", NULL, opMkdir, 1, MOVES_NOTHING},
+    {"rm", NULL, opRm, 1, MOVES_NOTHING},
+    {"spawn", setupSpawn, opSpawn, 1, MOVES_NOTHING},
+    {"fork_exec", setupSpawn, opForkExec, 1, MOVES_NOTHING},
+};
+#define NUM_CASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Value below which fraction of the sorted samples fall
+static double percentile(const double *sorted, int n, double fraction) {
+    int index = (int)(fraction * (n - 1) + 0.5);
+    return sorted[index];
+}
+
+// Reads the ops/s of every benchmark in an earlier run's output, returns how many were found
+static int loadBaseline(const char *path, baseline_entry *entries) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    int n = 0;
+    char line[1024];
+    while (n < BENCH_MAX_BASELINE && fgets(line, sizeof(line), file) != NULL) {
+        const char *ops = strstr(line, "\"ops_per_s\":");
+        if (sscanf(line, "{\"bench\":\"%63[^\"]\"", entries[n].name) == 1 && ops != NULL &&
+            sscanf(ops, "\"ops_per_s\":%lf", &entries[n].ops_per_s) == 1) {
+            n++;
+        }
+    }
+    fclose(file);
+    return n;
+}
+
+/*
+    Description: Runs one benchmark and prints its JSON line.
+        Args:
+            const bench_case *bench : Benchmark to run
+            const bench_options *opts : Sizes and iteration count
+            const baseline_entry *baseline, int num_baseline : Earlier results to compare with
+        Returns:
+            int : 0, or -1 if its setup failed
+*/
+static int runCase(const bench_case *bench, const bench_options *opts,
+                   const baseline_entry *baseline, int num_baseline) {
+    if (bench->setup != NULL && bench->setup(opts) != 0) {
+        fprintf(stderr, "%s: setup failed\n", bench->name);
+        return -1;
+    }
+    double *samples = malloc(opts->iterations * sizeof(double));
+    if (samples == NULL) {
+        return -1;
+    }
+
+    long long bytes = 0;
+    long long total = 0;
+    int index = 0;
+    for (int i = 0; i < opts->iterations; i++) {
+        long long begin = nowNanos();
+        for (int j = 0; j < bench->batch; j++) {
+            bench->op(index);
+            if (bench->moves == MOVES_LINE) {
+                bytes += strlen(sample_lines[index % NUM_SAMPLES]);
+            }
+            index++;
+        }
+        long long elapsed = nowNanos() - begin;
+        total += elapsed;
+        samples[i] = elapsed / 1e3 / bench->batch;    // Microseconds per operation
+    }
+    outFlush();
+    if (bench->moves == MOVES_FILE) {
+        bytes = (long long)index * bench_file_size;
+    }
+
+    qsort(samples, opts->iterations, sizeof(double), compareDoubles);
+    double seconds = total > 0 ? total / 1e9 : 1e-9;
+    double ops_per_s = index / seconds;
+    printf("{\"bench\":\"%s\",\"ops\":%d,\"seconds\":%.6f,\"ops_per_s\":%.1f,",
+           bench->name, index, seconds, ops_per_s);
+    if (bench->moves != MOVES_NOTHING) {
+        printf("\"mb_per_s\":%.1f,", bytes / 1e6 / seconds);
+    }
+    printf("\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f",
+           percentile(samples, opts->iterations, 0.50), percentile(samples, opts->iterations, 0.90),
+           percentile(samples, opts->iterations, 0.99), samples[opts->iterations - 1]);
+
+    for (int i = 0; i < num_baseline; i++) {
+        if (strcmp(baseline[i].name, bench->name) == 0 && baseline[i].ops_per_s > 0) {
+            double change = (ops_per_s / baseline[i].ops_per_s - 1) * 100;
+            printf(",\"baseline_ops_per_s\":%.1f,\"change_pct\":%.1f", baseline[i].ops_per_s, change);
+            fprintf(stderr, "%-10s %12.1f ops/s  %+6.1f%% against the baseline\n", bench->name, ops_per_s, change);
+        }
+    }
+    printf("}\n");
+    fflush(stdout);
+    free(samples);
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n samples] [-size MB] [-files N] [-dir scratch_parent] "
+                    "[-baseline file] [-only name]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    bench_options opts = {200, 4L * 1024 * 1024, 1000, NULL};
+    const char *parent = "/tmp";
+    const char *baseline_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-n") == 0) {
+            opts.iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-size") == 0) {
+            opts.file_size = atol(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "-files") == 0) {
+            opts.dir_entries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-dir") == 0) {
+            parent = argv[++i];
+        } else if (strcmp(argv[i], "-baseline") == 0) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "-only") == 0) {
+            opts.only = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.iterations <= 0 || opts.file_size < 0 || opts.dir_entries < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    baseline_entry baseline[BENCH_MAX_BASELINE];
+    int num_baseline = baseline_path != NULL ? loadBaseline(baseline_path, baseline) : 0;
+    if (baseline_path != NULL && num_baseline == 0) {
+        fprintf(stderr, "No baseline in %s, save one with \"make bench-baseline\"\n", baseline_path);
+    }
+
+    // Everything happens in a scratch directory, which the shell's session starts in
+    char scratch[4096];
+    snprintf(scratch, sizeof(scratch), "%s/pseudo-bench.XXXXXX", parent);
+    if (mkdtemp(scratch) == NULL || chdir(scratch) != 0) {
+        perror("scratch directory");
+        return 1;
+    }
+
+    // Command output is thrown away, only its cost is measured
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    outInit(&sink, null_fd, OUTPUT_FULL);
+    outUse(&sink);
+    arena_init(&arena);
+
+    int failed = 0;
+    for (int i = 0; i < NUM_CASES; i++) {
+        if (opts.only == NULL || strcmp(opts.only, cases[i].name) == 0 ||
+            (strcmp(opts.only, "rm") == 0 && strcmp(cases[i].name, "mkdir") == 0)) {
+            failed |= runCase(&cases[i], &opts, baseline, num_baseline) != 0;
+        }
+    }
+
+    outUse(NULL);
+    outClose(&sink);
+    close(null_fd);
+    if (cat_out.fd > 0) {
+        outClose(&cat_out);
+        close(cat_out.fd);
+    }
+    arena_free(&arena);
+    free(resident);
+    if (chdir(parent) != 0 || removeTree(scratch) != 0) {
+        fprintf(stderr, "Couldn't remove %s\n", scratch);
+    }
+    return failed;
+}
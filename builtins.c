@@ -0,0 +1,199 @@
+/*
+    Author: Ellison Schilling
+    Description: Registers the commands from command.h with the dispatcher. Each
+    entry adapts the argv form used by the dispatcher to the command's own signature.
+*/
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include "command.h"
+#include "copy_engine.h"
+#include "dispatch.h"
+#include "listing.h"
+#include "list_cache.h"
+#include "output.h"
+#include "tree.h"
+
+/* ls [-l] [--sort] [--timing] [directory] */
+static int runLs(int argc, char **argv) {
+    const char *path = NULL;
+    int flags = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sort") == 0) {
+            flags |= LIST_SORTED;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            flags |= LIST_LONG;
+        } else if (strcmp(argv[i], "--timing") == 0) {
+            flags |= LIST_TIMING;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            printWrongNumArgs();    // Only one directory can be listed at a time
+            return 1;
+        }
+    }
+
+    if (path == NULL && flags == 0) {
+        listDir();
+        return 0;
+    }
+    return listDirectory(path != NULL ? path : ".", flags) != 0;
+}
+
+static int runPwd(int argc, char **argv) {
+    (void)argc; (void)argv;
+    showCurrentDir();
+    return 0;
+}
+
+static int runMkdir(int argc, char **argv) {
+    char *paths[argc];
+    int num_paths = 0;
+    int parents = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--parents") == 0) {
+            parents = 1;
+        } else {
+            paths[num_paths++] = argv[i];
+        }
+    }
+    if (num_paths == 0) {
+        printWrongNumArgs();
+        return 1;
+    }
+
+    if (parents) {
+        return makeDirs(paths, num_paths) != 0;
+    }
+    for (int i = 0; i < num_paths; i++) {
+        makeDir(paths[i]);
+    }
+    return 0;
+}
+
+static int runCd(int argc, char **argv) {
+    (void)argc;
+    changeDir(argv[1]);
+    return 0;
+}
+
+static int runCp(int argc, char **argv) {
+    char *paths[2];
+    int num_paths = 0;
+    int recursive = 0;
+    int update = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-R") == 0) {
+            recursive = 1;
+        } else if (strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--update") == 0) {
+            update = 1;
+        } else if (num_paths < 2) {
+            paths[num_paths++] = argv[i];
+        } else {
+            printWrongNumArgs();
+            return 1;
+        }
+    }
+    if (num_paths != 2) {
+        printWrongNumArgs();
+        return 1;
+    }
+
+    if (recursive || update) {
+        // The tree code creates entries all the way down, the cache learns of them from inotify
+        int status = recursive ? copyTree(paths[0], paths[1], update) : updateFile(paths[0], paths[1]);
+        if (listCacheEnabled)
+            listCacheDirty();
+        return status != 0;
+    }
+    copyFile(paths[0], paths[1]);
+    return 0;
+}
+
+static int runMv(int argc, char **argv) {
+    (void)argc;
+    moveFile(argv[1], argv[2]);
+    return 0;
+}
+
+static int runRm(int argc, char **argv) {
+    char *path = NULL;
+    int recursive = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-R") == 0) {
+            recursive = 1;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            printWrongNumArgs();
+            return 1;
+        }
+    }
+    if (path == NULL) {
+        printWrongNumArgs();
+        return 1;
+    }
+
+    if (recursive) {
+        int status = removeTree(path);
+        if (listCacheEnabled)
+            listCacheDirty();
+        return status != 0;
+    }
+    deleteFile(path);
+    return 0;
+}
+
+// cat with no files inside a pipeline: passes on what the stage before wrote
+static int catInput(void) {
+    copy_status status;
+    if (outFd() == OUTPUT_MEMORY) {
+        status = outCopyFd(inFd()) == 0 ? COPY_OK : COPY_READ_ERROR;
+    } else {
+        outFlush();
+        status = streamFd(inFd(), outFd(), NULL);  // Pipe to pipe or file is a splice, no copy
+    }
+    if (status == COPY_WRITE_ERROR) {
+        outPrint("Error! write error\n");
+    } else if (status == COPY_READ_ERROR) {
+        outPrint("Error! read error\n");
+    }
+    return status != COPY_OK;
+}
+
+static int runCat(int argc, char **argv) {
+    if (argc == 1) {
+        if (inFd() == STDIN_FILENO) {
+            printWrongNumArgs();    // Outside a pipeline a file is still required
+            return 1;
+        }
+        return catInput();
+    }
+    for (int i = 1; i < argc; i++) {    // Print every file given, in order
+        displayFile(argv[i]);
+    }
+    return 0;
+}
+
+static const builtin core_builtins[] = {
+    /* name     handler   min  max             flags */
+    { "exit",   NULL,     0,   ARGS_UNLIMITED, BUILTIN_EXIT },
+    { "ls",     runLs,    0,   4,              BUILTIN_READS },
+    { "pwd",    runPwd,   0,   0,              BUILTIN_NO_FILES },
+    { "mkdir",  runMkdir, 1,   ARGS_UNLIMITED, BUILTIN_WRITES },
+    { "cd",     runCd,    1,   1,              BUILTIN_CHDIR },
+    { "cp",     runCp,    2,   4,              BUILTIN_WRITES_LAST },
+    { "mv",     runMv,    2,   2,              BUILTIN_WRITES },
+    { "rm",     runRm,    1,   2,              BUILTIN_WRITES },
+    { "cat",    runCat,   0,   ARGS_UNLIMITED, BUILTIN_READS },
+};
+
+__attribute__((constructor))
+static void registerCoreBuiltins(void) {
+    registerBuiltins(core_builtins, sizeof(core_builtins) / sizeof(core_builtins[0]));
+}
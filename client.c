@@ -0,0 +1,111 @@
+/*
+ * client.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Stand-in client for daemon mode. Sends a script (or standard input)
+ *			 to a pseudo-shell started with -d and prints the output as it
+ *			 comes back, until the server is done with the session.
+ *
+ *			 Usage: pseudo-client socket_path [script]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CLIENT_BUFFER_SIZE (64 * 1024)
+
+// Writes all of len bytes to fd, returns -1 on error
+static int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s socket_path [script]\n", argv[0]);
+        return 1;
+    }
+    int in = argc == 3 ? open(argv[2], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (in < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", argv[1]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);   // The server may close first after exit
+
+    // Sending and receiving go on together, so neither side can block the other
+    char out_buf[CLIENT_BUFFER_SIZE], in_buf[CLIENT_BUFFER_SIZE];
+    size_t pending = 0, sent = 0;
+    int sending = 1;
+    while (1) {
+        if (sending && pending == sent) {
+            ssize_t got = read(in, out_buf, sizeof(out_buf));
+            if (got > 0) {
+                pending = got;
+                sent = 0;
+            } else {
+                shutdown(sock, SHUT_WR);    // The server runs whatever is left and finishes
+                sending = 0;
+            }
+        }
+
+        struct pollfd fds = {sock, POLLIN | (sending ? POLLOUT : 0), 0};
+        if (poll(&fds, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t got = read(sock, in_buf, sizeof(in_buf));
+            if (got <= 0) {
+                break;      // The server closed the session
+            }
+            if (writeAll(STDOUT_FILENO, in_buf, got) != 0) {
+                break;
+            }
+        }
+        if (sending && (fds.revents & POLLOUT)) {
+            ssize_t written = send(sock, out_buf + sent, pending - sent, MSG_DONTWAIT);
+            if (written > 0) {
+                sent += written;
+            } else if (written < 0 && errno != EAGAIN && errno != EINTR) {
+                sending = 0;    // Closed after exit, stop sending but keep reading
+            }
+        }
+    }
+    close(sock);
+    if (in != STDIN_FILENO) {
+        close(in);
+    }
+    return 0;
+}
@@ -8,6 +8,13 @@
 # include <stdlib.h>
 # include <stdbool.h>
 # include "command.h"
+# include "copy_engine.h"
+# include "output.h"
+# include "listing.h"
+# include "list_cache.h"
+# include "session.h"
+# include "tree.h"
+# include <errno.h>
 # include <fcntl.h>
 # include <unistd.h>
 # include <dirent.h>
@@ -16,14 +23,14 @@
 
 /*
 Description: My implementation of a print to standard out. Used to slim down the code, and make reading
-easier. Helper function.
+easier. Helper function. Goes through the shared output buffer rather than a write() per call.
         Args: 
             char* string : The string we wish to print
         Returns: 
             N/A
 */
 void myPrint(char* string){
-	write(1, string, strlen(string));
+	outWrite(string, strlen(string));
 }
 
 /*
@@ -51,31 +58,7 @@ bool prefix(char *string, char *prefix) {
 */
 void listDir()
 {
-    char cur_dir[256]; // An empty string as big as it can go to hold the current directory path
-    struct dirent *dirt;  // a pointer to a single directory entry
-    DIR *dir = NULL; // a pointer for the directory stream
-    char *file; // a pointer to an empty string that will be replaced by the file found in directories
-
-    // Attempts to read the currecnt directory and get the path, prints error on failure
-    if(getcwd(cur_dir, sizeof(cur_dir)) == NULL) {  
-        myPrint("Error! unable to read from directory\n");
-    }
-    else {
-        if((dir = opendir(cur_dir)) == NULL) {  // If the current pathway is not actually a directory 
-                                                // pathway then an error message is printed
-            myPrint("Error! unable to open directory\n");
-        }
-        else {
-            while((dirt = readdir(dir)) != NULL) {  // While there is still more to read from the directory
-
-                file = dirt->d_name;    // file is set to the name of the single given directory entry indicated by dirt
-                myPrint(file); // Prints the given file
-                myPrint(" ");
-            }
-            myPrint("\n"); // Print newline charcter for proper spacing
-            closedir(dir); // Close the directory stream after iterating through it
-        }
-    }
+    listDirectory(".", 0);  // Batched getdents64 read, printed as one block
 }
 
 /*
@@ -88,15 +71,14 @@ void listDir()
 */
 void showCurrentDir()
 {
-    char cur_dir[256]; // An empty string as big as it can go to hold the current directory path
-
-    // Attempts to read the currecnt directory and get the path, prints error on failure
-    if(getcwd(cur_dir, sizeof(cur_dir)) == NULL) {
+    // The session keeps the path up to date on every cd, so there is nothing to ask the kernel
+    shell_session *session = currentSession();
+    if (session->cwd_path == NULL) {
         myPrint("Error! unable to read from directory\n");
     }
     else {
-        strcat(cur_dir, "\n");  // Concataonates a new line charchter onto the path to be printed
-        myPrint(cur_dir);   // Prints the current directory pathway
+        outWrite(session->cwd_path, session->cwd_len);  // Prints the current directory pathway
+        myPrint("\n");
     }
 }
 
@@ -110,18 +92,11 @@ void showCurrentDir()
 */
 void makeDir(char *dirName)
 {
-    char cur_dir[64];   // Declare a character array of size 64 to store the current working directory
-    char dir_path[256]; // Declare a character array of size 256 to store the path of the directory to be created
-
-    getcwd(cur_dir, sizeof(cur_dir));   // Get the current working directory and store it in cur_dir
-
-    strcpy(dir_path, "");   // Initialize dir_path with an empty string
-    strcat(dir_path, cur_dir);  // Append the current working directory to dir_path
-    strcat(dir_path, "/");  // Append a forward slash '/' to dir_path
-    strcat(dir_path, dirName);  // Append the name of the directory to be created to dir_path
-
-    if (mkdir(dir_path, 0666) != 0) {   // Call the mkdir function to create the directory
+    // Created relative to the session's directory, so paths of any length work
+    if (mkdirat(cwdFd(), dirName, 0777) != 0) {
         myPrint("Error! could not create given directory\n");   // If mkdir fails, print an error message
+    } else if (listCacheEnabled) {
+        listCacheNote(cwdFd(), dirName, true);
     }
 }
 
@@ -134,29 +109,12 @@ void makeDir(char *dirName)
             N/A
 */
 void changeDir(char *dirName) {
-    if (strcmp(dirName, "..") == 0) {
-        // Handle the parent directory case
-        char *parent_dir = (char *)malloc(256 * sizeof(char)); // Allocate memory for the parent directory path
-        if (getcwd(parent_dir, 256) != NULL) {
-            char *last_slash = strrchr(parent_dir, '/'); // Find the last '/' in the path
-            if (last_slash != NULL) {
-                *last_slash = '\0'; // Terminate the string at the last '/' to get the parent directory
-                int changed_directory = chdir(parent_dir); // Change to the parent directory
-                if (changed_directory != 0) {
-                    myPrint("Error! Wasn't able to change the directory\n");
-                }
-            }
-        }
-        free(parent_dir); // Free the dynamically allocated memory for parent_dir
-    } else if (strcmp(dirName, ".") == 0) {
+    if (strcmp(dirName, ".") == 0) {
         // Handle the current directory case
         // No need to do anything, as we're already in the current directory
-    } else {
-        // Handle the regular directory case
-        int changed_directory = chdir(dirName); // Change to the specified directory
-        if (changed_directory != 0) {
-            myPrint("Error! Wasn't able to change the directory\n");
-        }
+    } else if (sessionChdir(currentSession(), dirName) != 0) {
+        // Regular directories and ".." alike, the session tracks the new path
+        myPrint("Error! Wasn't able to change the directory\n");
     }
 }
 
@@ -171,51 +129,60 @@ void changeDir(char *dirName) {
 */
 void copyFile(char *sourcePath, char *destinationPath) { // cp
     int inFD, outFD; // Input and output file descriptors
-    char buffer[256]; // Buffer to read and write data
+    int dirFD; // The destination directory, if the destination is one
     char *dest_file_name = NULL; // Pointer to store the destination file name
 
-    inFD = open(sourcePath, O_RDONLY);  // Open source file
+    inFD = openat(cwdFd(), sourcePath, O_RDONLY | O_CLOEXEC);  // Open source file
     if (inFD < 0) {
         myPrint("Error! Can't open input file\n");
         return;
     }
 
-    // Get the file name from sourcePath 
-    dest_file_name = basename(sourcePath);
-    if (dest_file_name == NULL) // No '/' found, just use the source file name
-        dest_file_name = sourcePath;
-
-    // Change to the destination directory
-    if (chdir(destinationPath) != 0) {
+    dirFD = openat(cwdFd(), destinationPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFD >= 0) {
+        // Copying into a directory, keep the file name from sourcePath
+        dest_file_name = basename(sourcePath);
+        if (dest_file_name == NULL) // No '/' found, just use the source file name
+            dest_file_name = sourcePath;
+    } else if (destinationPath[strlen(destinationPath) - 1] == '/') {
+        // A trailing slash promises a directory that isn't there
         myPrint("Error! Can't change directory to destination\n");
         close(inFD);
         return;
+    } else {
+        // Anything else names the new file itself
+        dest_file_name = destinationPath;
+    }
+
+    // O_TRUNC on the source itself would empty it before a byte is read
+    struct stat in_st, out_st;
+    if (fstat(inFD, &in_st) == 0 && fstatat(dirFD >= 0 ? dirFD : cwdFd(), dest_file_name, &out_st, 0) == 0 &&
+        in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+        myPrint("Error! source and destination are the same file\n");
+        if (dirFD >= 0)
+            close(dirFD);
+        close(inFD);
+        return;
     }
-    
+
     // Open or create the destination file and destination file descriptor, giving full permissions
-    outFD = open(dest_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    outFD = openat(dirFD >= 0 ? dirFD : cwdFd(), dest_file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+    if (outFD >= 0 && listCacheEnabled)
+        listCacheNote(dirFD >= 0 ? dirFD : cwdFd(), dest_file_name, true);
+    if (dirFD >= 0)
+        close(dirFD);
     if (outFD < 0) {    // Check if not successful
         myPrint("Error! Can't open destination file\n");
         close(inFD);    // Close input file
         return;
     } 
 
-    // Write to output file what was written in the source file, the copying part of the function
-    ssize_t bytes_read, bytes_written;
-    while ((bytes_read = read(inFD, buffer, sizeof(buffer))) > 0) { // While there is still more to read
-        bytes_written = write(outFD, buffer, bytes_read);   // Write to output file
-        if (bytes_written != bytes_read) {
-            myPrint("Error! write error\n");
-            close(inFD);    // Close files as needed on failure
-            close(outFD);
-            return;
-        }
-    }
-
-    if (bytes_read < 0) { 
+    // Hand the descriptors to the copy engine, which picks the cheapest way the kernel offers
+    copy_status status = copyFd(inFD, outFD, NULL);
+    if (status == COPY_WRITE_ERROR) {
+        myPrint("Error! write error\n");
+    } else if (status == COPY_READ_ERROR) {
         myPrint("Error! read error\n");
-        close(inFD);    // Close files as needed on failure
-        close(outFD);
     }
 
     close(inFD);    // Close files
@@ -224,7 +191,8 @@ void copyFile(char *sourcePath, char *destinationPath) { // cp
 
 /*
     Description: Moves the file found at the source path to the location found via the
-    destination path. Operates like the linux mv command.
+    destination path. Operates like the linux mv command, including moves onto
+    another filesystem, which are copied and then removed.
         Args:
             char *sourcePath : The path of the orignal file, used to move
             char *destinationPath : The destination we wish to move our file into
@@ -233,8 +201,29 @@ void copyFile(char *sourcePath, char *destinationPath) { // cp
 */
 void moveFile(char *sourcePath, char *destinationPath)
 {   
-    int file_moved = rename(sourcePath, destinationPath);     // Move the file, and check for success
-    if(file_moved != 0) {
+    int dirFD = openat(cwdFd(), destinationPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    // Moving into a directory keeps the file name
+    int dst_parent = dirFD >= 0 ? dirFD : cwdFd();
+    char *dst_name = dirFD >= 0 ? basename(sourcePath) : destinationPath;
+    int file_moved = renameat(cwdFd(), sourcePath, dst_parent, dst_name);     // Move the file, and check for success
+    if (file_moved != 0 && errno == EXDEV) {
+        // Another filesystem, so the data has to be copied over and the source removed
+        file_moved = moveAcross(cwdFd(), sourcePath, dst_parent, dst_name);
+    }
+    if (file_moved == -2) {
+        // The copy is whole, only the source is left over
+        myPrint("Error! moved file but could not remove the source\n");
+        if (listCacheEnabled) {
+            listCacheNote(dst_parent, dst_name, true);
+        }
+    } else if (file_moved == 0 && listCacheEnabled) {
+        listCacheNote(cwdFd(), sourcePath, false);
+        listCacheNote(dst_parent, dst_name, true);
+    }
+    if (dirFD >= 0) {
+        close(dirFD);
+    }
+    if(file_moved == -1) {
         myPrint("Error! can't move file\n");     // Give appropriate error on fail
     } 
 }
@@ -248,15 +237,18 @@ void moveFile(char *sourcePath, char *destinationPath)
 */
 void deleteFile(char *filename)
 {
-    int file_deleted = unlink(filename); // Call the unlink() system call to delete the file 
+    int file_deleted = unlinkat(cwdFd(), filename, 0); // Call the unlinkat() system call to delete the file 
     if (file_deleted != 0) { // Check if the file deletion failed
     myPrint("Error! can't delete file\n"); // If it failed, print an error message
+} else if (listCacheEnabled) {
+    listCacheNote(cwdFd(), filename, false);
 }
 }
 
 /*
     Description: Prints the contents of the provided file into the command line. 
-    Operates like the linux cat command.
+    Operates like the linux cat command. The bytes are streamed by the kernel
+    (sendfile into files, splice into pipes, a mapped write onto terminals).
         Args: 
             char *filename : The name of the file the user wishes to see the 
             contents of
@@ -264,33 +256,26 @@ void deleteFile(char *filename)
             N/A
 */
 void displayFile(char *filename) {
-    int info, bytes_read;
-    char *buf = (char*)malloc(1024 * sizeof(char)); // Allocate memory for a buffer of 1024 characters using calloc
-
-    if (buf == NULL) {
-        myPrint("Error! memory allocation failed\n");
-        return;
-    }
-    info = open(filename, O_RDONLY); // Open the file specified by 'filename' in read-only mode
+    int info = openat(cwdFd(), filename, O_RDONLY | O_CLOEXEC); // Open the file specified by 'filename' in read-only mode
     if (info < 0) {
         myPrint("Error! can't open file\n"); // If the open() call fails, print an error message
-        free(buf); // Free the dynamically allocated memory for the buffer
         return;
     }
 
-    while ((bytes_read = read(info, buf, 1024)) > 0) {
-        if (write(STDOUT_FILENO, buf, bytes_read) != bytes_read) {         // Print the contents of the buffer
-            myPrint("Error! write error\n");
-            close(info);
-            free(buf);
-            break;
-        }
+    copy_status status = COPY_OK;
+    if (outFd() == OUTPUT_MEMORY) {
+        // Output is being collected (parallel file mode), so the bytes have to pass through it
+        if (outCopyFd(info) != 0)
+            status = COPY_READ_ERROR;
+    } else {
+        outFlush();     // Anything printed before has to reach stdout ahead of the file
+        status = streamFd(info, outFd(), NULL);   // Send the file straight to stdout
     }
-
-    if (bytes_read < 0) {
+    if (status == COPY_WRITE_ERROR) {
+        myPrint("Error! write error\n");
+    } else if (status == COPY_READ_ERROR) {
         myPrint("Error! read error\n");
     }
     myPrint("\n");
     close(info); // Close the file
-    free(buf); // Free the dynamically allocated memory for the buffer
-}
\ No newline at end of file
+}
@@ -0,0 +1,484 @@
+/*
+ * copy_engine.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Tiered file copy used by cp. Each tier is only attempted if the
+ *			 one before it is unsupported for this pair of files, and every tier
+ *			 picks up from wherever the previous one stopped.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+#include "copy_engine.h"
+
+// Largest single request handed to copy_file_range/sendfile
+#define KERNEL_CHUNK 0x7ffff000
+
+/*
+    Description: Clones the source into the destination by sharing extents (btrfs, xfs,
+    ...). Nothing is read or written if this works.
+        Args:
+            int inFD, outFD : Source and destination descriptors
+        Returns:
+            bool-like int : 1 if the clone succeeded, 0 if another tier has to do the work
+*/
+static int tryReflink(int inFD, int outFD) {
+#ifdef FICLONE
+    return ioctl(outFD, FICLONE, inFD) == 0;
+#else
+    (void)inFD; (void)outFD;
+    return 0;
+#endif
+}
+
+/*
+    Description: Copies with copy_file_range, which stays entirely inside the kernel and
+    can be offloaded by the filesystem. Partial transfers are looped over.
+        Args:
+            int inFD, outFD : Source and destination descriptors
+            off_t remaining : Bytes left according to fstat
+            off_t *copied : Running total, advanced as data moves
+        Returns:
+            int : 1 if the file was finished, 0 if the next tier should continue
+*/
+static int tryCopyFileRange(int inFD, int outFD, off_t remaining, off_t *copied) {
+#ifdef __linux__
+    while (remaining > 0) {
+        size_t chunk = remaining > KERNEL_CHUNK ? KERNEL_CHUNK : (size_t)remaining;
+        ssize_t moved = copy_file_range(inFD, NULL, outFD, NULL, chunk, 0);
+        if (moved < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;   // EXDEV, ENOSYS, EINVAL, ... let the next tier take over
+        }
+        if (moved == 0) // Source is shorter than fstat claimed
+            return 1;
+        *copied += moved;
+        remaining -= moved;
+    }
+    return 1;
+#else
+    (void)inFD; (void)outFD; (void)remaining; (void)copied;
+    return 0;
+#endif
+}
+
+/*
+    Description: Copies with sendfile, which still avoids user space but works across
+    more filesystem pairs than copy_file_range on older kernels.
+        Args:
+            int inFD, outFD : Source and destination descriptors
+            off_t remaining : Bytes left according to fstat
+            off_t *copied : Running total, advanced as data moves
+        Returns:
+            int : 1 if the file was finished, 0 if the next tier should continue
+*/
+static int trySendfile(int inFD, int outFD, off_t remaining, off_t *copied) {
+#ifdef __linux__
+    while (remaining > 0) {
+        size_t chunk = remaining > KERNEL_CHUNK ? KERNEL_CHUNK : (size_t)remaining;
+        ssize_t moved = sendfile(outFD, inFD, NULL, chunk);
+        if (moved < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (moved == 0)
+            return 1;
+        *copied += moved;
+        remaining -= moved;
+    }
+    return 1;
+#else
+    (void)inFD; (void)outFD; (void)remaining; (void)copied;
+    return 0;
+#endif
+}
+
+/*
+    Description: Moves a file into a pipe with splice, so the pages go from the page cache
+    into the pipe buffer without being copied through user space.
+        Args:
+            int inFD, outFD : Source file and destination pipe
+            off_t remaining : Bytes left according to fstat
+            off_t *copied : Running total, advanced as data moves
+        Returns:
+            int : 1 if the file was finished, 0 if the next tier should continue
+*/
+static int trySplice(int inFD, int outFD, off_t remaining, off_t *copied) {
+#ifdef __linux__
+    while (remaining > 0) {
+        size_t chunk = remaining > KERNEL_CHUNK ? KERNEL_CHUNK : (size_t)remaining;
+        ssize_t moved = splice(inFD, NULL, outFD, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (moved == 0)
+            return 1;
+        *copied += moved;
+        remaining -= moved;
+    }
+    return 1;
+#else
+    (void)inFD; (void)outFD; (void)remaining; (void)copied;
+    return 0;
+#endif
+}
+
+/*
+    Description: Moves everything left in a pipe on to outFD with splice, which hands the
+    pipe's pages over (into another pipe) or writes them out (into a file or socket)
+    without a copy through user space.
+        Args:
+            int inFD, outFD : Source pipe and destination descriptor
+            off_t *copied : Running total, advanced as data moves
+        Returns:
+            int : 1 if the pipe was drained, 0 if the kernel refused before anything moved
+*/
+static int splicePipe(int inFD, int outFD, off_t *copied) {
+#ifdef __linux__
+    int moved_any = 0;
+    while (1) {
+        ssize_t moved = splice(inFD, NULL, outFD, NULL, KERNEL_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0) {
+            if (errno == EINTR)
+                continue;
+            // Terminals and O_APPEND files can't take splice, read/write carries on from here
+            return moved_any ? -1 : 0;
+        }
+        if (moved == 0)
+            return 1;
+        moved_any = 1;
+        *copied += moved;
+    }
+#else
+    (void)inFD; (void)outFD; (void)copied;
+    return 0;
+#endif
+}
+
+/*
+    Description: Maps the rest of the file and writes it out in as few write() calls as
+    the destination accepts. Used for terminals, where none of the kernel paths apply.
+        Args:
+            int inFD, outFD : Source file and destination descriptor
+            off_t remaining : Bytes left according to fstat
+            off_t *copied : Running total, advanced as data moves
+        Returns:
+            copy_status : COPY_OK, COPY_READ_ERROR if the file could not be mapped (the
+            caller falls back to read/write then), or COPY_WRITE_ERROR
+*/
+static copy_status writeMapped(int inFD, int outFD, off_t remaining, off_t *copied) {
+    off_t start = lseek(inFD, 0, SEEK_CUR);
+    if (start < 0)
+        return COPY_READ_ERROR;
+
+    // mmap offsets must be page aligned, so map from the page holding the current position
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t base = start - start % page;
+    size_t length = (size_t)(remaining + (start - base));
+    char *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, inFD, base);
+    if (map == MAP_FAILED)
+        return COPY_READ_ERROR;
+    madvise(map, length, MADV_SEQUENTIAL);
+
+    copy_status status = COPY_OK;
+    char *data = map + (start - base);
+    off_t done = 0;
+    while (done < remaining) {
+        ssize_t bytes_written = write(outFD, data + done, remaining - done);
+        if (bytes_written < 0) {
+            if (errno == EINTR)
+                continue;
+            status = COPY_WRITE_ERROR;
+            break;
+        }
+        done += bytes_written;
+    }
+    munmap(map, length);
+
+    *copied += done;
+    lseek(inFD, start + done, SEEK_SET);   // Keep the offset where read() would have left it
+    return status;
+}
+
+/*
+    Description: Last resort copy through a large user space buffer. Also the only tier
+    that reports errors, since it is the one that can tell reads and writes apart.
+        Args:
+            int inFD, outFD : Source and destination descriptors
+            off_t *copied : Running total, advanced as data moves
+        Returns:
+            copy_status : COPY_OK, COPY_READ_ERROR or COPY_WRITE_ERROR
+*/
+static copy_status copyBuffered(int inFD, int outFD, off_t *copied) {
+    char small[64 * 1024];  // Used if the large buffer can't be allocated
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    size_t size = COPY_BUFFER_SIZE;
+    copy_status status = COPY_OK;
+
+    if (buffer == NULL) {
+        buffer = small;
+        size = sizeof(small);
+    }
+
+    while (1) {
+        ssize_t bytes_read = read(inFD, buffer, size);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            status = COPY_READ_ERROR;
+            break;
+        }
+        if (bytes_read == 0)
+            break;
+
+        // Write out everything that was read, even if write() only takes part of it
+        ssize_t done = 0;
+        while (done < bytes_read) {
+            ssize_t bytes_written = write(outFD, buffer + done, bytes_read - done);
+            if (bytes_written < 0) {
+                if (errno == EINTR)
+                    continue;
+                status = COPY_WRITE_ERROR;
+                break;
+            }
+            done += bytes_written;
+        }
+        *copied += done;
+        if (status != COPY_OK)
+            break;
+    }
+
+    if (buffer != small)
+        free(buffer);
+    return status;
+}
+
+// Reads up to len bytes at offset, short only at the end of the file. Returns the count or -1.
+static ssize_t readFull(int fd, char *buffer, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(fd, buffer + done, len - done, offset + done);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+// Writes all of len bytes at offset, returns -1 on error
+static int writeFull(int fd, const char *buffer, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t put = pwrite(fd, buffer + done, len - done, offset + done);
+        if (put < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += put;
+    }
+    return 0;
+}
+
+/*
+    Description: Compares both files COPY_BUFFER_SIZE bytes per read and writes the
+    UPDATE_BLOCK_SIZE blocks of the source that don't match the destination. Both
+    files are local, so comparing the bytes with memcmp (vectorized in libc) is
+    cheaper than hashing each side and comparing the hashes.
+        Args:
+            int inFD, outFD : Source, destination open for reading and writing
+            off_t *end : Gets the source's length as read
+            off_t *written : Running total of bytes rewritten
+        Returns:
+            copy_status : COPY_OK, COPY_READ_ERROR or COPY_WRITE_ERROR
+*/
+static copy_status updateBlocks(int inFD, int outFD, off_t *end, off_t *written) {
+    char *src = malloc(2 * COPY_BUFFER_SIZE);
+    if (src == NULL)
+        return COPY_READ_ERROR;
+    char *dst = src + COPY_BUFFER_SIZE;
+    copy_status status = COPY_OK;
+    off_t offset = 0;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(inFD, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(outFD, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    while (1) {
+        ssize_t src_len = readFull(inFD, src, COPY_BUFFER_SIZE, offset);
+        ssize_t dst_len = src_len > 0 ? readFull(outFD, dst, src_len, offset) : 0;
+        if (src_len < 0 || dst_len < 0) {
+            status = COPY_READ_ERROR;
+            break;
+        }
+        if (src_len == 0)
+            break;
+
+        for (ssize_t block = 0; block < src_len; block += UPDATE_BLOCK_SIZE) {
+            size_t len = src_len - block < UPDATE_BLOCK_SIZE ? (size_t)(src_len - block) : UPDATE_BLOCK_SIZE;
+            // Past the destination's end there is nothing to compare against
+            if (block + (ssize_t)len <= dst_len && memcmp(src + block, dst + block, len) == 0)
+                continue;
+            if (writeFull(outFD, src + block, len, offset + block) != 0) {
+                status = COPY_WRITE_ERROR;
+                break;
+            }
+            *written += len;
+        }
+        offset += src_len;
+        if (status != COPY_OK || src_len < COPY_BUFFER_SIZE)
+            break;
+    }
+    *end = offset;
+    free(src);
+    return status;
+}
+
+copy_status updateFd(int inFD, int outFD, off_t *written) {
+    struct statx in_sx, out_sx;
+    off_t total = 0;
+    copy_status status;
+
+    if (statx(inFD, "", AT_EMPTY_PATH, STATX_SIZE | STATX_MTIME, &in_sx) != 0)
+        return COPY_READ_ERROR;
+    if (statx(outFD, "", AT_EMPTY_PATH, STATX_SIZE | STATX_MTIME, &out_sx) != 0)
+        return COPY_WRITE_ERROR;
+
+    if (in_sx.stx_size == out_sx.stx_size &&
+        in_sx.stx_mtime.tv_sec == out_sx.stx_mtime.tv_sec &&
+        in_sx.stx_mtime.tv_nsec == out_sx.stx_mtime.tv_nsec) {
+        if (written != NULL)
+            *written = 0;
+        return COPY_OK;
+    }
+
+    if (out_sx.stx_size == 0 || !S_ISREG(in_sx.stx_mode)) {
+        // Nothing to keep, a plain copy is cheaper than comparing
+        if (ftruncate(outFD, 0) != 0)
+            return COPY_WRITE_ERROR;
+        status = copyFd(inFD, outFD, &total);
+    } else {
+        off_t end = 0;
+        status = updateBlocks(inFD, outFD, &end, &total);
+        if (status == COPY_OK && (off_t)out_sx.stx_size > end && ftruncate(outFD, end) != 0)
+            status = COPY_WRITE_ERROR;
+    }
+
+    if (status == COPY_OK) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {in_sx.stx_mtime.tv_sec, in_sx.stx_mtime.tv_nsec}};
+        if (futimens(outFD, times) != 0)
+            status = COPY_WRITE_ERROR;
+    }
+    if (written != NULL)
+        *written = total;
+    return status;
+}
+
+copy_status copyFd(int inFD, int outFD, off_t *copied) {
+    struct stat st;
+    off_t total = 0;
+    copy_status status = COPY_OK;
+    int kernel_ok = 0;
+
+    // Kernel tiers need a real size up front, pipes and procfs files go straight to read/write
+    int sized = fstat(inFD, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+
+    if (sized) {
+        if (tryReflink(inFD, outFD)) {
+            if (copied != NULL)
+                *copied = st.st_size;
+            return COPY_OK;
+        }
+
+#ifdef __linux__
+        // Reserve the blocks in one go so the filesystem can lay the file out contiguously
+        fallocate(outFD, 0, 0, st.st_size);
+#endif
+        kernel_ok = tryCopyFileRange(inFD, outFD, st.st_size, &total);
+        if (!kernel_ok)
+            kernel_ok = trySendfile(inFD, outFD, st.st_size - total, &total);
+    }
+
+    // Pick up anything the kernel tiers did not move (or the whole file if they were skipped)
+    if (!kernel_ok || total >= st.st_size)
+        status = copyBuffered(inFD, outFD, &total);
+
+    // The source may have shrunk since fstat, don't leave preallocated zeros behind
+    if (sized && total < st.st_size && ftruncate(outFD, total) != 0 && status == COPY_OK)
+        status = COPY_WRITE_ERROR;
+
+    if (copied != NULL)
+        *copied = total;
+    return status;
+}
+
+copy_status streamFd(int inFD, int outFD, off_t *copied) {
+    struct stat in_st, out_st;
+    off_t total = 0;
+    copy_status status = COPY_OK;
+    int kernel_ok = 0;
+
+    int in_ok = fstat(inFD, &in_st) == 0;
+    int sized = in_ok && S_ISREG(in_st.st_mode) && in_st.st_size > 0;
+
+    if (in_ok && S_ISFIFO(in_st.st_mode)) {
+        int drained = splicePipe(inFD, outFD, &total);
+        if (drained != 0) {
+            if (copied != NULL)
+                *copied = total;
+            return drained > 0 ? COPY_OK : COPY_WRITE_ERROR;
+        }
+    }
+
+    if (sized && fstat(outFD, &out_st) == 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        // Ask for aggressive readahead, the whole file is about to be consumed front to back
+        posix_fadvise(inFD, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if (S_ISFIFO(out_st.st_mode)) {
+            kernel_ok = trySplice(inFD, outFD, in_st.st_size, &total);
+        } else if (S_ISREG(out_st.st_mode) || S_ISSOCK(out_st.st_mode)) {
+            kernel_ok = trySendfile(inFD, outFD, in_st.st_size, &total);
+        } else {
+            status = writeMapped(inFD, outFD, in_st.st_size - total, &total);
+            if (status == COPY_WRITE_ERROR) {
+                if (copied != NULL)
+                    *copied = total;
+                return status;
+            }
+            kernel_ok = status == COPY_OK;
+            status = COPY_OK;
+        }
+    }
+
+    // Anything left over (or the whole stream if it isn't a sized file) goes through read/write
+    if (!kernel_ok || total >= in_st.st_size)
+        status = copyBuffered(inFD, outFD, &total);
+
+    if (copied != NULL)
+        *copied = total;
+    return status;
+}
@@ -0,0 +1,52 @@
+/*
+ * copy_engine.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Moves the bytes of one open file into another as cheaply as the
+ *			 kernel allows. Tries a reflink clone first, then copy_file_range,
+ *			 then sendfile, and only then falls back to a large read/write loop.
+ *			 Also streams files onto stdout-like descriptors for cat, and
+ *			 brings an existing copy up to date by rewriting only the blocks
+ *			 that differ.
+ *
+ */
+
+#ifndef COPY_ENGINE_H_
+#define COPY_ENGINE_H_
+
+#include <sys/types.h>
+
+// Size of the buffer used by the read/write fallback
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+// Unit updateFd compares and rewrites, a one byte change costs one block of writes
+#define UPDATE_BLOCK_SIZE (64 * 1024)
+
+typedef enum
+{
+    COPY_OK = 0,
+    COPY_READ_ERROR,
+    COPY_WRITE_ERROR
+}copy_status;
+
+//Copies everything from inFD (starting at offset 0) into outFD, which should
+//be freshly truncated. The number of bytes moved is stored in copied if it is
+//not NULL. Only the status is returned, callers print their own messages.
+copy_status copyFd(int inFD, int outFD, off_t *copied);
+
+//Streams everything left in inFD (a file or a pipe) onto the current position of
+//outFD (a terminal, pipe, socket or file opened for output). Unlike copyFd the
+//destination is never cloned, preallocated or truncated.
+copy_status streamFd(int inFD, int outFD, off_t *copied);
+
+//Makes outFD (open for reading and writing) match inFD without rewriting what is
+//already there. When size and modification time agree the files are taken to be
+//the same and neither is read. Otherwise both are compared UPDATE_BLOCK_SIZE
+//bytes at a time, blocks that differ are written in place and a longer outFD is
+//truncated. outFD then gets inFD's modification time, so the next update of an
+//unchanged file stops at the first check. Bytes written go in written if not NULL.
+copy_status updateFd(int inFD, int outFD, off_t *written);
+
+
+#endif /* COPY_ENGINE_H_ */
@@ -0,0 +1,219 @@
+/*
+ * dispatch.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Open addressing hash table of built-ins. The table is kept at most
+ *			 half full, so a lookup is one hash and almost always one strcmp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "dispatch.h"
+#include "external.h"
+#include "jobs.h"
+#include "list_cache.h"
+#include "output.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "trace.h"
+
+static const builtin **slots = NULL;  // Hash table of registered entries, NULL when empty
+static size_t slot_count = 0;         // Always a power of two
+static size_t registered = 0;
+static const builtin **by_id = NULL;  // Entries in the order they were registered
+static _Thread_local int last_status; // What the last command returned, for the trace
+
+// FNV-1a, short command names hash in a handful of cycles
+static uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Places an entry into the table without checking for duplicates or growing
+static void insertSlot(const builtin **table, size_t size, const builtin *entry) {
+    size_t i = hashName(entry->name) & (size - 1);
+    while (table[i] != NULL) {
+        i = (i + 1) & (size - 1);
+    }
+    table[i] = entry;
+}
+
+// Doubles the table and re-inserts every entry
+static int growTable(void) {
+    size_t size = slot_count ? slot_count * 2 : 32;
+    const builtin **table = calloc(size, sizeof(*table));
+    if (table == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < slot_count; i++) {
+        if (slots[i] != NULL) {
+            insertSlot(table, size, slots[i]);
+        }
+    }
+    free(slots);
+    slots = table;
+    slot_count = size;
+    return 0;
+}
+
+int registerBuiltins(const builtin *table, int count) {
+    for (int i = 0; i < count; i++) {
+        if (lookupBuiltin(table[i].name) != NULL) {
+            return -1;
+        }
+        if ((registered + 1) * 2 > slot_count && growTable() != 0) {
+            return -1;
+        }
+        const builtin **ids = realloc(by_id, (registered + 1) * sizeof(*ids));
+        if (ids == NULL) {
+            return -1;
+        }
+        by_id = ids;
+        by_id[registered] = &table[i];
+        insertSlot(slots, slot_count, &table[i]);
+        registered++;
+    }
+    return 0;
+}
+
+const builtin *lookupBuiltin(const char *name) {
+    if (slot_count == 0) {
+        return NULL;
+    }
+    size_t i = hashName(name) & (slot_count - 1);
+    while (slots[i] != NULL) {
+        if (strcmp(slots[i]->name, name) == 0) {
+            return slots[i];
+        }
+        i = (i + 1) & (slot_count - 1);
+    }
+    return NULL;
+}
+
+int builtinCount(void) {
+    return (int)registered;
+}
+
+const builtin *builtinById(int id) {
+    return id >= 0 && (size_t)id < registered ? by_id[id] : NULL;
+}
+
+int builtinId(const builtin *entry) {
+    // Only a handful are registered, and callers look each name up once
+    for (size_t i = 0; i < registered; i++) {
+        if (by_id[i] == entry) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+bool arityOk(const builtin *entry, int num_args) {
+    return num_args >= entry->min_args && (entry->max_args == ARGS_UNLIMITED || num_args <= entry->max_args);
+}
+
+void printWrongNumArgs(void) {
+    outPrint("Error! Wrong number of arguments for command, please ensure proper formatting\n");
+}
+
+bool wrongNumArgs(int target_num, int token_num) {
+    if (token_num != target_num) {
+        printWrongNumArgs();
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool runArgv(int argc, char **argv) {
+    const builtin *entry = lookupBuiltin(argv[0]);
+    if (entry == NULL) {
+        // Not ours, maybe a program in PATH
+        int status;
+        if (statsEnabled) {
+            stats_sample sample;
+            statsStart(&sample);
+            status = runExternal(argc, argv);
+            statsStop(statsEntry("(external)"), &sample, status != 0);
+        } else {
+            status = runExternal(argc, argv);
+        }
+        if (listCacheEnabled) {
+            listCacheDirty();   // Whatever the program changed is only known from the events
+        }
+        if (status == EXTERNAL_NOT_FOUND) {
+            outPrintf("Error! Unrecognized command: %s \n", argv[0]);
+            status = 127;   // What a shell reports for a command it can't find
+        }
+        last_status = status;
+        return true;
+    }
+
+    // Check the arity from the table before handing over to the command
+    if (!arityOk(entry, argc - 1)) {
+        printWrongNumArgs();
+        last_status = 1;
+        return true;
+    }
+    return runBuiltin(entry, argc, argv);
+}
+
+bool runBuiltin(const builtin *entry, int argc, char **argv) {
+    if (entry->handler != NULL) {
+        if (statsEnabled) {
+            stats_sample sample;
+            statsStart(&sample);
+            last_status = entry->handler(argc, argv);
+            statsStop(statsEntry(entry->name), &sample, last_status != 0);
+        } else {
+            last_status = entry->handler(argc, argv);
+        }
+    }
+    return !(entry->flags & BUILTIN_EXIT);
+}
+
+static bool runCommand(command_line cmd_line) {
+    char **cmd_list = cmd_line.command_list; // Get the list containing the command and args if applicable
+    if (cmd_list == NULL) {
+        outPrint("Error! Invalid command_line structure\n");
+        return true;
+    }
+
+    char *command = cmd_list[0]; // Get the command
+    if (command == NULL) {
+        outPrint("Error! Invalid command\n");
+        return true;
+    }
+
+    if (isBackground(cmd_line)) {
+        jobStart(cmd_line);     // Runs on its own thread, back to the prompt right away
+        return true;
+    }
+    if (isPipeline(cmd_line)) {
+        bool running = runPipeline(cmd_line);   // Pipes and redirections, each stage comes back through runArgv
+        if (listCacheEnabled) {
+            listCacheDirty();   // Redirections may have created files
+        }
+        return running;
+    }
+    return runArgv(cmd_line.num_token - 1, cmd_list); // num_token also counts the terminating NULL
+}
+
+bool parseCommand(command_line cmd_line) {
+    if (!traceEnabled || cmd_line.command_list == NULL || cmd_line.command_list[0] == NULL) {
+        return runCommand(cmd_line);
+    }
+    trace_sample sample;
+    traceStart(&sample);
+    last_status = 0;
+    bool running = runCommand(cmd_line);
+    traceStop(&sample, cmd_line, last_status);
+    return running;
+}
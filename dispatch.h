@@ -0,0 +1,89 @@
+/*
+ * dispatch.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Command lookup for the pseudo shell. Built-ins register a table of
+ *			 entries (name, handler, arity, flags) and parseCommand finds them
+ *			 through a hash table, so lookup cost does not depend on how many
+ *			 commands exist.
+ *
+ */
+
+#ifndef DISPATCH_H_
+#define DISPATCH_H_
+
+#include <stdbool.h>
+#include "string_parser.h"
+
+// Flags describing how a built-in interacts with the rest of the shell
+#define BUILTIN_EXIT    0x1     // Stops the shell once it has run
+#define BUILTIN_CHDIR   0x2     // Changes the working directory
+
+// What a built-in touches, so the parallel scheduler can tell which commands may
+// overlap. Arguments starting with '-' are options and never count as paths.
+// Built-ins declaring none of these are run with nothing else in flight.
+#define BUILTIN_NO_FILES    0x4     // Touches no files at all
+#define BUILTIN_READS       0x8     // Reads every path argument (the working directory if none)
+#define BUILTIN_WRITES      0x10    // Creates, changes or removes every path argument
+#define BUILTIN_WRITES_LAST 0x20    // Reads every path argument but the last, which it writes
+
+// max_args value for commands taking any number of arguments
+#define ARGS_UNLIMITED  -1
+
+//Handlers get the command name in argv[0] and a NULL at argv[argc], like main().
+//They return 0 on success and nonzero if the command failed.
+typedef int (*builtin_handler)(int argc, char **argv);
+
+typedef struct
+{
+    const char *name;
+    builtin_handler handler;
+    int min_args;           // Arguments after the command name
+    int max_args;           // ARGS_UNLIMITED for no limit
+    unsigned flags;
+}builtin;
+
+//Registers count entries from table, the table must outlive the shell. Modules
+//normally call this from a constructor so they register themselves. Returns 0,
+//or -1 if a name is already taken or memory ran out.
+int registerBuiltins(const builtin *table, int count);
+
+//Finds the entry for name, or NULL if no built-in has that name
+const builtin *lookupBuiltin(const char *name);
+
+//Registered built-ins are numbered from 0 in registration order. Modules register
+//from constructors, so the order follows the link order and only changes when the
+//shell is rebuilt. The compiled script cache stores these IDs and keys its files
+//on every entry in ID order, so a rebuild that reorders them recompiles scripts.
+int builtinCount(void);
+
+//The entry numbered id, or NULL if there is none
+const builtin *builtinById(int id);
+
+//The number of entry, or -1 if it isn't registered
+int builtinId(const builtin *entry);
+
+//Whether entry takes num_args arguments after its name
+bool arityOk(const builtin *entry, int num_args);
+
+//Prints the standard message when a command gets the wrong number of tokens
+bool wrongNumArgs(int target_num, int token_num);
+
+//Prints that same message unconditionally, for handlers that check their own options
+void printWrongNumArgs(void);
+
+//Runs a single command, returns false once the shell has been asked to exit
+bool parseCommand(command_line cmd_line);
+
+//Runs the built-in argv[0] with argc words (argv[argc] is NULL) as they are, no
+//pipes or redirections are looked for. Names that aren't built-ins are run as
+//programs from PATH (see external.h). Returns false once exit has run.
+bool runArgv(int argc, char **argv);
+
+//Runs entry with argv, whose arity has already been checked. Returns false once
+//exit has run.
+bool runBuiltin(const builtin *entry, int argc, char **argv);
+
+
+#endif /* DISPATCH_H_ */
@@ -0,0 +1,330 @@
+/*
+ * external.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Running programs that aren't built-ins. See external.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "external.h"
+#include "output.h"
+#include "session.h"
+
+extern char **environ;
+
+typedef struct
+{
+    char *name;     // NULL for an empty slot
+    char *path;     // Where name was found in PATH
+}path_entry;
+
+// Names found in PATH, shared by every thread. Misses aren't kept, so a program
+// installed later is found without waiting for PATH to change.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static path_entry *slots = NULL;    // Open addressing, at most half full
+static size_t slot_count = 0;       // Always a power of two
+static size_t cached = 0;
+static char *cached_for = NULL;     // PATH the entries were found with
+
+// FNV-1a, as for the built-in table
+static uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Drops every entry, called with the lock held
+static void clearCache(void) {
+    for (size_t i = 0; i < slot_count; i++) {
+        free(slots[i].name);
+        free(slots[i].path);
+    }
+    free(slots);
+    slots = NULL;
+    slot_count = 0;
+    cached = 0;
+}
+
+// Index of name's slot, or of the empty slot it would go in. The table must exist.
+static size_t findSlot(const char *name) {
+    size_t i = hashName(name) & (slot_count - 1);
+    while (slots[i].name != NULL && strcmp(slots[i].name, name) != 0) {
+        i = (i + 1) & (slot_count - 1);
+    }
+    return i;
+}
+
+// Doubles the table, with the lock held. Returns -1 if memory ran out.
+static int growCache(void) {
+    size_t size = slot_count ? slot_count * 2 : 64;
+    path_entry *table = calloc(size, sizeof(*table));
+    if (table == NULL) {
+        return -1;
+    }
+    path_entry *old = slots;
+    size_t old_count = slot_count;
+    slots = table;
+    slot_count = size;
+    for (size_t i = 0; i < old_count; i++) {
+        if (old[i].name != NULL) {
+            slots[findSlot(old[i].name)] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// Remembers where name was found, with the lock held. Failing only costs a search next time.
+static void cacheInsert(const char *name, const char *path) {
+    if ((cached + 1) * 2 > slot_count && growCache() != 0) {
+        return;
+    }
+    size_t i = findSlot(name);
+    if (slots[i].name != NULL) {
+        return;     // Another thread found it first
+    }
+    char *name_copy = strdup(name);
+    char *path_copy = strdup(path);
+    if (name_copy == NULL || path_copy == NULL) {
+        free(name_copy);
+        free(path_copy);
+        return;
+    }
+    slots[i].name = name_copy;
+    slots[i].path = path_copy;
+    cached++;
+}
+
+// Forgets name, with the lock held. Later entries of its run are moved up so none is lost.
+static void cacheRemove(const char *name) {
+    if (slot_count == 0) {
+        return;
+    }
+    size_t i = findSlot(name);
+    if (slots[i].name == NULL) {
+        return;
+    }
+    free(slots[i].name);
+    free(slots[i].path);
+    slots[i].name = NULL;
+    slots[i].path = NULL;
+    cached--;
+    for (size_t j = (i + 1) & (slot_count - 1); slots[j].name != NULL; j = (j + 1) & (slot_count - 1)) {
+        path_entry entry = slots[j];
+        slots[j].name = NULL;
+        slots[j].path = NULL;
+        slots[findSlot(entry.name)] = entry;
+    }
+}
+
+static const char *searchPath(void) {
+    const char *path = getenv("PATH");
+    return path != NULL ? path : EXTERNAL_DEFAULT_PATH;
+}
+
+/*
+    Description: Looks for an executable regular file called name in each directory
+    of search. Empty and relative entries are skipped: they would depend on the
+    directory of whichever session asked, so they can't be shared through the cache.
+        Args:
+            const char *name : Command name, without a /
+            const char *search : Colon separated directories
+            char *path : Gets the full path of the first match
+            size_t size : Bytes available at path
+        Returns:
+            int : 0 if found, -1 if not
+*/
+static int searchDirs(const char *name, const char *search, char *path, size_t size) {
+    size_t name_len = strlen(name);
+    while (*search != '\0') {
+        const char *end = strchr(search, ':');
+        size_t dir_len = end != NULL ? (size_t)(end - search) : strlen(search);
+        if (dir_len > 0 && search[0] == '/' && dir_len + name_len + 2 <= size) {
+            memcpy(path, search, dir_len);
+            path[dir_len] = '/';
+            memcpy(path + dir_len + 1, name, name_len + 1);
+            struct stat st;
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+                return 0;
+            }
+        }
+        if (end == NULL) {
+            break;
+        }
+        search = end + 1;
+    }
+    return -1;
+}
+
+int resolveExternal(const char *name, char *path, size_t size) {
+    if (name[0] == '\0' || strchr(name, '/') != NULL) {
+        return -1;
+    }
+    const char *search = searchPath();
+
+    pthread_mutex_lock(&cache_lock);
+    if (cached_for == NULL || strcmp(cached_for, search) != 0) {
+        clearCache();       // PATH changed, everything found through the old one may be wrong
+        free(cached_for);
+        cached_for = strdup(search);
+    }
+    if (slot_count > 0) {
+        size_t i = findSlot(name);
+        if (slots[i].name != NULL && strlen(slots[i].path) < size) {
+            strcpy(path, slots[i].path);
+            pthread_mutex_unlock(&cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Search without the lock, other threads' hits don't have to wait on our misses
+    if (searchDirs(name, search, path, size) != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    if (cached_for != NULL && strcmp(cached_for, search) == 0) {
+        cacheInsert(name, path);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// Drops name from the cache after the program it pointed at turned out to be gone
+static void forgetExternal(const char *name) {
+    pthread_mutex_lock(&cache_lock);
+    cacheRemove(name);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+    Description: Starts path with the calling thread's session directory, input and
+    output. The child gets default signal handling and no blocked signals whatever
+    the shell has set up for itself (SIGPIPE ignored by pipelines, SIGUSR1 blocked
+    for stats, SIGINT and SIGTERM blocked by the daemon).
+        Args:
+            const char *path : Program to run
+            char **argv : Its arguments, NULL terminated
+            int out : Descriptor to give it as standard output
+            pid_t *pid : Gets the child's process ID
+        Returns:
+            int : 0, or the error posix_spawn failed with
+*/
+static int spawnChild(const char *path, char **argv, int out, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+        return err;
+    }
+    err = posix_spawnattr_init(&attr);
+    if (err != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return err;
+    }
+
+    sigset_t none, defaults;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    // Relative program paths are looked up after the chdir, from the session's directory
+    err = posix_spawn_file_actions_addfchdir_np(&actions, cwdFd());
+    if (err == 0 && inFd() != STDIN_FILENO) {
+        err = posix_spawn_file_actions_adddup2(&actions, inFd(), STDIN_FILENO);
+    }
+    if (err == 0 && out != STDOUT_FILENO) {
+        err = posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    }
+    if (err == 0) {
+        err = posix_spawn(pid, path, &actions, &attr, argv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+// Waits for pid and turns how it ended into a shell style exit status
+static int waitChild(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return 127;
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+int runExternal(int argc, char **argv) {
+    (void)argc;
+    char found[PATH_MAX];
+    const char *path = argv[0];
+    int from_cache = strchr(argv[0], '/') == NULL;
+    if (from_cache && resolveExternal(argv[0], found, sizeof(found)) != 0) {
+        return EXTERNAL_NOT_FOUND;
+    }
+    if (from_cache) {
+        path = found;
+    }
+
+    // Whatever the shell printed so far goes out before the child's output
+    outFlush();
+    int out = outFd();
+    int ends[2] = {-1, -1};
+    if (out == OUTPUT_MEMORY) {
+        if (pipe2(ends, O_CLOEXEC) != 0) {
+            outPrintf("Error! can't run %s\n", argv[0]);
+            return 127;
+        }
+        out = ends[1];
+    }
+
+    pid_t pid;
+    int err = spawnChild(path, argv, out, &pid);
+    if (err == ENOENT && from_cache) {
+        // Removed since it was cached, look again in case it moved along PATH
+        forgetExternal(argv[0]);
+        if (resolveExternal(argv[0], found, sizeof(found)) == 0) {
+            err = spawnChild(found, argv, out, &pid);
+        }
+    }
+    if (ends[1] >= 0) {
+        close(ends[1]);     // Only the child writes now, so we see the end of its output
+        if (err == 0) {
+            outCopyFd(ends[0]);
+        }
+        close(ends[0]);
+    }
+    if (err == ENOENT) {
+        return EXTERNAL_NOT_FOUND;
+    }
+    if (err != 0) {
+        outPrintf("Error! can't run %s\n", argv[0]);
+        return 127;
+    }
+    return waitChild(pid);
+}
@@ -0,0 +1,38 @@
+/*
+ * external.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Programs outside the shell. A command that isn't a built-in is
+ *			 looked up in PATH and started with posix_spawn, which glibc runs
+ *			 on clone(CLONE_VM | CLONE_VFORK): the child shares our memory
+ *			 until it execs, so starting it costs the same however large the
+ *			 shell has grown, where fork would copy every page table first.
+ *			 Where a name was found is remembered in a hash table, which is
+ *			 thrown away whenever PATH is no longer the string it was built
+ *			 from. The child runs in the session's directory with the calling
+ *			 thread's input and output, so it works in pipelines and with >.
+ *
+ */
+
+#ifndef EXTERNAL_H_
+#define EXTERNAL_H_
+
+#include <stddef.h>
+
+#define EXTERNAL_NOT_FOUND  -1      // No such program, runExternal printed nothing
+#define EXTERNAL_DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"   // Searched when PATH isn't set
+
+//Runs the program argv[0] with argv as its arguments and waits for it. Names
+//with a / are taken as paths from the session's directory, anything else is
+//searched for in PATH. Returns the program's exit status (128 plus the signal
+//number if one killed it), 127 after printing an error if it couldn't be
+//started, or EXTERNAL_NOT_FOUND.
+int runExternal(int argc, char **argv);
+
+//Where name would be run from, copied into path (size bytes). Returns 0, or -1
+//if PATH has no executable of that name.
+int resolveExternal(const char *name, char *path, size_t size);
+
+
+#endif /* EXTERNAL_H_ */
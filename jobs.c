@@ -0,0 +1,398 @@
+/*
+ * jobs.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Background jobs and the jobs and wait built-ins. See jobs.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "jobs.h"
+#include "copy_engine.h"
+#include "dispatch.h"
+#include "output.h"
+#include "session.h"
+#include "trace.h"
+
+typedef struct shell_job
+{
+    int id;
+    char **argv;                // The command without its "&", words copied after the pointers
+    int argc;
+    char *text;                 // The words joined by spaces, for jobs and Done lines
+    int out_fd;                 // Memory backed file holding the job's output
+    int in_fd;                  // /dev/null, a job never reads the terminal
+    output_stream out;
+    shell_session session;
+    int done;                   // Guarded by jobs_lock
+    job_table *owner;
+    struct shell_job *next_done;
+}shell_job;
+
+// Guarded by jobs_lock, but for done_fd which never changes once the table is made
+struct job_table
+{
+    shell_job *slots[JOBS_MAX];     // Indexed by id - 1, running or not yet reported
+    shell_job *done_head;           // Finished, oldest first, waiting for jobsNotify
+    shell_job *done_tail;
+    int done_fd;                    // Counts jobs put on the done list
+    int refs;                       // The owner while it holds the table, plus one per job
+    int released;                   // The owner is gone, finished jobs free themselves
+};
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+static job_table shell_table = { .done_fd = -1, .refs = 1 };     // The shell's own, opened at startup
+static _Thread_local job_table *current_table = NULL;
+
+static job_table *currentTable(void) {
+    return current_table != NULL ? current_table : &shell_table;
+}
+
+bool isBackground(command_line cmd) {
+    int argc = cmd.num_token - 1;
+    return argc > 0 && strcmp(cmd.command_list[argc - 1], "&") == 0;
+}
+
+/*
+    Description: Makes a job of the first argc words of argv. The words are copied,
+    the line they came from is reused as soon as the prompt comes back.
+        Args:
+            int argc : Words to keep
+            char **argv : The command
+        Returns:
+            shell_job* : The job with its output file open, NULL on failure
+*/
+static shell_job *newJob(int argc, char **argv) {
+    size_t chars = 0;
+    for (int i = 0; i < argc; i++) {
+        chars += strlen(argv[i]) + 1;
+    }
+    shell_job *job = calloc(1, sizeof(shell_job));
+    char **words = malloc((argc + 1) * sizeof(char *) + chars);
+    char *text = malloc(chars);
+    if (job == NULL || words == NULL || text == NULL) {
+        free(job);
+        free(words);
+        free(text);
+        return NULL;
+    }
+
+    char *copy = (char *)(words + argc + 1);
+    char *joined = text;
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+        memcpy(copy, argv[i], len + 1);
+        words[i] = copy;
+        copy += len + 1;
+        memcpy(joined, argv[i], len);
+        joined[len] = i + 1 < argc ? ' ' : '\0';
+        joined += len + 1;
+    }
+    words[argc] = NULL;
+    job->argv = words;
+    job->argc = argc;
+    job->text = text;
+
+    job->out_fd = memfd_create("pseudo-shell-job", MFD_CLOEXEC);
+    job->in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (job->out_fd < 0 || job->in_fd < 0 || sessionClone(&job->session, currentSession()) != 0) {
+        if (job->out_fd >= 0) close(job->out_fd);
+        if (job->in_fd >= 0) close(job->in_fd);
+        free(words);
+        free(text);
+        free(job);
+        return NULL;
+    }
+    outInit(&job->out, job->out_fd, OUTPUT_FULL);
+    return job;
+}
+
+static void freeJob(shell_job *job) {
+    close(job->out_fd);
+    close(job->in_fd);
+    free(job->argv);
+    free(job->text);
+    free(job);
+}
+
+static void freeTable(job_table *table) {
+    close(table->done_fd);
+    free(table);
+}
+
+static void *jobThread(void *arg) {
+    shell_job *job = arg;
+    sessionUse(&job->session);
+    outUse(&job->out);
+    inUse(job->in_fd);
+    jobsUse(job->owner);
+    if (traceEnabled)
+        traceSession(TRACE_NO_SESSION);    // Its line was recorded when it was started
+    parseCommand((command_line){job->argv, job->argc + 1});     // exit in a job does nothing
+    outClose(&job->out);
+    outUse(NULL);
+    inUse(-1);
+    sessionUse(NULL);
+    jobsUse(NULL);
+    sessionFree(&job->session);
+
+    job_table *table = job->owner;
+    pthread_mutex_lock(&jobs_lock);
+    if (table->released) {
+        // Nobody is left to report it to
+        table->slots[job->id - 1] = NULL;
+        int last = --table->refs == 0;
+        pthread_mutex_unlock(&jobs_lock);
+        freeJob(job);
+        if (last)
+            freeTable(table);
+        return NULL;
+    }
+    job->done = 1;
+    job->next_done = NULL;
+    if (table->done_tail != NULL) {
+        table->done_tail->next_done = job;
+    } else {
+        table->done_head = job;
+    }
+    table->done_tail = job;
+    pthread_cond_broadcast(&job_finished);
+    uint64_t one = 1;       // Under the lock, the owner may release the table as soon as it is dropped
+    if (write(table->done_fd, &one, sizeof(one)) != sizeof(one)) {
+        // Only fails if the counter is full, the job is reported all the same
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return NULL;
+}
+
+void jobStart(command_line cmd) {
+    int argc = cmd.num_token - 2;   // Without the "&"
+    if (argc <= 0) {
+        outPrint("Error! Invalid command\n");
+        return;
+    }
+    job_table *table = currentTable();
+    shell_job *job = table->done_fd >= 0 ? newJob(argc, cmd.command_list) : NULL;
+    if (job == NULL) {
+        outPrint("Error! can't start background job\n");
+        return;
+    }
+    job->owner = table;
+
+    pthread_mutex_lock(&jobs_lock);
+    int slot = 0;
+    while (slot < JOBS_MAX && table->slots[slot] != NULL) {
+        slot++;
+    }
+    if (slot == JOBS_MAX) {
+        pthread_mutex_unlock(&jobs_lock);
+        sessionFree(&job->session);
+        freeJob(job);
+        outPrint("Error! too many background jobs\n");
+        return;
+    }
+    job->id = slot + 1;
+    table->slots[slot] = job;
+    table->refs++;
+    pthread_mutex_unlock(&jobs_lock);
+
+    outPrintf("[%d] %s\n", job->id, job->text);
+    outFlush();     // The number comes before anything the job prints
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, jobThread, job) != 0) {
+        pthread_mutex_lock(&jobs_lock);
+        table->slots[slot] = NULL;
+        table->refs--;      // The owner still holds it
+        pthread_mutex_unlock(&jobs_lock);
+        sessionFree(&job->session);
+        freeJob(job);
+        outPrint("Error! can't start background job\n");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+    Description: Prints what a finished job wrote, ending it with a newline if it
+    didn't, so the Done line and the next prompt start on lines of their own.
+        Args:
+            shell_job *job : A finished job, no longer in the table
+        Returns:
+            N/A
+*/
+static void reportJob(shell_job *job) {
+    off_t size = lseek(job->out_fd, 0, SEEK_END);
+    if (size > 0 && lseek(job->out_fd, 0, SEEK_SET) == 0) {
+        outFlush();
+        if (outFd() == OUTPUT_MEMORY) {
+            outCopyFd(job->out_fd);
+        } else {
+            streamFd(job->out_fd, outFd(), NULL);
+        }
+        char last;
+        if (pread(job->out_fd, &last, 1, size - 1) == 1 && last != '\n') {
+            outPrint("\n");
+        }
+    }
+    outPrintf("[%d] Done  %s\n", job->id, job->text);
+}
+
+// Takes everything off the done list and reports it. A job is on the list before it
+// bumps the eventfd, so whoever reads the count always finds the job behind it.
+static void reportFinished(job_table *table) {
+    pthread_mutex_lock(&jobs_lock);
+    shell_job *finished = table->done_head;
+    table->done_head = table->done_tail = NULL;
+    for (shell_job *job = finished; job != NULL; job = job->next_done) {
+        table->slots[job->id - 1] = NULL;
+        table->refs--;      // The owner still holds it
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    while (finished != NULL) {
+        shell_job *next = finished->next_done;
+        reportJob(finished);
+        freeJob(finished);
+        finished = next;
+    }
+    outFlush();
+}
+
+void jobsNotify(void) {
+    job_table *table = currentTable();
+    uint64_t count;
+    if (table->done_fd < 0 || read(table->done_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;     // Nothing finished, the usual case at a prompt
+    }
+    reportFinished(table);
+}
+
+// Blocks until job id of table (or every one of its jobs, for 0) has finished. Returns -1 if there is no such job.
+static int waitFor(job_table *table, int id) {
+    pthread_mutex_lock(&jobs_lock);
+    if (id > 0 && (id > JOBS_MAX || table->slots[id - 1] == NULL)) {
+        pthread_mutex_unlock(&jobs_lock);
+        return -1;
+    }
+    while (1) {
+        int pending = 0;
+        for (int i = 0; i < JOBS_MAX; i++) {
+            if (table->slots[i] != NULL && !table->slots[i]->done && (id == 0 || i == id - 1)) {
+                pending = 1;
+                break;
+            }
+        }
+        if (!pending) {
+            break;
+        }
+        pthread_cond_wait(&job_finished, &jobs_lock);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return 0;
+}
+
+void jobsFinish(void) {
+    waitFor(currentTable(), 0);
+    reportFinished(currentTable());
+}
+
+job_table *jobsCreate(void) {
+    job_table *table = calloc(1, sizeof(job_table));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (table->done_fd < 0) {
+        free(table);
+        return NULL;
+    }
+    table->refs = 1;
+    return table;
+}
+
+void jobsRelease(job_table *table) {
+    pthread_mutex_lock(&jobs_lock);
+    table->released = 1;
+    shell_job *finished = table->done_head;
+    table->done_head = table->done_tail = NULL;
+    for (shell_job *job = finished; job != NULL; job = job->next_done) {
+        table->slots[job->id - 1] = NULL;
+        table->refs--;
+    }
+    int last = --table->refs == 0;
+    pthread_mutex_unlock(&jobs_lock);
+
+    while (finished != NULL) {
+        shell_job *next = finished->next_done;
+        freeJob(finished);
+        finished = next;
+    }
+    if (last) {
+        freeTable(table);
+    }
+}
+
+void jobsUse(job_table *table) {
+    current_table = table;
+}
+
+static int runJobs(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    job_table *table = currentTable();
+    reportFinished(table);  // Finished ones are reported with their output rather than listed
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < JOBS_MAX; i++) {
+        shell_job *job = table->slots[i];
+        if (job != NULL) {
+            outPrintf("[%d] %s  %s\n", job->id, job->done ? "Done" : "Running", job->text);
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    return 0;
+}
+
+static int runWait(int argc, char **argv) {
+    int id = 0;
+    if (argc == 2) {
+        char *end;
+        id = (int)strtol(argv[1][0] == '%' ? argv[1] + 1 : argv[1], &end, 10);
+        if (*end != '\0' || id <= 0) {
+            outPrint("Error! no such job\n");
+            return 1;
+        }
+    }
+    if (waitFor(currentTable(), id) != 0) {
+        outPrint("Error! no such job\n");
+        return 1;
+    }
+    reportFinished(currentTable());   // The eventfd may not have been bumped yet, the list is already right
+    return 0;
+}
+
+static const builtin job_builtins[] = {
+    /* name     handler   min  max  flags */
+    { "jobs",   runJobs,  0,   0,   BUILTIN_NO_FILES },
+    { "wait",   runWait,  0,   1,   0 },     // Waits on everything, so nothing may run beside it
+};
+
+__attribute__((constructor))
+static void registerJobBuiltins(void) {
+    shell_table.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);     // Before any thread could start a job
+    registerBuiltins(job_builtins, sizeof(job_builtins) / sizeof(job_builtins[0]));
+}
@@ -0,0 +1,56 @@
+/*
+ * jobs.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Background jobs. A command ending in a "&" word runs on a thread
+ *			 of its own, in a copy of the session, while the shell goes back to
+ *			 its prompt. The job's output is kept in a memory backed file and
+ *			 printed whole once the job is done, so it never lands in the
+ *			 middle of a foreground line. Finished jobs queue themselves and
+ *			 bump an eventfd; jobsNotify, called before every prompt, costs one
+ *			 non-blocking read when nothing has finished. The jobs built-in
+ *			 lists them and wait blocks until they are done.
+ *
+ *			 Jobs belong to a job table: the shell has one, and every daemon
+ *			 client gets its own, so clients only ever see their own jobs.
+ *
+ */
+
+#ifndef JOBS_H_
+#define JOBS_H_
+
+#include <stdbool.h>
+#include "string_parser.h"
+
+#define JOBS_MAX 64     // Jobs running or waiting to be reported at once, per table
+
+typedef struct job_table job_table;
+
+//Whether cmd ends in a "&" word
+bool isBackground(command_line cmd);
+
+//Starts cmd without its "&" as job, and prints its number. Prints an error if
+//JOBS_MAX jobs are already around or the job couldn't be set up.
+void jobStart(command_line cmd);
+
+//Prints the output and a Done line for every job that finished since the last
+//call, in the order they finished. Cheap when there is nothing to report.
+void jobsNotify(void);
+
+//Waits for every job to finish, then reports them, for when the shell exits
+void jobsFinish(void);
+
+//A job table for an owner other than the shell, NULL if it couldn't be made
+job_table *jobsCreate(void);
+
+//Gives up the owner's hold on table. Jobs still running finish unreported, the
+//table goes with the last of them.
+void jobsRelease(job_table *table);
+
+//Makes table the one the calling thread starts, lists and reports jobs in.
+//NULL goes back to the shell's own.
+void jobsUse(job_table *table);
+
+
+#endif /* JOBS_H_ */
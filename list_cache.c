@@ -0,0 +1,564 @@
+/*
+ * list_cache.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Directory listing cache kept up to date with inotify. See list_cache.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "list_cache.h"
+#include "listing.h"
+#include "output.h"
+#include "session.h"
+
+#define EVENT_BUFFER_SIZE (64 * 1024)   // Bytes of inotify events taken per read
+#define MIN_INDEX_SIZE 16
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+// Text ls prints for a directory. Kept alive by the directory and by whoever is printing it.
+typedef struct
+{
+    int refs;               // Guarded by cache_lock
+    size_t len;
+    char data[];
+}rendered_text;
+
+typedef struct cached_dir
+{
+    dev_t dev;
+    ino_t ino;
+    int wd;                 // Watch descriptor, -1 once the kernel has dropped the watch
+    uint64_t ticket;        // Nonzero while the names are still being read
+    int raced;              // An event came in before the names did
+    char **names;           // Directory order, NULL where an entry was removed
+    size_t count;           // Slots used in names, holes included
+    size_t cap;
+    size_t live;
+    uint32_t *index;        // Open addressing on the name hash, holds position + 1, 0 is empty
+    size_t index_cap;       // Power of two, always more than twice count
+    rendered_text *text[2]; // Plain and sorted, built the first time they are asked for
+    size_t bytes;
+    struct cached_dir *prev;
+    struct cached_dir *next;    // Most recently listed first
+}cached_dir;
+
+int listCacheEnabled = 0;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_dir *lru_head = NULL;
+static cached_dir *lru_tail = NULL;
+static size_t num_dirs = 0;
+static size_t total_bytes = 0;
+static uint64_t next_ticket = 1;
+static int notify_fd = -1;
+static atomic_int dirty;                        // Events must be read before the next lookup
+static char event_buf[EVENT_BUFFER_SIZE]        // Guarded by cache_lock
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+
+static uint64_t hashName(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void charge(cached_dir *dir, long delta) {
+    dir->bytes += delta;
+    total_bytes += delta;
+}
+
+static void releaseText(rendered_text *text) {
+    if (text != NULL && --text->refs == 0) {
+        free(text);
+    }
+}
+
+// Forgets the rendered listings, after the names changed
+static void dropTexts(cached_dir *dir) {
+    for (int i = 0; i < 2; i++) {
+        if (dir->text[i] != NULL) {
+            charge(dir, -(long)(sizeof(rendered_text) + dir->text[i]->len));
+            releaseText(dir->text[i]);
+            dir->text[i] = NULL;
+        }
+    }
+}
+
+static void unlinkDir(cached_dir *dir) {
+    if (dir->prev != NULL) dir->prev->next = dir->next;
+    else lru_head = dir->next;
+    if (dir->next != NULL) dir->next->prev = dir->prev;
+    else lru_tail = dir->prev;
+    dir->prev = dir->next = NULL;
+}
+
+static void pushDir(cached_dir *dir) {
+    dir->next = lru_head;
+    if (lru_head != NULL) lru_head->prev = dir;
+    lru_head = dir;
+    if (lru_tail == NULL) lru_tail = dir;
+}
+
+static void freeDir(cached_dir *dir) {
+    unlinkDir(dir);
+    if (dir->wd >= 0) {
+        inotify_rm_watch(notify_fd, dir->wd);
+    }
+    dropTexts(dir);
+    for (size_t i = 0; i < dir->count; i++) {
+        free(dir->names[i]);
+    }
+    free(dir->names);
+    free(dir->index);
+    total_bytes -= dir->bytes;
+    num_dirs--;
+    free(dir);
+}
+
+// Drops the least recently listed directories until the cache is back under its limits
+static void evict(void) {
+    while (lru_tail != NULL && (num_dirs > LIST_CACHE_MAX_DIRS || total_bytes > LIST_CACHE_MAX_BYTES)) {
+        freeDir(lru_tail);
+    }
+}
+
+// The lists are at most LIST_CACHE_MAX_DIRS long, a scan costs less than the hashing would
+static cached_dir *findDir(dev_t dev, ino_t ino) {
+    for (cached_dir *dir = lru_head; dir != NULL; dir = dir->next) {
+        if (dir->ino == ino && dir->dev == dev) return dir;
+    }
+    return NULL;
+}
+
+static cached_dir *findWatch(int wd) {
+    for (cached_dir *dir = lru_head; dir != NULL; dir = dir->next) {
+        if (dir->wd == wd) return dir;
+    }
+    return NULL;
+}
+
+static cached_dir *findTicket(uint64_t ticket) {
+    for (cached_dir *dir = lru_head; dir != NULL; dir = dir->next) {
+        if (dir->ticket == ticket) return dir;
+    }
+    return NULL;
+}
+
+// Position of name in dir->names, -1 if it isn't there
+static long findName(const cached_dir *dir, const char *name) {
+    size_t mask = dir->index_cap - 1;
+    for (size_t i = hashName(name) & mask;; i = (i + 1) & mask) {
+        uint32_t slot = dir->index[i];
+        if (slot == 0) return -1;
+        const char *entry = dir->names[slot - 1];
+        if (entry != NULL && strcmp(entry, name) == 0) return (long)slot - 1;
+    }
+}
+
+/*
+    Description: Squeezes the holes left by removed names out of the name array and
+    rebuilds the index at a size that leaves room for as many names again.
+        Args:
+            cached_dir *dir : Directory whose names and index are rebuilt
+        Returns:
+            int : 0, or -1 if memory ran out (dir is left as it was)
+*/
+static int rebuildIndex(cached_dir *dir) {
+    size_t index_cap = MIN_INDEX_SIZE;
+    while (index_cap < dir->live * 4) index_cap *= 2;
+    uint32_t *index = calloc(index_cap, sizeof(uint32_t));
+    if (index == NULL) {
+        return -1;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < dir->count; i++) {
+        if (dir->names[i] != NULL) {
+            dir->names[kept++] = dir->names[i];
+        }
+    }
+    dir->count = kept;
+    for (size_t i = 0; i < kept; i++) {
+        size_t pos = hashName(dir->names[i]) & (index_cap - 1);
+        while (index[pos] != 0) pos = (pos + 1) & (index_cap - 1);
+        index[pos] = (uint32_t)i + 1;
+    }
+    charge(dir, ((long)index_cap - (long)dir->index_cap) * (long)sizeof(uint32_t));
+    free(dir->index);
+    dir->index = index;
+    dir->index_cap = index_cap;
+    return 0;
+}
+
+// Adds name if it isn't listed yet. Returns 0, or -1 if memory ran out.
+static int addName(cached_dir *dir, const char *name) {
+    if (findName(dir, name) >= 0) {
+        return 0;
+    }
+    if ((dir->count + 1) * 2 > dir->index_cap && rebuildIndex(dir) != 0) {
+        return -1;
+    }
+    if (dir->count == dir->cap) {
+        size_t cap = dir->cap ? dir->cap * 2 : MIN_INDEX_SIZE;
+        char **grown = realloc(dir->names, cap * sizeof(char *));
+        if (grown == NULL) return -1;
+        charge(dir, (long)((cap - dir->cap) * sizeof(char *)));
+        dir->names = grown;
+        dir->cap = cap;
+    }
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    size_t mask = dir->index_cap - 1;
+    size_t pos = hashName(name) & mask;
+    while (dir->index[pos] != 0) pos = (pos + 1) & mask;
+    dir->index[pos] = (uint32_t)dir->count + 1;
+    dir->names[dir->count++] = copy;
+    dir->live++;
+    charge(dir, (long)strlen(name) + 1);
+    dropTexts(dir);
+    return 0;
+}
+
+// Removes name if it is listed. Its slot stays taken in the index until the next rebuild.
+static void removeName(cached_dir *dir, const char *name) {
+    long pos = findName(dir, name);
+    if (pos < 0) {
+        return;
+    }
+    charge(dir, -((long)strlen(name) + 1));
+    free(dir->names[pos]);
+    dir->names[pos] = NULL;
+    dir->live--;
+    dropTexts(dir);
+}
+
+// Drops everything, for when events were lost and nothing cached can be trusted
+static void dropAll(void) {
+    while (lru_head != NULL) {
+        freeDir(lru_head);
+    }
+}
+
+/*
+    Description: Reads every queued inotify event and applies it to the directory it
+    belongs to. Creations and removals patch the names, a directory that is deleted
+    or unmounted is dropped. Called with cache_lock held.
+        Args:
+            N/A
+        Returns:
+            N/A
+*/
+static void readEvents(void) {
+    ssize_t nread;
+    while ((nread = read(notify_fd, event_buf, sizeof(event_buf))) > 0) {
+        for (char *pos = event_buf; pos < event_buf + nread;) {
+            struct inotify_event *event = (struct inotify_event *)pos;
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                dropAll();
+                continue;
+            }
+            cached_dir *dir = findWatch(event->wd);
+            if (dir == NULL) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                dir->wd = -1;   // Already gone, nothing to remove
+            }
+            if (dir->ticket != 0) {
+                dir->raced = 1;     // The names being read may or may not include this
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_UNMOUNT | IN_IGNORED)) {
+                freeDir(dir);
+            } else if (event->len == 0) {
+                continue;
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                if (addName(dir, event->name) != 0)
+                    freeDir(dir);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                removeName(dir, event->name);
+            }
+        }
+    }
+    evict();
+}
+
+// Picks up changes made by other processes as they happen
+static void *watchEvents(void *arg) {
+    (void)arg;
+    struct pollfd pfd = { notify_fd, POLLIN, 0 };
+    while (1) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        pthread_mutex_lock(&cache_lock);
+        readEvents();
+        pthread_mutex_unlock(&cache_lock);
+    }
+    return NULL;
+}
+
+int listCacheEnable(void) {
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd < 0) {
+        return -1;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int status = pthread_create(&thread, &attr, watchEvents, NULL);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        close(notify_fd);
+        notify_fd = -1;
+        return -1;
+    }
+    listCacheEnabled = 1;
+    return 0;
+}
+
+// Lays the live names out the way ls prints them: "name name ... \n"
+static rendered_text *render(cached_dir *dir, int sorted) {
+    char **names = malloc((dir->live ? dir->live : 1) * sizeof(char *));
+    if (names == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    size_t len = 1;
+    for (size_t i = 0; i < dir->count; i++) {
+        if (dir->names[i] != NULL) {
+            names[n++] = dir->names[i];
+            len += strlen(dir->names[i]) + 1;
+        }
+    }
+    if (sorted) {
+        sortNames(names, n);
+    }
+
+    rendered_text *text = malloc(sizeof(rendered_text) + len);
+    if (text != NULL) {
+        char *out = text->data;
+        for (size_t i = 0; i < n; i++) {
+            size_t name_len = strlen(names[i]);
+            memcpy(out, names[i], name_len);
+            out[name_len] = ' ';
+            out += name_len + 1;
+        }
+        *out = '\n';
+        text->len = len;
+        text->refs = 1;     // The directory's
+        dir->text[sorted] = text;
+        charge(dir, (long)(sizeof(rendered_text) + len));
+    }
+    free(names);
+    return text;
+}
+
+int listCachePrint(const char *path, int sorted) {
+    dev_t dev;
+    ino_t ino;
+    if (path == NULL || strcmp(path, ".") == 0) {
+        shell_session *session = currentSession();
+        dev = session->cwd_dev;
+        ino = session->cwd_ino;
+    } else {
+        struct stat st;
+        if (fstatat(cwdFd(), path, &st, 0) != 0 || !S_ISDIR(st.st_mode)) {
+            return -1;      // Reading it prints the error
+        }
+        dev = st.st_dev;
+        ino = st.st_ino;
+    }
+    sorted = sorted ? 1 : 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (atomic_exchange(&dirty, 0)) {
+        readEvents();
+    }
+    rendered_text *text = NULL;
+    cached_dir *dir = ino != 0 ? findDir(dev, ino) : NULL;
+    if (dir != NULL && dir->ticket == 0) {
+        unlinkDir(dir);
+        pushDir(dir);
+        text = dir->text[sorted] != NULL ? dir->text[sorted] : render(dir, sorted);
+        if (text != NULL) {
+            text->refs++;   // Ours until it is printed, even if the directory goes meanwhile
+            evict();
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (text == NULL) {
+        return -1;
+    }
+
+    outWrite(text->data, text->len);    // Outside the lock, a slow reader holds up nobody
+    pthread_mutex_lock(&cache_lock);
+    releaseText(text);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+uint64_t listCacheBegin(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return 0;
+    }
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);    // Watches take a path
+
+    uint64_t ticket = 0;
+    pthread_mutex_lock(&cache_lock);
+    if (findDir(st.st_dev, st.st_ino) == NULL) {    // Otherwise someone else is reading it
+        cached_dir *dir = calloc(1, sizeof(cached_dir));
+        int wd = dir != NULL ? inotify_add_watch(notify_fd, proc_path, WATCH_MASK) : -1;
+        if (wd >= 0) {
+            dir->dev = st.st_dev;
+            dir->ino = st.st_ino;
+            dir->wd = wd;
+            dir->ticket = ticket = next_ticket++;
+            dir->bytes = sizeof(cached_dir);
+            total_bytes += dir->bytes;
+            num_dirs++;
+            pushDir(dir);
+            evict();
+        } else {
+            free(dir);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ticket;
+}
+
+void listCacheStore(uint64_t ticket, char **names, size_t count) {
+    if (ticket == 0) {
+        return;
+    }
+    // Copied before taking the lock, the watcher isn't held up for a large directory
+    char **copies = NULL;
+    uint32_t *index = NULL;
+    size_t index_cap = MIN_INDEX_SIZE;
+    size_t bytes = 0;
+    while (index_cap < count * 4) index_cap *= 2;
+    if (names != NULL) {
+        copies = malloc((count ? count : 1) * sizeof(char *));
+        index = calloc(index_cap, sizeof(uint32_t));
+    }
+    size_t copied = 0;
+    if (copies != NULL && index != NULL) {
+        for (; copied < count; copied++) {
+            size_t len = strlen(names[copied]) + 1;
+            copies[copied] = malloc(len);
+            if (copies[copied] == NULL) break;
+            memcpy(copies[copied], names[copied], len);
+            bytes += len;
+            size_t pos = hashName(names[copied]) & (index_cap - 1);
+            while (index[pos] != 0) pos = (pos + 1) & (index_cap - 1);
+            index[pos] = (uint32_t)copied + 1;
+        }
+    }
+    int ok = copies != NULL && index != NULL && copied == count;
+
+    pthread_mutex_lock(&cache_lock);
+    cached_dir *dir = findTicket(ticket);
+    if (dir != NULL && (!ok || dir->raced)) {
+        freeDir(dir);   // Read again next time
+    } else if (dir != NULL) {
+        dir->names = copies;
+        dir->cap = count ? count : 1;
+        dir->count = dir->live = count;
+        dir->index = index;
+        dir->index_cap = index_cap;
+        dir->ticket = 0;
+        charge(dir, (long)(bytes + dir->cap * sizeof(char *) + index_cap * sizeof(uint32_t)));
+        copies = NULL;
+        index = NULL;
+        evict();
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (copies != NULL) {
+        for (size_t i = 0; i < copied; i++) free(copies[i]);
+    }
+    free(copies);
+    free(index);
+}
+
+void listCacheNote(int dirfd, const char *path, bool exists) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    size_t leaf = len;
+    while (leaf > 0 && path[leaf - 1] != '/') leaf--;
+    size_t leaf_len = len - leaf;
+    if (leaf_len == 0 || (leaf_len == 1 && path[leaf] == '.') ||
+        (leaf_len == 2 && path[leaf] == '.' && path[leaf + 1] == '.')) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int empty = lru_head == NULL;
+    pthread_mutex_unlock(&cache_lock);
+    if (empty) {
+        return;     // Nothing to patch, don't look the parent up
+    }
+
+    // The directory the entry is in, known without a call when it is the working one
+    dev_t dev;
+    ino_t ino;
+    shell_session *session = currentSession();
+    struct stat st;
+    if (leaf == 0 && dirfd == session->cwd_fd) {
+        dev = session->cwd_dev;
+        ino = session->cwd_ino;
+    } else {
+        char *parent = leaf == 0 ? strdup(".") : strndup(path, leaf > 1 ? leaf - 1 : 1);
+        int found = parent != NULL && fstatat(dirfd, parent, &st, 0) == 0;
+        free(parent);
+        if (!found) {
+            return;
+        }
+        dev = st.st_dev;
+        ino = st.st_ino;
+    }
+    char *name = strndup(path + leaf, leaf_len);
+    if (name == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    cached_dir *dir = findDir(dev, ino);
+    if (dir != NULL && dir->ticket != 0) {
+        dir->raced = 1;
+    } else if (dir != NULL && exists) {
+        if (addName(dir, name) != 0)
+            freeDir(dir);
+        evict();
+    } else if (dir != NULL) {
+        removeName(dir, name);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(name);
+}
+
+void listCacheDirty(void) {
+    atomic_store(&dirty, 1);
+}
@@ -0,0 +1,65 @@
+/*
+ * list_cache.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Optional cache of directory listings behind -lscache. The names of
+ *			 a listed directory are kept in memory, keyed by its device and
+ *			 inode, together with the plain and --sort text ls prints for it.
+ *			 Every cached directory carries an inotify watch; a watcher thread
+ *			 applies creations, removals and renames to the names as they
+ *			 arrive, so the cache never has to be thrown away for a change. The
+ *			 shell's own mkdir, cp, mv and rm patch the cache directly, and
+ *			 anything else the shell does that may change a directory (cp -r,
+ *			 rm -r, redirections, external programs, jobs) has the next lookup
+ *			 read the queued events first. ls of the working directory is then
+ *			 answered without a system call, ls of another path with one stat.
+ *			 Changes made by other processes show up once the watcher has seen
+ *			 them. The least recently listed directories are dropped past
+ *			 LIST_CACHE_MAX_DIRS directories or LIST_CACHE_MAX_BYTES of memory.
+ *
+ */
+
+#ifndef LIST_CACHE_H_
+#define LIST_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LIST_CACHE_MAX_DIRS 256                     // Also the inotify watches held at once
+#define LIST_CACHE_MAX_BYTES (64L * 1024 * 1024)    // Names, indexes and rendered text together
+
+//Nonzero once listCacheEnable has run, test it before calling anything else here
+extern int listCacheEnabled;
+
+//Turns the cache on and starts its watcher thread. Returns 0, or -1 if inotify
+//isn't available (the cache stays off).
+int listCacheEnable(void);
+
+//Prints the listing of path (relative to the working directory) from the cache,
+//sorted or in directory order. Returns 0 if it was printed, -1 if path isn't
+//cached (or isn't a directory) and has to be read.
+int listCachePrint(const char *path, int sorted);
+
+//Starts caching the directory open on fd, which is about to be read. The watch
+//goes on before the read so no change can fall between them. Returns a ticket
+//for listCacheStore, 0 if the directory won't be cached this time.
+uint64_t listCacheBegin(int fd);
+
+//Hands over the names read after listCacheBegin, in directory order. They are
+//copied. NULL names (the read failed) or a change to the directory while it
+//was being read drops the entry, the next ls reads it again.
+void listCacheStore(uint64_t ticket, char **names, size_t count);
+
+//Records that path, relative to dirfd, now exists (exists true) or is gone.
+//Called by the built-ins after they create, remove or rename an entry.
+void listCacheNote(int dirfd, const char *path, bool exists);
+
+//Records that directories may have changed in ways nobody noted, so the next
+//lookup reads the queued inotify events before answering
+void listCacheDirty(void);
+
+
+#endif /* LIST_CACHE_H_ */
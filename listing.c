@@ -0,0 +1,432 @@
+/*
+ * listing.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: ls implementation. See listing.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "listing.h"
+#include "list_cache.h"
+#include "output.h"
+#include "session.h"
+#include "workers.h"
+
+#define DENTS_BUFFER_SIZE (256 * 1024)    // Bytes asked of getdents64 per call
+#define BLOCK_FLUSH_SIZE (1024 * 1024)    // Unsorted output is handed over in blocks this big
+#define INSERTION_CUTOFF 32                 // Buckets smaller than this are insertion sorted
+#define STAT_CHUNK 64                       // Entries a stat worker claims at a time
+
+#ifdef __linux__
+// Record layout returned by getdents64
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+// A growable run of bytes, used both for the output block and for the name pool
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+}byte_block;
+
+static int blockAppend(byte_block *block, const char *data, size_t len) {
+    if (block->len + len > block->cap) {
+        size_t cap = block->cap ? block->cap : 64 * 1024;
+        while (cap < block->len + len) cap *= 2;
+        char *grown = realloc(block->data, cap);
+        if (grown == NULL) return -1;
+        block->data = grown;
+        block->cap = cap;
+    }
+    memcpy(block->data + block->len, data, len);
+    block->len += len;
+    return 0;
+}
+
+// Listing state shared by the streaming and pooled paths
+typedef struct
+{
+    int pooled;             // Names are kept for sorting or stat-ing instead of printed as read
+    byte_block out;         // "name name ... " ready to print
+    byte_block pool;        // Pooled: NUL terminated names back to back
+    size_t count;
+}listing;
+
+// What the long format shows for one entry
+typedef struct
+{
+    const char *name;
+    mode_t mode;
+    long long size;
+    time_t mtime;
+    int ok;                 // Whether the stat call succeeded
+}entry_info;
+
+typedef struct
+{
+    int dirfd;
+    entry_info *entries;
+}stat_job;
+
+static int addName(listing *list, const char *name, size_t len) {
+    list->count++;
+    if (list->pooled) {
+        return blockAppend(&list->pool, name, len + 1);
+    }
+    if (blockAppend(&list->out, name, len) != 0 || blockAppend(&list->out, " ", 1) != 0) {
+        return -1;
+    }
+    // Keep memory flat on huge directories, the order is final already
+    if (list->out.len >= BLOCK_FLUSH_SIZE) {
+        outWrite(list->out.data, list->out.len);
+        list->out.len = 0;
+    }
+    return 0;
+}
+
+/*
+    Description: Reads every entry of an open directory into the listing, using raw
+    getdents64 so hundreds of entries arrive per system call.
+        Args:
+            int fd : Open directory descriptor, left open for the caller
+            listing *list : Where the names go
+        Returns:
+            int : 0, or -1 on a read or memory error
+*/
+static int readEntries(int fd, listing *list) {
+#ifdef __linux__
+    char *buf = malloc(DENTS_BUFFER_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    int status = 0;
+    while (status == 0) {
+        long nread = syscall(SYS_getdents64, fd, buf, DENTS_BUFFER_SIZE);
+        if (nread <= 0) {
+            status = nread < 0 ? -1 : 0;
+            break;
+        }
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + pos);
+            if (addName(list, entry->d_name, strlen(entry->d_name)) != 0) {
+                status = -1;
+                break;
+            }
+            pos += entry->d_reclen;
+        }
+    }
+    free(buf);
+    return status;
+#else
+    int dup_fd = dup(fd);   // closedir() closes the descriptor it was given
+    DIR *dir = dup_fd < 0 ? NULL : fdopendir(dup_fd);
+    if (dir == NULL) {
+        if (dup_fd >= 0)
+            close(dup_fd);
+        return -1;
+    }
+    struct dirent *entry;
+    int status = 0;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        status = addName(list, entry->d_name, strlen(entry->d_name));
+    }
+    closedir(dir);
+    return status;
+#endif
+}
+
+// Sorts by the suffixes starting at depth, for buckets too small to be worth counting
+static void insertionSort(char **names, size_t n, size_t depth) {
+    for (size_t i = 1; i < n; i++) {
+        char *name = names[i];
+        size_t j = i;
+        while (j > 0 && strcmp(names[j - 1] + depth, name + depth) > 0) {
+            names[j] = names[j - 1];
+            j--;
+        }
+        names[j] = name;
+    }
+}
+
+/*
+    Description: MSD radix sort. The byte at depth is read once per name into a
+    contiguous key array, so the counting and scatter passes don't chase a pointer
+    per name twice.
+        Args:
+            char **names : The names to sort, all equal before depth
+            char **tmp : Scratch space for n pointers
+            uint8_t *keys : Scratch space for n bytes
+            size_t n : Number of names
+            size_t depth : Index of the byte to bucket on
+        Returns:
+            N/A
+*/
+static void radixSort(char **names, char **tmp, uint8_t *keys, size_t n, size_t depth) {
+    if (n < INSERTION_CUTOFF) {
+        insertionSort(names, n, depth);
+        return;
+    }
+
+    uint32_t start[257] = {0};
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = (uint8_t)names[i][depth];
+        start[keys[i] + 1]++;
+    }
+    for (int c = 0; c < 256; c++) {
+        start[c + 1] += start[c];
+    }
+
+    uint32_t next[256];
+    memcpy(next, start, sizeof(next));
+    for (size_t i = 0; i < n; i++) {
+        tmp[next[keys[i]]++] = names[i];
+    }
+    memcpy(names, tmp, n * sizeof(char *));
+
+    // Bucket 0 holds names that ended at depth, they are all equal and already in place
+    for (int c = 1; c < 256; c++) {
+        size_t size = start[c + 1] - start[c];
+        if (size > 1) {
+            radixSort(names + start[c], tmp, keys, size, depth + 1);
+        }
+    }
+}
+
+void sortNames(char **names, size_t n) {
+    if (n < 2) {
+        return;
+    }
+    char **tmp = malloc(n * sizeof(char *));
+    uint8_t *keys = malloc(n);
+    if (tmp == NULL || keys == NULL) {
+        free(tmp);
+        free(keys);
+        insertionSort(names, n, 0);
+        return;
+    }
+    radixSort(names, tmp, keys, n, 0);
+    free(tmp);
+    free(keys);
+}
+
+// Points an array at every pooled name, in the order they were read
+static char **collectNames(listing *list) {
+    char **names = malloc((list->count ? list->count : 1) * sizeof(char *));
+    if (names == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t pos = 0; pos < list->pool.len; n++) {
+        names[n] = list->pool.data + pos;
+        pos += strlen(names[n]) + 1;
+    }
+    return names;
+}
+
+// Lays the names out as one "name name ... " block
+static int renderShort(listing *list, char **names) {
+    int status = 0;
+    for (size_t i = 0; i < list->count && status == 0; i++) {
+        status = blockAppend(&list->out, names[i], strlen(names[i]));
+        if (status == 0)
+            status = blockAppend(&list->out, " ", 1);
+    }
+    return status;
+}
+
+// Fills in one entry with statx (or fstatat where statx is missing), never following symlinks
+static void statEntry(int dirfd, entry_info *entry) {
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+    entry->ok = statx(dirfd, entry->name, AT_SYMLINK_NOFOLLOW,
+                      STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) == 0;
+    if (entry->ok) {
+        entry->mode = stx.stx_mode;
+        entry->size = (long long)stx.stx_size;
+        entry->mtime = stx.stx_mtime.tv_sec;
+    }
+#else
+    struct stat st;
+    entry->ok = fstatat(dirfd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (entry->ok) {
+        entry->mode = st.st_mode;
+        entry->size = (long long)st.st_size;
+        entry->mtime = st.st_mtime;
+    }
+#endif
+}
+
+static void statRange(void *ctx, size_t begin, size_t end) {
+    stat_job *job = ctx;
+    for (size_t i = begin; i < end; i++) {
+        statEntry(job->dirfd, &job->entries[i]);
+    }
+}
+
+// Writes the ls -l style permission string for mode into text (11 bytes)
+static void modeString(mode_t mode, char *text) {
+    text[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISFIFO(mode) ? 'p' :
+              S_ISSOCK(mode) ? 's' : S_ISCHR(mode) ? 'c' : S_ISBLK(mode) ? 'b' : '-';
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; i++) {
+        text[i + 1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+    }
+    text[10] = '\0';
+}
+
+/*
+    Description: Stats every name on LIST_STAT_THREADS threads and lays out one line per
+    entry: mode, size (right aligned), modification time and name.
+        Args:
+            listing *list : Listing whose output block receives the lines
+            int dirfd : Directory the names are relative to
+            char **names : Names in the order they should be printed
+            int timing : Whether to also time a sequential pass and report the difference
+        Returns:
+            int : 0, or -1 if memory ran out
+*/
+static int renderLong(listing *list, int dirfd, char **names, int timing) {
+    size_t n = list->count;
+    entry_info *entries = calloc(n ? n : 1, sizeof(entry_info));
+    if (entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        entries[i].name = names[i];
+    }
+
+    stat_job job = { dirfd, entries };
+    long long start = nowNanos();
+    parallelFor(n, STAT_CHUNK, LIST_STAT_THREADS, statRange, &job);
+    long long parallel_ns = nowNanos() - start;
+
+    if (timing) {
+        // Same calls one at a time, run second so any cache warming favours the baseline
+        entry_info *baseline = calloc(n ? n : 1, sizeof(entry_info));
+        if (baseline != NULL) {
+            for (size_t i = 0; i < n; i++) {
+                baseline[i].name = names[i];
+            }
+            stat_job seq = { dirfd, baseline };
+            start = nowNanos();
+            statRange(&seq, 0, n);
+            long long sequential_ns = nowNanos() - start;
+            free(baseline);
+            outPrintf("statx: %zu entries, %d threads %.3f ms, sequential %.3f ms, saved %.3f ms\n",
+                      n, LIST_STAT_THREADS, parallel_ns / 1e6, sequential_ns / 1e6,
+                      (sequential_ns - parallel_ns) / 1e6);
+        }
+    }
+
+    // Widest size, so the column lines up
+    int width = 1;
+    for (size_t i = 0; i < n; i++) {
+        int digits = entries[i].ok ? snprintf(NULL, 0, "%lld", entries[i].size) : 1;
+        if (digits > width)
+            width = digits;
+    }
+
+    int status = 0;
+    char line[128];
+    for (size_t i = 0; i < n && status == 0; i++) {
+        int len;
+        if (entries[i].ok) {
+            char mode[11], when[32];
+            struct tm tm;
+            modeString(entries[i].mode, mode);
+            localtime_r(&entries[i].mtime, &tm);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+            len = snprintf(line, sizeof(line), "%s %*lld %s ", mode, width, entries[i].size, when);
+        } else {
+            len = snprintf(line, sizeof(line), "%-10s %*s %-16s ", "?", width, "?", "?");
+        }
+        status = blockAppend(&list->out, line, len);
+        if (status == 0)
+            status = blockAppend(&list->out, entries[i].name, strlen(entries[i].name));
+        if (status == 0)
+            status = blockAppend(&list->out, "\n", 1);
+    }
+    free(entries);
+    return status;
+}
+
+int listDirectory(const char *path, int flags) {
+    // Names only, the long format depends on more than the directory's entries
+    int cacheable = listCacheEnabled && !(flags & LIST_LONG);
+    if (cacheable && listCachePrint(path, flags & LIST_SORTED) == 0) {
+        return 0;
+    }
+
+    listing list;
+    memset(&list, 0, sizeof(list));
+    list.pooled = flags & (LIST_SORTED | LIST_LONG);
+
+    // Resolved against the session's directory descriptor, no getcwd or path building
+    int fd = openat(cwdFd(), path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        outPrint("Error! unable to open directory\n");
+        return -1;
+    }
+    uint64_t ticket = cacheable ? listCacheBegin(fd) : 0;
+    if (ticket != 0) {
+        list.pooled = 1;    // The cache keeps the names
+    }
+
+    int status = readEntries(fd, &list);
+    if (status == 0 && list.pooled) {
+        char **names = collectNames(&list);
+        if (names == NULL) {
+            status = -1;
+        } else {
+            if (ticket != 0) {
+                listCacheStore(ticket, names, list.count);  // Copied, and before sorting
+                ticket = 0;
+            }
+            if (flags & LIST_SORTED)
+                sortNames(names, list.count);
+            if (flags & LIST_LONG)
+                status = renderLong(&list, fd, names, flags & LIST_TIMING);
+            else
+                status = renderShort(&list, names);
+            free(names);
+        }
+    }
+    if (ticket != 0) {
+        listCacheStore(ticket, NULL, 0);    // The read failed, nothing to keep
+    }
+    close(fd);
+
+    if (status != 0) {
+        outPrint("Error! unable to read from directory\n");
+    } else {
+        // The long format already ends every line
+        if (!(flags & LIST_LONG))
+            blockAppend(&list.out, "\n", 1);
+        outWrite(list.out.data, list.out.len);
+    }
+    free(list.out.data);
+    free(list.pool.data);
+    return status;
+}
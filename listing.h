@@ -0,0 +1,33 @@
+/*
+ * listing.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Directory listing behind the ls command. Entries are read in large
+ *			 getdents64 batches and printed as one block, optionally sorted. The
+ *			 long format stats entries on a small pool of threads.
+ *
+ */
+
+#ifndef LISTING_H_
+#define LISTING_H_
+
+#include <stddef.h>
+
+// Flags for listDirectory
+#define LIST_SORTED 0x1     // Print names in byte order instead of directory order
+#define LIST_LONG   0x2     // One line per entry with mode, size and mtime
+#define LIST_TIMING 0x4     // With LIST_LONG, also time a sequential stat pass and report both
+
+// Threads used to stat entries for the long format, the work is latency bound
+#define LIST_STAT_THREADS 8
+
+//Prints the names in path (relative to the working directory) separated by
+//spaces, followed by a newline. Returns 0, or -1 after printing an error.
+int listDirectory(const char *path, int flags);
+
+//Sorts n strings in byte order (same order as strcmp) with an MSD radix sort
+void sortNames(char **names, size_t n);
+
+
+#endif /* LISTING_H_ */
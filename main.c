@@ -10,8 +10,17 @@
 #include <dirent.h>
 #include <stdbool.h>
 #include <sys/types.h>
-#include "command.h"
+#include "dispatch.h"
+#include "jobs.h"
+#include "list_cache.h"
+#include "output.h"
+#include "scheduler.h"
+#include "script_cache.h"
+#include "server.h"
+#include "stats.h"
+#include "script_reader.h"
 #include "string_parser.h"
+#include "trace.h"
 
 #define _GNU_SOURCE
 
@@ -25,76 +34,9 @@ void dealloc(char *buf, FILE *in, FILE *out) {
         fclose(out);
 }
 
-bool wrongNumArgs(int target_num, int token_num) {
-    if (token_num != target_num) {
-        printf("Error! Wrong number of arguments for command, please ensure proper formatting\n");
-        return true;
-    } else {
-        return false;
-    }
-}
-
-void parseCommand(command_line cmd_line) {
-    if (cmd_list == NULL) {
-        printf("Error! Invalid command_line structure\n");
-        return;
-    }
-    char **cmd_list = cmd_line.command_list; // Get the list containing the command and args if applicable
-
-    char *command = cmd_list[0]; // Get the command
-    if (command == NULL) {
-        printf("Error! Invalid command\n");
-		return;
-    }
-    int num_tok = cmd_line.num_token; // Get the number of tokens
-
-    // Process each command
-    if (strcmp(command, "exit") == 0) {                // Exits on request
-        free_command_line(&cmd_line);
-        exit(0);
-    } else if (strcmp(command, "ls") == 0) {           // Executes the ls command if possible
-        if (!wrongNumArgs(2, num_tok)) {
-            listDir();
-        }
-    } else if (strcmp(command, "pwd") == 0) {          // Executes the pwd command if possible
-        if (!wrongNumArgs(2, num_tok)) {
-            showCurrentDir();
-        }
-    } else if (strcmp(command, "mkdir") == 0) {        // Executes the mkdir command if possible
-        if (!wrongNumArgs(3, num_tok)) {
-            makeDir(cmd_list[1]);
-        }
-    } else if (strcmp(command, "cd") == 0) {           // Executes the cd command if possible
-        if (!wrongNumArgs(3, num_tok)) {
-            changeDir(cmd_list[1]);
-        }
-    } else if (strcmp(command, "cp") == 0) {           // Executes the cp command if possible
-        if (!wrongNumArgs(4, num_tok)) {
-            copyFile(cmd_list[1], cmd_list[2]);
-        }
-    } else if (strcmp(command, "mv") == 0) {           // Executes the mv command if possible
-        if (!wrongNumArgs(4, num_tok)) {
-            moveFile(cmd_list[1], cmd_list[2]);
-        }
-    } else if (strcmp(command, "rm") == 0) {           // Executes the rm command if possible
-        if (!wrongNumArgs(3, num_tok)) {
-            deleteFile(cmd_list[1]);
-        }
-    } else if (strcmp(command, "cat") == 0) {          // Executes the cat command if possible
-        if (!wrongNumArgs(3, num_tok)) {
-            displayFile(cmd_list[1]);
-        }
-    } else {
-        printf("Error! Unrecognized command: %s \n", command);
-        fflush(NULL);
-    }
-}
-
 int main(int argc, char *argv[]) {
-    setbuf(stdout, NULL);
-
     // Variables
-    FILE *i_file;   // In file (holds the commands)
+    script_reader i_file;   // In file (holds the commands)
     FILE *o_file;   // Out file (receives the output)
 
     // Allocate memory for the buffer
@@ -102,87 +44,150 @@ int main(int argc, char *argv[]) {
     size_t bufSize = 32;
     buffer = (char *)malloc(bufSize * sizeof(char));
 
-    // **** FILE MODE (ensures that there are three args and a file flag) ****
-    if (argc == 3 && (strncmp(argv[1], "-f", 2) == 0 || strncmp(argv[1], "-file", 5) == 0)) {
+    // -stats (or -stats=json) anywhere on the command line reports per-command numbers on stderr,
+    // -lscache keeps directory listings in memory between ls calls, -trace FILE records every
+    // command line for pseudo-replay
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-stats") == 0 || strcmp(argv[i], "-stats=json") == 0) {
+            statsEnable(argv[i][6] == '=' ? STATS_JSON : STATS_TABLE);    // Before any thread starts
+        } else if (strcmp(argv[i], "-lscache") == 0) {
+            listCacheEnable();
+        } else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+            traceOpen(argv[++i]);
+        }
+    }
+
+    // **** DAEMON MODE (-d socket, -j N sets the number of workers) ****
+    if (argc >= 3 && (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "-daemon") == 0)) {
+        int threads = SERVER_THREADS;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                threads = atoi(argv[++i]);
+            }
+        }
+        int status = serverRun(argv[2], threads);
+        free(buffer);
+        return status == 0 ? 0 : 1;
+    }
+
+    // **** FILE MODE (ensures that there are at least three args and a file flag) ****
+    if (argc >= 3 && (strncmp(argv[1], "-f", 2) == 0 || strncmp(argv[1], "-file", 5) == 0)) {
+        // Options after the script: -j N runs independent commands on N worker threads,
+        // -nocache parses the script instead of using (or writing) its compiled form
+        int jobs = 1;
+        bool use_cache = !traceEnabled;     // Compiled scripts skip parseCommand, where lines are recorded
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                jobs = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "-nocache") == 0) {
+                use_cache = false;
+            }
+        }
+
         o_file = freopen("output.txt", "w", stdout);
         if (o_file == NULL) {
-            printf("Error! Failed to open output file\n");
+            outPrint("Error! Failed to open output file\n");
             dealloc(buffer, NULL, NULL);
             exit(1);
         }
 
-        i_file = fopen(argv[2], "r");
-        if (i_file == NULL) {
-            printf("Error! Input file missing\n");
+        outSetPolicy(OUTPUT_FULL);  // Nobody is watching, only write when the buffer fills up
+
+        if (scriptOpen(&i_file, argv[2]) != 0) {
+            outPrint("Error! Input file missing\n");
+            outFlush();
             dealloc(buffer, NULL, o_file);
             exit(1);
         }
 
-        // declare line_buffer
-        size_t len = 128;
-        char *line_buf = malloc(len);
-        command_line cmdList; // List of all the commands in a line
+        // Lines come straight out of the mapped script, nothing is copied. They are taken
+        // a block at a time, the parser treats newlines like ';' so a block is one parse
+        char *line_buf;
+        size_t line_len;
+        parse_arena arena;  // Reused for every block so parsing allocates nothing in steady state
+        arena_init(&arena);
+        bool running = true;
+
+        command_scheduler sched;
+        bool parallel = jobs > 1 && schedulerStart(&sched, jobs) == 0;
+
+        // A compiled script runs without parsing, anything that can't be compiled is streamed
+        compiled_script compiled;
+        stats_sample load_sample;
+        if (statsEnabled)
+            statsStart(&load_sample);
+        bool precompiled = use_cache && compiledLoad(&compiled, argv[2]) == 0;
+        if (statsEnabled && precompiled)
+            statsStop(statsEntry("(load)"), &load_sample, 0);
+        if (precompiled) {
+            running = compiledRun(&compiled, parallel ? &sched : NULL);
+            compiledFree(&compiled);
+        }
 
         // loop until the file is over
-        while (getline(&line_buf, &len, i_file) != -1) {
-            cmdList = str_filler(line_buf, ";"); 	// Deliniate the line by the ';' and sort into a list of commands
-            for (int i = 0; cmdList.command_list[i] != NULL; i++) { 	// Go through each command
-                if (cmdList.command_list[i] == NULL) {	// If command is NULL send error message
-                    printf("Error! Invalid command_list element\n");
+        while (running && !precompiled && (line_buf = scriptNextBlock(&i_file, SCRIPT_BLOCK_SIZE, &line_len)) != NULL) {
+            stats_sample sample;
+            if (statsEnabled)
+                statsStart(&sample);
+            parsed_line line = parse_line(&arena, line_buf, line_len);	// Split into commands and their args in one pass
+            if (statsEnabled)
+                statsStop(statsEntry("(parse)"), &sample, 0);
+            if (parallel) {
+                running = schedulerRun(&sched, line);	// Output still comes out in script order
+                continue;
+            }
+            for (int i = 0; i < line.num_commands; i++) { 	// Go through each command
+                if (!parseCommand(line.commands[i])) {	// Execute command, stop on exit
+                    running = false;
                     break;
                 }
-                command_line cmd;     // List of a command and its args (initialize each time to make sure no unititialized values)
-				cmd = str_filler(cmdList.command_list[i], " ");	// Create a command_line for the command
-				parseCommand(cmd);	// Execute command
-                free_command_line(&cmd);	// Free command_line of the single command
             }
-            free_command_line(&cmdList);	// Free command_list of commands
+            jobsNotify();
         }
-        free(line_buf); // Free the dynamically allocated memory for line_buf
-        printf("End of file \nBye Bye!");
-        dealloc(buffer, i_file, o_file);
+        if (parallel)
+            schedulerStop(&sched);
+        jobsFinish();   // Background jobs still running are waited for
+        arena_free(&arena);
+        scriptClose(&i_file);
+        if (running)
+            outPrint("End of file \nBye Bye!");
+        outFlush();     // Must happen before output.txt is closed
+        dealloc(buffer, NULL, o_file);
         return 0;
     } else {
 
         // **** INTERACTIVE MODE ****
-        while (true) {
-            printf(">>> ");
-            command_line cmdList;
-            char *input = NULL;
-            size_t len = 0;
+        char *input = NULL;
+        size_t len = 0;
+        parse_arena arena;
+        arena_init(&arena);
+        bool running = true;
+
+        while (running) {
+            jobsNotify();   // Background jobs that finished are reported before the prompt
+            outPrint(">>> ");
+            outFlush();     // Show the prompt and anything still pending before blocking
             ssize_t read;
 
             read = getline(&input, &len, stdin); // Get input from the command line
             if (read == -1) {
-                printf("Error! Issue with reading input from console.\n");
+                outPrint("Error! Issue with reading input from console.\n");
                 break;
             }
 
-            // Remove newline character
-            input[strcspn(input, "\n")] = '\0';
-
-            if (strlen(input) == 0) {
-                free(input);
-                continue; // Empty input, prompt again
-            }
-
-            cmdList = str_filler(input, ";");
-            for (int i = 0; cmdList.command_list[i] != NULL; i++) {
-                if (cmdList.command_list[i] == NULL) {
-                    printf("Error! Invalid command_list element\n");
-                    continue;
+            // Parse the line into commands, and each command into its args, by ';' and spaces
+            parsed_line line = parse_line(&arena, input, read);
+            for (int i = 0; i < line.num_commands; i++) {
+                if (!parseCommand(line.commands[i])) {	// Parse or call the command indicated by the commandline
+                    running = false;
+                    break;
                 }
-                command_line cmd;
-				cmd = str_filler(cmdList.command_list[i], " "); // Parse the commands by the spaces to differentiate between the command and it's args
-                parseCommand(cmd);	// Parse or call the command indicated by the commandline
-                free_command_line(&cmd);	// Free this instance of the command
-				memset(&cmd, 0, 0);
-
             }
-            free_command_line(&cmdList);	// Free the entire list of commands
-			memset(&cmdList, 0, 0);
-            free(input);	// Free the given input
         }
+        jobsFinish();
+        outFlush();
+        arena_free(&arena);
+        free(input);	// Free the given input
         free(buffer); // Free the dynamically allocated buffer
     }
     return 0;
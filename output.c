@@ -0,0 +1,228 @@
+/*
+ * output.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Buffered output sink shared by every built-in. See output.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+
+static output_stream standard_out = { STDOUT_FILENO, NULL, 0, 0, OUTPUT_LINE, 0 };
+static _Thread_local output_stream *current = &standard_out;
+static _Thread_local int input_fd = STDIN_FILENO;
+static int exit_hook = 0;  // Whether the atexit flush has been registered
+
+static void flushAtExit(void) {
+    outClose(&standard_out);
+}
+
+/*
+    Description: Writes every byte described by iov, retrying partial writes and EINTR.
+        Args:
+            int fd : Destination descriptor
+            struct iovec *iov : The pieces to write, adjusted in place as they go out
+            int count : Number of pieces
+        Returns:
+            int : 0 on success, -1 if the descriptor refused the data
+*/
+static int writeAll(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // Skip over whatever was fully written and trim the piece that was cut short
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Grows a memory stream's buffer so len more bytes fit
+static int reserveMemory(output_stream *stream, size_t len) {
+    if (len <= stream->cap - stream->len) {
+        return 0;
+    }
+    size_t cap = stream->cap ? stream->cap : OUTPUT_BUFFER_SIZE;
+    while (cap - stream->len < len) cap *= 2;
+    char *grown = realloc(stream->buf, cap);
+    if (grown == NULL) {
+        stream->error = 1;
+        return -1;
+    }
+    stream->buf = grown;
+    stream->cap = cap;
+    return 0;
+}
+
+// Sends the buffered bytes of stream, plus an optional extra piece, in one writev()
+static void drain(output_stream *stream, const char *extra, size_t extra_len) {
+    if (stream->fd == OUTPUT_MEMORY) {
+        return;     // Memory streams keep everything until their owner takes it
+    }
+    struct iovec iov[2];
+    int count = 0;
+
+    if (stream->len > 0) {
+        iov[count].iov_base = stream->buf;
+        iov[count].iov_len = stream->len;
+        count++;
+    }
+    if (extra_len > 0) {
+        iov[count].iov_base = (void *)extra;
+        iov[count].iov_len = extra_len;
+        count++;
+    }
+    if (count > 0 && writeAll(stream->fd, iov, count) != 0) {
+        stream->error = 1;
+    }
+    stream->len = 0;
+}
+
+void outInit(output_stream *stream, int fd, int policy) {
+    stream->fd = fd;
+    stream->buf = NULL;
+    stream->len = 0;
+    stream->cap = 0;
+    stream->policy = policy;
+    stream->error = 0;
+}
+
+void outClose(output_stream *stream) {
+    drain(stream, NULL, 0);
+    free(stream->buf);
+    stream->buf = NULL;
+    stream->len = 0;
+    stream->cap = 0;
+}
+
+output_stream *outCurrent(void) {
+    return current;
+}
+
+void outUse(output_stream *stream) {
+    current = stream != NULL ? stream : &standard_out;
+}
+
+int inFd(void) {
+    return input_fd;
+}
+
+void inUse(int fd) {
+    input_fd = fd >= 0 ? fd : STDIN_FILENO;
+}
+
+void outSetPolicy(int policy) {
+    current->policy = policy;
+}
+
+void outWrite(const char *data, size_t len) {
+    output_stream *stream = current;
+
+    if (stream->fd == OUTPUT_MEMORY) {
+        if (reserveMemory(stream, len) == 0) {
+            memcpy(stream->buf + stream->len, data, len);
+            stream->len += len;
+        }
+        return;
+    }
+
+    if (stream->buf == NULL) {
+        stream->buf = malloc(OUTPUT_BUFFER_SIZE);
+        stream->cap = stream->buf != NULL ? OUTPUT_BUFFER_SIZE : 0;
+        if (stream == &standard_out && !exit_hook) {
+            atexit(flushAtExit);
+            exit_hook = 1;
+        }
+    }
+
+    if (len <= stream->cap - stream->len) {
+        memcpy(stream->buf + stream->len, data, len);
+        stream->len += len;
+        if (stream->policy == OUTPUT_LINE && memchr(data, '\n', len) != NULL) {
+            drain(stream, NULL, 0);
+        }
+    } else {
+        // Doesn't fit: send the buffer and the new data together instead of copying
+        drain(stream, data, len);
+    }
+}
+
+void outPrint(const char *string) {
+    outWrite(string, strlen(string));
+}
+
+void outPrintf(const char *format, ...) {
+    char small[256];
+    va_list args;
+
+    va_start(args, format);
+    int needed = vsnprintf(small, sizeof(small), format, args);
+    va_end(args);
+    if (needed < 0) {
+        return;
+    }
+
+    if ((size_t)needed < sizeof(small)) {
+        outWrite(small, needed);
+        return;
+    }
+
+    // Too long for the stack buffer, format again into one that fits
+    char *large = malloc(needed + 1);
+    if (large == NULL) {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(large, needed + 1, format, args);
+    va_end(args);
+    outWrite(large, needed);
+    free(large);
+}
+
+void outFlush(void) {
+    drain(current, NULL, 0);
+}
+
+int outFd(void) {
+    return current->fd;
+}
+
+int outCopyFd(int fd) {
+    output_stream *stream = current;
+    char chunk[OUTPUT_BUFFER_SIZE];
+
+    while (1) {
+        ssize_t nread = read(fd, chunk, sizeof(chunk));
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread < 0) {
+            return -1;
+        }
+        if (nread == 0) {
+            return 0;
+        }
+        if (stream->fd == OUTPUT_MEMORY && reserveMemory(stream, nread) != 0) {
+            return 0;   // Out of memory, the stream's error flag says so
+        }
+        outWrite(chunk, nread);
+    }
+}
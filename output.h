@@ -0,0 +1,82 @@
+/*
+ * output.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: The one place the shell writes output through. Everything printed
+ *			 by built-ins, error messages and the prompt is collected in a large
+ *			 buffer and handed to the kernel according to a flush policy, instead
+ *			 of one write() per fragment.
+ *
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Flush policies
+#define OUTPUT_LINE 0   // Interactive: flush whenever a line is finished and at the prompt
+#define OUTPUT_FULL 1   // File mode: flush only when the buffer fills up and at exit
+
+// fd for a stream that only collects into memory, buf/len hold everything written
+#define OUTPUT_MEMORY -1
+
+typedef struct
+{
+    int fd;             // Where flushed bytes go, OUTPUT_MEMORY to keep them in buf
+    char *buf;
+    size_t len;         // Bytes waiting in buf
+    size_t cap;
+    int policy;
+    int error;          // Set once a write to fd has failed
+}output_stream;
+
+//Sets up a stream writing to fd, the buffer is allocated on first use
+void outInit(output_stream *stream, int fd, int policy);
+
+//Writes out anything still buffered and frees the buffer
+void outClose(output_stream *stream);
+
+//The stream all the functions below write to (stdout unless changed). Each thread
+//has its own, so workers can collect output without interleaving.
+output_stream *outCurrent(void);
+
+//Makes stream the calling thread's current stream, NULL goes back to stdout
+void outUse(output_stream *stream);
+
+//Descriptor the calling thread's built-ins read their input from, standard input
+//unless a pipeline has connected the thread to the stage before it
+int inFd(void);
+
+//Makes fd the calling thread's input, -1 goes back to standard input
+void inUse(int fd);
+
+//Changes how the current stream is flushed
+void outSetPolicy(int policy);
+
+//Buffers len bytes, large writes are coalesced with the buffer in one writev()
+void outWrite(const char *data, size_t len);
+
+//Buffers a NUL terminated string
+void outPrint(const char *string);
+
+//printf into the buffer
+void outPrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+//Hands everything buffered to the kernel now. Call this before writing to the
+//stream's descriptor by any other route (sendfile, splice, ...).
+void outFlush(void);
+
+//Descriptor of the current stream, for kernel side transfers after outFlush().
+//OUTPUT_MEMORY streams have none, use outCopyFd for those.
+int outFd(void);
+
+//Reads fd to its end into the current stream. Returns 0, or -1 on a read error.
+int outCopyFd(int fd);
+
+
+#endif /* OUTPUT_H_ */
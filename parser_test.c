@@ -0,0 +1,105 @@
+/*
+ * parser_test.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Differential test for parse_line. Random lines are tokenized with
+ *			 every scan kernel the CPU supports and compared with what the
+ *			 reference str_filler produces when splitting on ';' and then on ' '.
+ *			 Run with "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "string_parser.h"
+
+#define TEST_LINES 20000
+#define MAX_LINE 300
+
+static const char alphabet[] = "abcdefgh   ;;\t";
+
+// Fills line with len random characters, sometimes spaces or ';' only
+static void randomLine(char *line, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        line[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    line[len] = '\0';
+}
+
+/*
+    Description: Tokenizes line with the current kernel and checks it against str_filler.
+        Args:
+            parse_arena *arena : Arena reused across calls
+            const char *line : Line to check, left untouched
+        Returns:
+            int : 0 if both agree, 1 otherwise
+*/
+static int checkLine(parse_arena *arena, const char *line) {
+    size_t len = strlen(line);
+    char *work = malloc(len + 1);
+    char *ref = malloc(len + 1);
+    memcpy(work, line, len + 1);
+    memcpy(ref, line, len + 1);
+
+    parsed_line parsed = parse_line(arena, work, len);
+    command_line commands = str_filler(ref, ";");
+    int failed = 0;
+    int n = 0;
+
+    for (int i = 0; commands.command_list[i] != NULL && !failed; i++) {
+        command_line tokens = str_filler(commands.command_list[i], " \t");
+        if (tokens.num_token > 1) {     // parse_line drops blank commands
+            if (n >= parsed.num_commands || parsed.commands[n].num_token != tokens.num_token) {
+                failed = 1;
+            } else {
+                for (int t = 0; t < tokens.num_token; t++) {
+                    char *a = parsed.commands[n].command_list[t];
+                    char *b = tokens.command_list[t];
+                    if ((a == NULL) != (b == NULL) || (a != NULL && strcmp(a, b) != 0)) {
+                        failed = 1;
+                    }
+                }
+            }
+            n++;
+        }
+        free_command_line(&tokens);
+    }
+    if (n != parsed.num_commands) {
+        failed = 1;
+    }
+    if (failed) {
+        printf("Mismatch on \"%s\"\n", line);
+    }
+
+    free_command_line(&commands);
+    free(work);
+    free(ref);
+    return failed;
+}
+
+int main(void) {
+    static const char *names[] = { "scalar", "sse2", "avx2" };
+    parse_arena arena;
+    arena_init(&arena);
+    char line[MAX_LINE + 1];
+    int failures = 0;
+
+    for (int kind = SCAN_SCALAR; kind <= SCAN_AVX2; kind++) {
+        if (parser_select_kernel(kind) != kind) {
+            printf("%s: not supported, skipped\n", names[kind]);
+            continue;
+        }
+        srand(1234);
+        int bad = 0;
+        for (int i = 0; i < TEST_LINES; i++) {
+            randomLine(line, rand() % (MAX_LINE + 1));
+            bad += checkLine(&arena, line);
+        }
+        printf("%s: %d lines, %d mismatches\n", names[kind], TEST_LINES, bad);
+        failures += bad;
+    }
+
+    arena_free(&arena);
+    return failures != 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * pipeline.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Threaded pipelines and redirection between built-ins. See pipeline.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "dispatch.h"
+#include "output.h"
+#include "session.h"
+
+typedef struct
+{
+    char **argv;            // NULL terminated, in the pipeline's word pool
+    int argc;
+    const char *out_path;   // Target of > or >>, NULL to write down the pipe
+    int append;
+    int in_fd;              // Read end of the pipe before, -1 for the caller's input
+    int out_fd;             // Pipe to the next stage or the redirection file, -1 for the caller's stream
+    shell_session session;
+    output_stream out;
+}pipe_stage;
+
+static bool isPipe(const char *word) {
+    return word[0] == '|' && word[1] == '\0';
+}
+
+static bool isRedirect(const char *word) {
+    return word[0] == '>' && (word[1] == '\0' || (word[1] == '>' && word[2] == '\0'));
+}
+
+bool isPipeline(command_line cmd) {
+    for (int i = 0; cmd.command_list[i] != NULL; i++) {
+        const char *word = cmd.command_list[i];
+        if ((word[0] == '|' || word[0] == '>') && (isPipe(word) || isRedirect(word))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Description: Splits the words of a command into stages at every |, taking > and
+    >> with their file names out of the stage they appear in.
+        Args:
+            char **words : The command's words, NULL terminated
+            char **pool : Room for every word plus a NULL per stage
+            pipe_stage *stages : One per stage, filled in
+        Returns:
+            int : Number of stages, or -1 if a stage is empty or a redirection has no file
+*/
+static int splitStages(char **words, char **pool, pipe_stage *stages) {
+    int n = 0;
+    pipe_stage *stage = &stages[0];
+    memset(stage, 0, sizeof(*stage));
+    stage->argv = pool;
+    for (int i = 0; ; i++) {
+        char *word = words[i];
+        if (word == NULL || isPipe(word)) {
+            if (stage->argc == 0) {
+                return -1;
+            }
+            *pool++ = NULL;
+            n++;
+            if (word == NULL) {
+                return n;
+            }
+            stage = &stages[n];
+            memset(stage, 0, sizeof(*stage));
+            stage->argv = pool;
+        } else if (isRedirect(word)) {
+            char *path = words[i + 1];
+            if (path == NULL || isPipe(path) || isRedirect(path) || stage->out_path != NULL) {
+                return -1;
+            }
+            stage->out_path = path;
+            stage->append = word[1] == '>';
+            i++;
+        } else {
+            *pool++ = word;
+            stage->argc++;
+        }
+    }
+}
+
+// Opens the file a stage's output is redirected to, relative to the session's directory
+static int openTarget(pipe_stage *stage) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (stage->append ? O_APPEND : O_TRUNC);
+    stage->out_fd = openat(cwdFd(), stage->out_path, flags, 0666);
+    return stage->out_fd >= 0 ? 0 : -1;
+}
+
+// Runs one stage of several on whatever thread calls it, then lets go of its descriptors
+static void runStage(pipe_stage *stage) {
+    output_stream *caller_out = outCurrent();
+    shell_session *caller_session = currentSession();
+    int caller_in = inFd();
+
+    sessionUse(&stage->session);
+    if (stage->in_fd >= 0) {
+        inUse(stage->in_fd);
+    }
+    if (stage->out_fd >= 0) {
+        outInit(&stage->out, stage->out_fd, OUTPUT_FULL);
+        outUse(&stage->out);
+    }
+    runArgv(stage->argc, stage->argv);     // exit does nothing inside a pipeline
+    if (stage->out_fd >= 0) {
+        outClose(&stage->out);
+        close(stage->out_fd);   // The next stage sees the end of its input
+    }
+    if (stage->in_fd >= 0) {
+        close(stage->in_fd);    // A stage that stopped early makes the one before it stop too
+    }
+    outUse(caller_out);
+    inUse(caller_in);
+    sessionUse(caller_session);
+    sessionFree(&stage->session);
+}
+
+// A stage whose reader has gone gets EPIPE instead of killing the shell
+static pthread_once_t sigpipe_once = PTHREAD_ONCE_INIT;
+
+static void ignoreSigpipe(void) {
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void *stageThread(void *arg) {
+    runStage(arg);
+    return NULL;
+}
+
+// Runs a command with no | on the calling thread, only its output goes elsewhere
+static bool runRedirected(pipe_stage *stage) {
+    if (stage->out_path == NULL) {
+        return runArgv(stage->argc, stage->argv);
+    }
+    if (openTarget(stage) != 0) {
+        outPrint("Error! can't open file\n");
+        return true;
+    }
+    output_stream *caller_out = outCurrent();
+    outFlush();     // Whatever was printed before still goes out first
+    outInit(&stage->out, stage->out_fd, OUTPUT_FULL);
+    outUse(&stage->out);
+    bool keep_going = runArgv(stage->argc, stage->argv);
+    outClose(&stage->out);
+    outUse(caller_out);
+    close(stage->out_fd);
+    return keep_going;
+}
+
+bool runPipeline(command_line cmd) {
+    int words = cmd.num_token - 1;
+    int max_stages = 1;
+    for (int i = 0; i < words; i++) {
+        max_stages += isPipe(cmd.command_list[i]);
+    }
+    char **pool = malloc((words + max_stages) * sizeof(char *));
+    pipe_stage *stages = malloc(max_stages * sizeof(pipe_stage));
+    if (pool == NULL || stages == NULL) {
+        free(pool);
+        free(stages);
+        outPrint("Error! out of memory\n");
+        return true;
+    }
+
+    int n = splitStages(cmd.command_list, pool, stages);
+    bool keep_going = true;
+    if (n < 0) {
+        outPrint("Error! Invalid pipe or redirection\n");
+    } else if (n == 1) {
+        keep_going = runRedirected(&stages[0]);
+    } else {
+        pthread_once(&sigpipe_once, ignoreSigpipe);
+
+        // Set everything up before the first stage starts, so a failure leaves nothing running
+        const char *failed = NULL;
+        int made = 0;
+        for (int i = 0; i < n; i++) {
+            stages[i].in_fd = -1;
+            stages[i].out_fd = -1;
+        }
+        for (int i = 0; i < n && !failed; i++) {
+            if (sessionClone(&stages[i].session, currentSession()) != 0) {
+                failed = "Error! can't set up pipeline\n";
+                break;
+            }
+            made++;
+            if (i + 1 < n) {
+                int ends[2];
+                if (pipe2(ends, O_CLOEXEC) != 0) {
+                    failed = "Error! can't set up pipeline\n";
+                } else {
+#ifdef F_SETPIPE_SZ
+                    fcntl(ends[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+#endif
+                    stages[i].out_fd = ends[1];
+                    stages[i + 1].in_fd = ends[0];
+                }
+            }
+        }
+        for (int i = 0; i < n && !failed; i++) {
+            if (stages[i].out_path == NULL) {
+                continue;
+            }
+            if (stages[i].out_fd >= 0) {
+                close(stages[i].out_fd);    // Redirected, so the next stage gets no input
+            }
+            if (openTarget(&stages[i]) != 0) {
+                failed = "Error! can't open file\n";
+            }
+        }
+
+        if (failed) {
+            for (int i = 0; i < n; i++) {
+                if (stages[i].in_fd >= 0) close(stages[i].in_fd);
+                if (stages[i].out_fd >= 0) close(stages[i].out_fd);
+                if (i < made) sessionFree(&stages[i].session);
+            }
+            outPrint(failed);
+        } else {
+            // Every stage but the last gets a thread, the last one writes to our own stream
+            outFlush();
+            pthread_t *threads = malloc((n - 1) * sizeof(pthread_t));
+            int started = 0;
+            while (threads != NULL && started < n - 1 &&
+                   pthread_create(&threads[started], NULL, stageThread, &stages[started]) == 0) {
+                started++;
+            }
+            for (int i = started; i < n - 1; i++) {
+                // No thread for it: drop the stage, the ones after it see an empty input
+                close(stages[i].out_fd);
+                if (stages[i].in_fd >= 0) close(stages[i].in_fd);
+                sessionFree(&stages[i].session);
+            }
+            if (started < n - 1) {
+                outPrint("Error! can't set up pipeline\n");
+            }
+            runStage(&stages[n - 1]);
+            for (int i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            free(threads);
+        }
+    }
+    free(pool);
+    free(stages);
+    return keep_going;
+}
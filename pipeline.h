@@ -0,0 +1,35 @@
+/*
+ * pipeline.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Pipes and output redirection between built-ins. A command such as
+ *			 "cat a.txt | cat > b.txt" is split at its | words into stages that
+ *			 run at the same time on threads of this process, joined by pipes.
+ *			 Every stage gets its own input descriptor and output stream (and
+ *			 its own copy of the session, so cd inside a pipeline stays there).
+ *			 File data moves with splice, from the page cache into the pipe and
+ *			 from one pipe into the next, without passing through user space.
+ *			 The operators have to be words of their own, "a|b" is one name.
+ *
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdbool.h>
+#include "string_parser.h"
+
+#define PIPE_BUFFER_SIZE (1024 * 1024)  // Asked for on every pipe, fewer switches between stages
+
+//Whether cmd has a |, > or >> word, so it has to go through runPipeline
+bool isPipeline(command_line cmd);
+
+//Runs the stages of cmd connected by pipes, with > (truncate) and >> (append)
+//sending a stage's output to a file instead. A lone stage runs on the calling
+//thread in the current session. Returns false once exit has run, which only
+//counts in a lone stage, as in other shells.
+bool runPipeline(command_line cmd);
+
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,386 @@
+/*
+ * replay.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Load driver that runs a trace recorded with -trace again, linked
+ *			 from the same objects as the shell. Every replay session runs the
+ *			 whole trace on a thread of its own, through parse_line and
+ *			 parseCommand like the shell, in its own directory under a scratch
+ *			 directory, so N sessions put N times the recorded load on the
+ *			 tokenizer, the dispatcher and the I/O built-ins at once. Lines
+ *			 keep their recorded spacing unless -fast runs them back to back.
+ *			 The recorded sessions of a daemon trace each get a session of
+ *			 their own in every replay session, and are interleaved in the
+ *			 order they were recorded.
+ *
+ *			 -seed DIR copies DIR into each session's directory first, so the
+ *			 files the trace works on are there. Every argument of a command is
+ *			 resolved from the session's directory before it runs, and the rest
+ *			 of a line is skipped from the first command naming a path outside
+ *			 the session's directory, so nothing outside the scratch directory
+ *			 is touched (paths are resolved as written, symbolic links in the
+ *			 seed are trusted). A session whose directory still ends up outside
+ *			 is put back before its next command. Command
+ *			 output is thrown away. The result is one JSON line with the
+ *			 recorded and replayed latency percentiles; -stats adds the usual
+ *			 per built-in table on stderr.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dispatch.h"
+#include "jobs.h"
+#include "output.h"
+#include "session.h"
+#include "stats.h"
+#include "string_parser.h"
+#include "trace.h"
+#include "tree.h"
+#include "workers.h"
+
+#define REPLAY_MAX_SESSIONS 256
+
+// Settings from the command line
+typedef struct
+{
+    int sessions;           // Replays of the trace running at once
+    int fast;               // Don't wait for the recorded start times
+    const char *seed;       // Copied into every session's directory, NULL for none
+    int keep;               // Leave the scratch directory behind
+}replay_options;
+
+// One replay of the whole trace
+typedef struct
+{
+    int index;
+    const replay_options *opts;
+    const trace_record *records;
+    size_t num_records;
+    long long start_ns;         // When every session starts, so they stay in step
+    long long *latency_ns;      // Per record, -1 where it was skipped
+    int skipped;                // Lines cut short for naming paths outside the session's directory
+    int escaped;                // Times a command left the session outside its directory anyway
+    int failed;
+}replay_session;
+
+// A recorded session inside a replay
+typedef struct
+{
+    uint32_t id;
+    shell_session session;
+}replayed_shell;
+
+static int compareLongs(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Value below which fraction of the sorted samples fall
+static long long percentile(const long long *sorted, size_t n, double fraction) {
+    return n > 0 ? sorted[(size_t)(fraction * (n - 1) + 0.5)] : 0;
+}
+
+// Whether the absolute path is root's directory or lies below it
+static int isInside(const char *path, size_t len, const shell_session *root) {
+    return len >= root->cwd_len && strncmp(path, root->cwd_path, root->cwd_len) == 0 &&
+           (path[root->cwd_len] == '/' || path[root->cwd_len] == '\0');
+}
+
+// Whether every argument of cmd, taken as a path from session's directory, stays inside root.
+// Words that aren't paths resolve to names inside it, so they pass.
+static int staysInside(const shell_session *session, const shell_session *root, command_line cmd) {
+    for (int i = 1; i < cmd.num_token - 1; i++) {
+        size_t len;
+        char *path = sessionResolve(session, cmd.command_list[i], &len);
+        int inside = path != NULL && isInside(path, len, root);
+        free(path);
+        if (!inside) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The shell a recorded session runs in, started in root the first time it is seen
+static shell_session *shellFor(replayed_shell **shells, size_t *count, uint32_t id, const shell_session *root) {
+    for (size_t i = 0; i < *count; i++) {
+        if ((*shells)[i].id == id) return &(*shells)[i].session;
+    }
+    replayed_shell *grown = realloc(*shells, (*count + 1) * sizeof(replayed_shell));
+    if (grown == NULL) {
+        return NULL;
+    }
+    *shells = grown;
+    replayed_shell *shell = &grown[*count];
+    if (sessionClone(&shell->session, root) != 0) {
+        return NULL;
+    }
+    shell->id = id;
+    (*count)++;
+    return &shell->session;
+}
+
+/*
+    Description: Runs every record of the trace in the session's own directory, waiting
+    for each one's recorded start unless -fast was given, and times each line.
+        Args:
+            void *arg : The replay_session
+        Returns:
+            void* : NULL
+*/
+static void *replaySession(void *arg) {
+    replay_session *replay = arg;
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    output_stream sink;
+    outInit(&sink, null_fd, OUTPUT_FULL);
+    outUse(&sink);
+    inUse(null_fd);     // cat without files reads nothing rather than the terminal
+
+    // session-N, filled from the seed when there is one
+    char dir[64];
+    snprintf(dir, sizeof(dir), "session-%d", replay->index);
+    shell_session root;
+    int ready = replay->opts->seed != NULL ? copyTree((char *)replay->opts->seed, dir, 0) == 0 :
+                mkdir(dir, 0777) == 0;
+    if (!ready || sessionInit(&root) != 0 || sessionChdir(&root, dir) != 0) {
+        fprintf(stderr, "Couldn't set up %s\n", dir);
+        replay->failed = 1;
+        outUse(NULL);
+        inUse(-1);
+        close(null_fd);
+        return NULL;
+    }
+
+    replayed_shell *shells = NULL;
+    size_t num_shells = 0;
+    parse_arena arena;
+    arena_init(&arena);
+    char *buf = malloc(TRACE_LINE_MAX + 1);
+
+    // Every session starts at the same moment, paced or not, so the elapsed time holds for all
+    struct timespec start = { replay->start_ns / 1000000000LL, replay->start_ns % 1000000000LL };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL);
+
+    for (size_t i = 0; i < replay->num_records && buf != NULL; i++) {
+        const trace_record *record = &replay->records[i];
+        replay->latency_ns[i] = -1;
+        shell_session *session = shellFor(&shells, &num_shells, record->session, &root);
+        if (session == NULL) {
+            replay->skipped++;
+            continue;
+        }
+        if (!replay->opts->fast) {
+            long long due = replay->start_ns + record->start_ns;
+            struct timespec until = { due / 1000000000LL, due % 1000000000LL };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+        }
+
+        memcpy(buf, record->line, record->line_len);
+        buf[record->line_len] = '\n';
+        sessionUse(session);
+        long long begin = nowNanos();
+        parsed_line line = parse_line(&arena, buf, record->line_len + 1);
+        for (int j = 0; j < line.num_commands; j++) {
+            // Checked from where the earlier commands of the line left the session
+            if (!staysInside(session, &root, line.commands[j])) {
+                replay->skipped++;
+                break;
+            }
+            parseCommand(line.commands[j]);     // exit only ends the line, the trace goes on
+            if (!isInside(session->cwd_path, session->cwd_len, &root)) {
+                sessionChdir(session, root.cwd_path);
+                replay->escaped++;
+            }
+        }
+        outFlush();
+        replay->latency_ns[i] = nowNanos() - begin;
+    }
+
+    sessionUse(NULL);
+    for (size_t i = 0; i < num_shells; i++) {
+        sessionFree(&shells[i].session);
+    }
+    free(shells);
+    sessionFree(&root);
+    free(buf);
+    arena_free(&arena);
+    outUse(NULL);
+    outClose(&sink);
+    inUse(-1);
+    close(null_fd);
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-sessions N] [-fast] [-seed dir] [-dir scratch_parent] [-keep] "
+                    "[-stats] trace\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    replay_options opts = {1, 0, NULL, 0};
+    const char *parent = "/tmp";
+    const char *trace_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-fast") == 0) {
+            opts.fast = 1;
+        } else if (strcmp(argv[i], "-keep") == 0) {
+            opts.keep = 1;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            statsEnable(STATS_TABLE);
+        } else if (strcmp(argv[i], "-sessions") == 0 && i + 1 < argc) {
+            opts.sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            opts.seed = argv[++i];
+        } else if (strcmp(argv[i], "-dir") == 0 && i + 1 < argc) {
+            parent = argv[++i];
+        } else if (trace_path == NULL && argv[i][0] != '-') {
+            trace_path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (trace_path == NULL || opts.sessions <= 0 || opts.sessions > REPLAY_MAX_SESSIONS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    trace_reader reader;
+    if (traceRead(&reader, trace_path) != 0) {
+        return 1;
+    }
+    size_t num_records = 0;
+    size_t cap = 1024;
+    trace_record *records = malloc(cap * sizeof(trace_record));
+    int status = 0;
+    while (records != NULL && (status = traceNext(&reader, &records[num_records])) == 1) {
+        if (++num_records == cap) {
+            cap *= 2;
+            trace_record *grown = realloc(records, cap * sizeof(trace_record));
+            if (grown == NULL) {
+                free(records);
+                records = NULL;
+                break;
+            }
+            records = grown;
+        }
+    }
+    if (records == NULL) {
+        fprintf(stderr, "Out of memory reading %s\n", trace_path);
+        traceReadClose(&reader);
+        return 1;
+    }
+    if (status < 0) {
+        fprintf(stderr, "%s is cut short, replaying the %zu lines before that\n", trace_path, num_records);
+    }
+
+    // The seed is named from where we were started, before moving into the scratch directory
+    char *seed = opts.seed != NULL ? realpath(opts.seed, NULL) : NULL;
+    if (opts.seed != NULL && seed == NULL) {
+        perror(opts.seed);
+        return 1;
+    }
+    opts.seed = seed;
+    char scratch[4096];
+    snprintf(scratch, sizeof(scratch), "%s/pseudo-replay.XXXXXX", parent);
+    if (mkdtemp(scratch) == NULL || chdir(scratch) != 0) {
+        perror("scratch directory");
+        return 1;
+    }
+    // Set up here, the sessions share it until they have their own
+    char *scratch_path = strdup(cwdPath());
+
+    replay_session *replays = calloc(opts.sessions, sizeof(replay_session));
+    pthread_t *threads = calloc(opts.sessions, sizeof(pthread_t));
+    long long *latency = calloc((size_t)opts.sessions * (num_records ? num_records : 1), sizeof(long long));
+    if (replays == NULL || threads == NULL || latency == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    parser_select_kernel(SCAN_BEST);    // Before the sessions, parse_line would pick it lazily on each of them
+    long long start = nowNanos() + 1000000;     // A millisecond for the threads to get going
+    for (int i = 0; i < opts.sessions; i++) {
+        replays[i].index = i;
+        replays[i].opts = &opts;
+        replays[i].records = records;
+        replays[i].num_records = num_records;
+        replays[i].start_ns = start;
+        replays[i].latency_ns = latency + (size_t)i * num_records;
+        if (pthread_create(&threads[i], NULL, replaySession, &replays[i]) != 0) {
+            fprintf(stderr, "Couldn't start session %d\n", i);
+            opts.sessions = i;
+            break;
+        }
+    }
+    int skipped = 0, escaped = 0, failed = 0;
+    for (int i = 0; i < opts.sessions; i++) {
+        pthread_join(threads[i], NULL);
+        skipped += replays[i].skipped;
+        escaped += replays[i].escaped;
+        failed += replays[i].failed;
+    }
+    long long elapsed = nowNanos() - start;
+
+    // Jobs the trace started in the background are waited for before the scratch goes
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    output_stream sink;
+    outInit(&sink, null_fd, OUTPUT_FULL);
+    outUse(&sink);
+    jobsFinish();
+    outUse(NULL);
+    outClose(&sink);
+    close(null_fd);
+
+    // Latencies of the lines that ran, next to what they took when recorded
+    size_t ran = 0;
+    size_t total = (size_t)opts.sessions * num_records;
+    for (size_t i = 0; i < total; i++) {
+        if (latency[i] >= 0) latency[ran++] = latency[i];
+    }
+    long long *recorded = malloc((num_records ? num_records : 1) * sizeof(long long));
+    for (size_t i = 0; recorded != NULL && i < num_records; i++) {
+        recorded[i] = records[i].duration_ns;
+    }
+    qsort(latency, ran, sizeof(long long), compareLongs);
+    if (recorded != NULL)
+        qsort(recorded, num_records, sizeof(long long), compareLongs);
+
+    double seconds = elapsed > 0 ? elapsed / 1e9 : 1e-9;
+    printf("{\"trace\":\"%s\",\"lines\":%zu,\"sessions\":%d,\"pacing\":\"%s\",\"seconds\":%.6f,"
+           "\"lines_per_s\":%.1f,\"skipped\":%d,\"escaped\":%d",
+           trace_path, num_records, opts.sessions, opts.fast ? "fast" : "recorded", seconds,
+           ran / seconds, skipped, escaped);
+    if (recorded != NULL) {
+        printf(",\"recorded_p50_us\":%.3f,\"recorded_p99_us\":%.3f,\"recorded_max_us\":%.3f",
+               percentile(recorded, num_records, 0.50) / 1e3, percentile(recorded, num_records, 0.99) / 1e3,
+               num_records ? recorded[num_records - 1] / 1e3 : 0.0);
+    }
+    printf(",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}\n",
+           percentile(latency, ran, 0.50) / 1e3, percentile(latency, ran, 0.90) / 1e3,
+           percentile(latency, ran, 0.99) / 1e3, ran ? latency[ran - 1] / 1e3 : 0.0);
+    fflush(stdout);
+
+    free(recorded);
+    free(latency);
+    free(threads);
+    free(replays);
+    free(records);
+    free(seed);
+    traceReadClose(&reader);
+    if (opts.keep) {
+        fprintf(stderr, "Left the replay in %s\n", scratch_path);
+    } else if (scratch_path == NULL || chdir("/") != 0 || removeTree(scratch_path) != 0) {
+        fprintf(stderr, "Couldn't remove %s\n", scratch);
+    }
+    free(scratch_path);
+    return failed != 0;
+}
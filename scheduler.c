@@ -0,0 +1,372 @@
+/*
+ * scheduler.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Dependency aware parallel execution for file mode. See scheduler.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "scheduler.h"
+#include "dispatch.h"
+#include "jobs.h"
+#include "output.h"
+#include "pipeline.h"
+#include "session.h"
+
+typedef struct
+{
+    char *path;     // Absolute, so different spellings of one path compare equal
+    size_t len;
+    int write;
+}sched_path;
+
+struct sched_task
+{
+    command_line cmd;
+    output_stream out;      // Collected here, written out in script order
+    sched_path *paths;
+    int num_paths;
+
+    int *dependents;        // Later tasks that have to wait for this one
+    int num_dependents;
+    int dependent_cap;
+    atomic_int pending;     // Earlier tasks this one still waits for
+    int done;               // Guarded by the scheduler lock
+};
+
+// Work stealing deque: the owner pushes and pops at the bottom, thieves take from the top
+struct sched_queue
+{
+    pthread_mutex_t lock;
+    int items[SCHED_WINDOW];
+    int top;
+    int bottom;
+    command_scheduler *sched;
+    int index;
+};
+
+// Built-ins that can run alongside others, as opposed to cd, exit, programs and unknown effects
+static bool isBarrier(command_line cmd) {
+    if (cmd.command_list == NULL || cmd.command_list[0] == NULL) {
+        return false;
+    }
+    if (isPipeline(cmd) || isBackground(cmd)) {
+        return true;    // Redirections write files the arguments don't show, jobs outlive the window
+    }
+    const builtin *entry = lookupBuiltin(cmd.command_list[0]);
+    if (entry == NULL) {
+        return true;    // A program from PATH may touch anything
+    }
+    if (entry->flags & (BUILTIN_EXIT | BUILTIN_CHDIR)) {
+        return true;
+    }
+    return !(entry->flags & (BUILTIN_NO_FILES | BUILTIN_READS | BUILTIN_WRITES | BUILTIN_WRITES_LAST));
+}
+
+/*
+    Description: Works out which paths a command reads and writes from its built-in's
+    flags. Commands that won't run (unknown, bad arity) only print, so they get none.
+        Args:
+            struct sched_task *task : Task whose cmd is set, paths are filled in
+        Returns:
+            N/A
+*/
+static void collectPaths(struct sched_task *task) {
+    task->paths = NULL;
+    task->num_paths = 0;
+
+    char **argv = task->cmd.command_list;
+    const builtin *entry = argv != NULL && argv[0] != NULL ? lookupBuiltin(argv[0]) : NULL;
+    if (entry == NULL || (entry->flags & BUILTIN_NO_FILES)) {
+        return;
+    }
+
+    int count = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (argv[i][0] != '-') count++;
+    }
+    task->paths = malloc((count > 0 ? count : 1) * sizeof(sched_path));
+    if (task->paths == NULL) {
+        return;
+    }
+
+    shell_session *session = currentSession();
+    if (count == 0) {
+        // Nothing named, so the command works on the current directory
+        task->paths[0].path = sessionResolve(session, ".", &task->paths[0].len);
+        task->paths[0].write = (entry->flags & BUILTIN_WRITES) != 0;
+        task->num_paths = task->paths[0].path != NULL;
+        return;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (argv[i][0] == '-') continue;
+        sched_path *path = &task->paths[task->num_paths];
+        path->path = sessionResolve(session, argv[i], &path->len);
+        if (path->path == NULL) continue;
+        path->write = (entry->flags & BUILTIN_WRITES) ||
+                      ((entry->flags & BUILTIN_WRITES_LAST) && task->num_paths == count - 1);
+        task->num_paths++;
+    }
+}
+
+// Whether one path is the other or lies inside it
+static bool pathsOverlap(const sched_path *a, const sched_path *b) {
+    const sched_path *shorter = a->len <= b->len ? a : b;
+    const sched_path *longer = shorter == a ? b : a;
+    if (memcmp(shorter->path, longer->path, shorter->len) != 0) {
+        return false;
+    }
+    return longer->len == shorter->len || longer->path[shorter->len] == '/' || shorter->len == 1;
+}
+
+// Two commands conflict if one writes somewhere the other reads or writes
+static bool tasksConflict(const struct sched_task *a, const struct sched_task *b) {
+    for (int i = 0; i < a->num_paths; i++) {
+        for (int j = 0; j < b->num_paths; j++) {
+            if ((a->paths[i].write || b->paths[j].write) && pathsOverlap(&a->paths[i], &b->paths[j])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int addDependent(struct sched_task *task, int dependent) {
+    if (task->num_dependents == task->dependent_cap) {
+        int cap = task->dependent_cap ? task->dependent_cap * 2 : 8;
+        int *grown = realloc(task->dependents, cap * sizeof(int));
+        if (grown == NULL) return -1;
+        task->dependents = grown;
+        task->dependent_cap = cap;
+    }
+    task->dependents[task->num_dependents++] = dependent;
+    return 0;
+}
+
+static void pushTask(command_scheduler *sched, int queue, int task) {
+    struct sched_queue *q = &sched->queues[queue];
+    pthread_mutex_lock(&q->lock);
+    q->items[q->bottom++] = task;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->queued++;
+    pthread_cond_signal(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Pops from the worker's own deque, or steals the oldest task of another one
+static int takeTask(command_scheduler *sched, int self) {
+    int task = -1;
+    for (int i = 0; i < sched->threads && task < 0; i++) {
+        struct sched_queue *q = &sched->queues[(self + i) % sched->threads];
+        pthread_mutex_lock(&q->lock);
+        if (q->bottom > q->top) {
+            task = i == 0 ? q->items[--q->bottom] : q->items[q->top++];
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    if (task >= 0) {
+        pthread_mutex_lock(&sched->lock);
+        sched->queued--;
+        pthread_mutex_unlock(&sched->lock);
+    }
+    return task;
+}
+
+// Runs one command into its own stream, then releases whatever was waiting on it
+static void runTask(command_scheduler *sched, int self, int index) {
+    struct sched_task *task = &sched->tasks[index];
+
+    outUse(&task->out);
+    parseCommand(task->cmd);
+    outUse(NULL);
+
+    for (int i = 0; i < task->num_dependents; i++) {
+        int next = task->dependents[i];
+        if (atomic_fetch_sub(&sched->tasks[next].pending, 1) == 1) {
+            pushTask(sched, self, next);
+        }
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    task->done = 1;
+    pthread_cond_broadcast(&sched->task_done);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+static void *workerMain(void *arg) {
+    struct sched_queue *queue = arg;
+    command_scheduler *sched = queue->sched;
+
+    while (1) {
+        int task = takeTask(sched, queue->index);
+        if (task >= 0) {
+            runTask(sched, queue->index, task);
+            continue;
+        }
+        pthread_mutex_lock(&sched->lock);
+        while (sched->queued == 0 && !sched->stopping) {
+            pthread_cond_wait(&sched->work_ready, &sched->lock);
+        }
+        int stop = sched->stopping && sched->queued == 0;
+        pthread_mutex_unlock(&sched->lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+/*
+    Description: Runs n commands that contain no barrier. Each one waits only for the
+    earlier commands it conflicts with; output is committed strictly in order.
+        Args:
+            command_scheduler *sched : Running scheduler
+            command_line *commands : The commands, in script order
+            int n : How many, at most SCHED_WINDOW
+        Returns:
+            N/A
+*/
+static void runWindow(command_scheduler *sched, command_line *commands, int n) {
+    struct sched_task *tasks = sched->tasks;
+
+    for (int i = 0; i < n; i++) {
+        tasks[i].cmd = commands[i];
+        outInit(&tasks[i].out, OUTPUT_MEMORY, OUTPUT_FULL);
+        collectPaths(&tasks[i]);
+        tasks[i].num_dependents = 0;
+        tasks[i].done = 0;
+    }
+
+    // Every earlier command it conflicts with has to finish first
+    int ready[SCHED_WINDOW];
+    int num_ready = 0;
+    for (int i = 0; i < n; i++) {
+        int pending = 0;
+        for (int j = 0; j < i; j++) {
+            if (tasksConflict(&tasks[j], &tasks[i]) && addDependent(&tasks[j], i) == 0) {
+                pending++;
+            }
+        }
+        atomic_init(&tasks[i].pending, pending);
+        if (pending == 0) {
+            ready[num_ready++] = i;
+        }
+    }
+
+    // The ready list is fixed before the first push, once workers run they release the rest
+    for (int q = 0; q < sched->threads; q++) {
+        pthread_mutex_lock(&sched->queues[q].lock);
+        sched->queues[q].top = 0;
+        sched->queues[q].bottom = 0;
+        pthread_mutex_unlock(&sched->queues[q].lock);
+    }
+    for (int i = 0; i < num_ready; i++) {
+        pushTask(sched, i % sched->threads, ready[i]);
+    }
+
+    // Commit each command's output as soon as everything before it is out
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&sched->lock);
+        while (!tasks[i].done) {
+            pthread_cond_wait(&sched->task_done, &sched->lock);
+        }
+        pthread_mutex_unlock(&sched->lock);
+
+        if (tasks[i].out.len > 0) {
+            outWrite(tasks[i].out.buf, tasks[i].out.len);
+        }
+        outClose(&tasks[i].out);
+        for (int p = 0; p < tasks[i].num_paths; p++) {
+            free(tasks[i].paths[p].path);
+        }
+        free(tasks[i].paths);
+    }
+}
+
+int schedulerStart(command_scheduler *sched, int threads) {
+    memset(sched, 0, sizeof(*sched));
+    sched->workers = calloc(threads, sizeof(pthread_t));
+    sched->queues = calloc(threads, sizeof(struct sched_queue));
+    sched->tasks = calloc(SCHED_WINDOW, sizeof(struct sched_task));
+    if (sched->workers == NULL || sched->queues == NULL || sched->tasks == NULL) {
+        free(sched->workers);
+        free(sched->queues);
+        free(sched->tasks);
+        return -1;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work_ready, NULL);
+    pthread_cond_init(&sched->task_done, NULL);
+
+    currentSession();   // Set up before any worker can race to do it
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&sched->queues[i].lock, NULL);
+        sched->queues[i].sched = sched;
+        sched->queues[i].index = i;
+    }
+    // Workers read the thread count, so it is set before the first one starts
+    sched->threads = threads;
+    int started = 0;
+    while (started < threads && pthread_create(&sched->workers[started], NULL, workerMain, &sched->queues[started]) == 0) {
+        started++;
+    }
+    if (started < threads) {
+        sched->threads = started;   // Only these get joined
+        schedulerStop(sched);
+        return -1;
+    }
+    return 0;
+}
+
+bool schedulerRun(command_scheduler *sched, parsed_line line) {
+    int i = 0;
+    while (i < line.num_commands) {
+        int n = 0;
+        while (i + n < line.num_commands && n < SCHED_WINDOW && !isBarrier(line.commands[i + n])) {
+            n++;
+        }
+        if (n <= 1) {
+            // A barrier, or a lone command with nothing to overlap with
+            if (!parseCommand(line.commands[i])) {
+                return false;
+            }
+            i++;
+        } else {
+            runWindow(sched, line.commands + i, n);
+            i += n;
+        }
+    }
+    return true;
+}
+
+void schedulerStop(command_scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = 1;
+    pthread_cond_broadcast(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+
+    for (int i = 0; i < sched->threads; i++) {
+        pthread_join(sched->workers[i], NULL);
+    }
+    for (int i = 0; i < SCHED_WINDOW; i++) {
+        free(sched->tasks[i].dependents);
+    }
+    for (int i = 0; i < sched->threads; i++) {
+        pthread_mutex_destroy(&sched->queues[i].lock);
+    }
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->work_ready);
+    pthread_cond_destroy(&sched->task_done);
+    free(sched->workers);
+    free(sched->queues);
+    free(sched->tasks);
+    sched->workers = NULL;
+    sched->queues = NULL;
+    sched->tasks = NULL;
+    sched->threads = 0;
+}
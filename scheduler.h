@@ -0,0 +1,52 @@
+/*
+ * scheduler.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Parallel file mode. The commands of a parsed block are checked for
+ *			 the paths they read and write; commands that don't overlap run at
+ *			 the same time on a work stealing pool, while cd, exit and anything
+ *			 that doesn't declare its paths act as barriers. Every command's
+ *			 output is collected in memory and written in script order, so
+ *			 output.txt is the same as in sequential mode.
+ *
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "string_parser.h"
+
+#define SCHED_WINDOW 256    // Most commands analysed and in flight together
+
+struct sched_task;
+struct sched_queue;
+
+typedef struct
+{
+    int threads;
+    pthread_t *workers;
+    struct sched_queue *queues;     // One deque per worker
+    struct sched_task *tasks;       // The window being run, SCHED_WINDOW entries
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;      // Workers sleep here when every deque is empty
+    pthread_cond_t task_done;       // The committing thread waits here for the next task
+    int queued;                     // Tasks sitting in deques, guarded by lock
+    int stopping;
+}command_scheduler;
+
+//Starts threads workers. Returns 0, or -1 if the pool couldn't be set up.
+int schedulerStart(command_scheduler *sched, int threads);
+
+//Runs the commands of line, in parallel where that can't be told apart from
+//running them in order. Returns false once exit has run, like parseCommand.
+bool schedulerRun(command_scheduler *sched, parsed_line line);
+
+//Stops the workers and frees the pool
+void schedulerStop(command_scheduler *sched);
+
+
+#endif /* SCHEDULER_H_ */
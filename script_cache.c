@@ -0,0 +1,666 @@
+/*
+ * script_cache.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Compiling file mode scripts and caching the result. See script_cache.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "script_cache.h"
+#include "dispatch.h"
+#include "jobs.h"
+#include "output.h"
+#include "pipeline.h"
+#include "script_reader.h"
+#include "string_parser.h"
+
+#define CACHE_MAGIC "PSHCOMP"
+
+// IDs at the top of the range stand for commands that can't be resolved ahead of time
+#define ID_LOOKUP    0xffffffffu    // Not a built-in, found (or not) in PATH when it runs
+#define ID_BAD_ARITY 0xfffffffeu    // A built-in with the wrong number of arguments
+#define ID_PIPELINE  0xfffffffdu    // Has pipes or redirections, goes back through parseCommand
+#define ID_BACKGROUND 0xfffffffcu   // Ends in "&", goes back through parseCommand to start a job
+
+// Start of a cache file. The script's path follows it, then the sections, each 8 byte aligned.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t path_len;              // Without its NUL
+    uint64_t builtins_sig;          // The built-in table the IDs and arity checks were made with
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    int64_t built_sec;              // When the script was read, for the racy check
+    uint64_t content_hash;
+    uint64_t num_commands;
+    uint64_t num_words;
+    uint64_t pool_size;
+    uint64_t max_argc;
+    uint64_t max_chars;             // Longest command's words with their NULs
+}cache_header;
+
+// Commands are run in order, so each one's words simply follow the previous one's
+struct cache_command
+{
+    uint32_t id;
+    uint32_t argc;
+};
+
+// Growable arrays the compiler fills in
+typedef struct
+{
+    struct cache_command *commands;
+    size_t num_commands, command_cap;
+    uint32_t *words;
+    size_t num_words, word_cap;
+    char *pool;
+    size_t pool_size, pool_cap;
+    uint32_t *interned;             // Pool offset + 1 of each distinct word, 0 for empty
+    size_t intern_count, intern_cap;
+    uint64_t max_argc, max_chars;
+}compiler;
+
+static uint64_t fnv64(const void *data, size_t len, uint64_t hash) {
+    const unsigned char *c = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= c[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/*
+    Description: 64 bit hash of the script's bytes. Four independent lanes take 8 bytes
+    each per step, so the multiplies overlap and a script hashes at several GB/s.
+        Args:
+            const unsigned char *data : Bytes to hash
+            size_t len : Their number
+        Returns:
+            uint64_t : The hash
+*/
+static uint64_t hashContent(const unsigned char *data, size_t len) {
+    const uint64_t prime = 0x9e3779b97f4a7c15ull;
+    uint64_t lanes[4] = {len, 0x243f6a8885a308d3ull, 0x13198a2e03707344ull, 0xa4093822299f31d0ull};
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t word;
+            memcpy(&word, data + i + l * 8, 8);
+            lanes[l] = (lanes[l] ^ word) * prime;
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+    uint64_t hash = fnv64(data + i, len - i, 14695981039346656037ull);
+    for (int l = 0; l < 4; l++) {
+        hash = (hash ^ lanes[l]) * prime;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// Fingerprint of the built-in table, a cache made by a different build doesn't match it
+static uint64_t builtinsSignature(void) {
+    uint64_t sig = fnv64(CACHE_MAGIC, sizeof(CACHE_MAGIC), 14695981039346656037ull);
+    for (int id = 0; id < builtinCount(); id++) {
+        const builtin *entry = builtinById(id);
+        int shape[3] = {entry->min_args, entry->max_args, (int)entry->flags};
+        sig = fnv64(entry->name, strlen(entry->name) + 1, sig);
+        sig = fnv64(shape, sizeof(shape), sig);
+    }
+    return sig;
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// Doubles *cap until it holds need elements of size bytes. Returns -1 if memory ran out.
+static int reserve(void **array, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t grown = *cap ? *cap : 1024;
+    while (grown < need) grown *= 2;
+    void *bigger = realloc(*array, grown * size);
+    if (bigger == NULL) {
+        return -1;
+    }
+    *array = bigger;
+    *cap = grown;
+    return 0;
+}
+
+// Doubles the intern table and re-inserts every word
+static int growInterned(compiler *comp) {
+    size_t cap = comp->intern_cap ? comp->intern_cap * 2 : 4096;
+    uint32_t *table = calloc(cap, sizeof(uint32_t));
+    if (table == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < comp->intern_cap; i++) {
+        if (comp->interned[i] != 0) {
+            const char *word = comp->pool + comp->interned[i] - 1;
+            size_t j = fnv64(word, strlen(word), 14695981039346656037ull) & (cap - 1);
+            while (table[j] != 0) j = (j + 1) & (cap - 1);
+            table[j] = comp->interned[i];
+        }
+    }
+    free(comp->interned);
+    comp->interned = table;
+    comp->intern_cap = cap;
+    return 0;
+}
+
+// Pool offset of word, adding it the first time it is seen. Returns -1 if memory ran out.
+static int64_t intern(compiler *comp, const char *word) {
+    if ((comp->intern_count + 1) * 2 > comp->intern_cap && growInterned(comp) != 0) {
+        return -1;
+    }
+    size_t len = strlen(word);
+    size_t i = fnv64(word, len, 14695981039346656037ull) & (comp->intern_cap - 1);
+    while (comp->interned[i] != 0) {
+        if (strcmp(comp->pool + comp->interned[i] - 1, word) == 0) {
+            return comp->interned[i] - 1;
+        }
+        i = (i + 1) & (comp->intern_cap - 1);
+    }
+    if (comp->pool_size + len + 1 >= UINT32_MAX ||
+        reserve((void **)&comp->pool, &comp->pool_cap, comp->pool_size + len + 1, 1) != 0) {
+        return -1;
+    }
+    int64_t offset = comp->pool_size;
+    memcpy(comp->pool + offset, word, len + 1);
+    comp->pool_size += len + 1;
+    comp->interned[i] = (uint32_t)offset + 1;
+    comp->intern_count++;
+    return offset;
+}
+
+// Resolves one parsed command and appends it. Returns -1 if memory ran out.
+static int compileCommand(compiler *comp, command_line cmd) {
+    int argc = cmd.num_token - 1;
+    if (argc <= 0 || reserve((void **)&comp->commands, &comp->command_cap,
+                             comp->num_commands + 1, sizeof(struct cache_command)) != 0 ||
+        reserve((void **)&comp->words, &comp->word_cap, comp->num_words + argc, sizeof(uint32_t)) != 0) {
+        return argc <= 0 ? 0 : -1;
+    }
+
+    struct cache_command *out = &comp->commands[comp->num_commands];
+    const builtin *entry = lookupBuiltin(cmd.command_list[0]);
+    if (isBackground(cmd)) {
+        out->id = ID_BACKGROUND;
+    } else if (isPipeline(cmd)) {
+        out->id = ID_PIPELINE;
+    } else if (entry == NULL) {
+        out->id = ID_LOOKUP;
+    } else if (!arityOk(entry, argc - 1)) {
+        out->id = ID_BAD_ARITY;
+    } else {
+        out->id = builtinId(entry);
+    }
+    out->argc = argc;
+
+    uint64_t chars = 0;
+    for (int i = 0; i < argc; i++) {
+        int64_t offset = intern(comp, cmd.command_list[i]);
+        if (offset < 0) {
+            return -1;
+        }
+        comp->words[comp->num_words++] = (uint32_t)offset;
+        chars += strlen(cmd.command_list[i]) + 1;
+    }
+    if ((uint64_t)argc > comp->max_argc) comp->max_argc = argc;
+    if (chars > comp->max_chars) comp->max_chars = chars;
+    comp->num_commands++;
+    return 0;
+}
+
+static void compilerFree(compiler *comp) {
+    free(comp->commands);
+    free(comp->words);
+    free(comp->pool);
+    free(comp->interned);
+}
+
+/*
+    Description: Parses the whole script the same way file mode does, a block of lines
+    per parse_line call, and lays the result out as a cache image.
+        Args:
+            const char *path : The script
+            const cache_header *key : Identity of the script, copied into the image
+            const char *real : The script's real path, stored after the header
+            char **image, size_t *image_len : Get the malloc'd image
+        Returns:
+            int : 0, or -1 if the script couldn't be read or memory ran out
+*/
+static int compileScript(const char *path, const cache_header *key, const char *real,
+                         char **image, size_t *image_len) {
+    script_reader reader;
+    if (scriptOpen(&reader, path) != 0) {
+        return -1;
+    }
+    compiler comp;
+    memset(&comp, 0, sizeof(comp));
+    parse_arena arena;
+    arena_init(&arena);
+
+    int status = 0;
+    char *block;
+    size_t len;
+    while (status == 0 && (block = scriptNextBlock(&reader, SCRIPT_BLOCK_SIZE, &len)) != NULL) {
+        parsed_line line = parse_line(&arena, block, len);
+        for (int i = 0; i < line.num_commands && status == 0; i++) {
+            status = compileCommand(&comp, line.commands[i]);
+        }
+    }
+    arena_free(&arena);
+    scriptClose(&reader);
+
+    size_t path_len = strlen(real);
+    size_t commands_off = align8(sizeof(cache_header) + path_len + 1);
+    size_t words_off = commands_off + comp.num_commands * sizeof(struct cache_command);
+    size_t pool_off = align8(words_off + comp.num_words * sizeof(uint32_t));
+    size_t total = pool_off + comp.pool_size;
+    char *out = status == 0 ? calloc(1, total) : NULL;
+    if (out == NULL) {
+        compilerFree(&comp);
+        return -1;
+    }
+
+    cache_header *header = (cache_header *)out;
+    *header = *key;
+    header->path_len = path_len;
+    header->num_commands = comp.num_commands;
+    header->num_words = comp.num_words;
+    header->pool_size = comp.pool_size;
+    header->max_argc = comp.max_argc;
+    header->max_chars = comp.max_chars;
+    memcpy(out + sizeof(cache_header), real, path_len + 1);
+    memcpy(out + commands_off, comp.commands, comp.num_commands * sizeof(struct cache_command));
+    memcpy(out + words_off, comp.words, comp.num_words * sizeof(uint32_t));
+    memcpy(out + pool_off, comp.pool, comp.pool_size);
+    compilerFree(&comp);
+
+    *image = out;
+    *image_len = total;
+    return 0;
+}
+
+/*
+    Description: Points script at the sections of image and checks that they hang
+    together, so a truncated or damaged cache file is rebuilt rather than trusted.
+        Args:
+            compiled_script *script : Gets the section pointers
+            char *image, size_t len : A cache image
+        Returns:
+            int : 0, or -1 if the image is inconsistent
+*/
+static int attachImage(compiled_script *script, char *image, size_t len) {
+    const cache_header *header = (const cache_header *)image;
+    if (len < sizeof(cache_header) || header->path_len >= len ||
+        header->num_commands > len || header->num_words > len || header->max_chars > len) {
+        return -1;
+    }
+    size_t commands_off = align8(sizeof(cache_header) + header->path_len + 1);
+    size_t words_off = commands_off + header->num_commands * sizeof(struct cache_command);
+    size_t pool_off = align8(words_off + header->num_words * sizeof(uint32_t));
+    if (pool_off > len || len - pool_off != header->pool_size ||
+        (header->pool_size > 0 && image[len - 1] != '\0')) {
+        return -1;
+    }
+
+    script->commands = (const struct cache_command *)(image + commands_off);
+    script->words = (const uint32_t *)(image + words_off);
+    script->pool = image + pool_off;
+    script->num_commands = header->num_commands;
+    script->num_words = header->num_words;
+    script->pool_size = header->pool_size;
+
+    uint64_t words = 0;
+    for (uint64_t i = 0; i < script->num_commands; i++) {
+        const struct cache_command *cmd = &script->commands[i];
+        if (cmd->argc == 0 || cmd->argc > header->max_argc || cmd->argc > script->num_words - words) {
+            return -1;
+        }
+        if (cmd->id < ID_BACKGROUND && builtinById(cmd->id) == NULL) {
+            return -1;
+        }
+        // compiledRun gathers a command's words into a buffer of max_chars
+        uint64_t chars = 0;
+        for (uint32_t j = 0; j < cmd->argc; j++) {
+            uint32_t word = script->words[words + j];
+            if (word >= script->pool_size) {
+                return -1;
+            }
+            chars += strlen(script->pool + word) + 1;
+        }
+        if (chars > header->max_chars) {
+            return -1;
+        }
+        words += cmd->argc;
+    }
+    if (words != script->num_words) {
+        return -1;
+    }
+    return 0;
+}
+
+// Makes dir and its parent if they are missing, the cache is private to the user
+static int makeCacheDir(const char *dir) {
+    if (mkdir(dir, 0700) == 0 || errno == EEXIST) {
+        return 0;
+    }
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", dir);
+    char *slash = strrchr(parent, '/');
+    if (slash == NULL || slash == parent) {
+        return -1;
+    }
+    *slash = '\0';
+    if (mkdir(parent, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return mkdir(dir, 0700) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+// Where the cache file for the script at real lives. Returns -1 if there is no cache directory.
+static int cachePath(const char *real, char *out, size_t size, int create) {
+    char dir[PATH_MAX];
+    const char *env = getenv("PSEUDO_SHELL_CACHE");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if (xdg != NULL && xdg[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/pseudo-shell", xdg);
+    } else if (home != NULL && home[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/.cache/pseudo-shell", home);
+    } else {
+        return -1;
+    }
+    if (create && makeCacheDir(dir) != 0) {
+        return -1;
+    }
+    uint64_t key = fnv64(real, strlen(real), 14695981039346656037ull);
+    int n = snprintf(out, size, "%s/%016llx.psc", dir, (unsigned long long)key);
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+// Writes the image under a temporary name and renames it over the old one, so readers never see half
+static void saveImage(const char *real, const char *image, size_t len) {
+    char path[PATH_MAX], temp[PATH_MAX + 32];
+    if (cachePath(real, path, sizeof(path), 1) != 0) {
+        return;
+    }
+    snprintf(temp, sizeof(temp), "%s.%ld", path, (long)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t written = write(fd, image + done, len - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            break;
+        }
+        done += written;
+    }
+    if (close(fd) != 0 || done != len || rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+/*
+    Description: Maps the cache file for the script and checks that it describes the
+    script as it is now. The hash is only compared when the script changed so close
+    to compile time that the timestamps can't be trusted; a passing check then moves
+    the recorded time forward so the next run can skip the hash.
+        Args:
+            compiled_script *script : Filled in on success
+            const cache_header *key : The script's identity now, with its hash unset
+            const char *real : Its real path
+            const unsigned char *text, size_t text_len : The script's bytes, for the hash
+        Returns:
+            int : 0 if the cache is usable, -1 if it has to be rebuilt
+*/
+static int mapCache(compiled_script *script, const cache_header *key, const char *real,
+                    const unsigned char *text, size_t text_len) {
+    char path[PATH_MAX];
+    if (cachePath(real, path, sizeof(path), 0) != 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(cache_header)) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    const cache_header *header = (const cache_header *)image;
+    int valid = memcmp(header->magic, key->magic, sizeof(header->magic)) == 0 &&
+                header->version == key->version && header->builtins_sig == key->builtins_sig &&
+                header->dev == key->dev && header->ino == key->ino && header->size == key->size &&
+                header->mtime_sec == key->mtime_sec && header->mtime_nsec == key->mtime_nsec &&
+                header->ctime_sec == key->ctime_sec && header->ctime_nsec == key->ctime_nsec &&
+                header->path_len == strlen(real) && (size_t)st.st_size > sizeof(cache_header) + header->path_len &&
+                memcmp(image + sizeof(cache_header), real, header->path_len + 1) == 0;
+    if (valid && key->ctime_sec + SCRIPT_CACHE_RACY_SEC >= header->built_sec) {
+        valid = hashContent(text, text_len) == header->content_hash;
+        if (valid && key->ctime_sec + SCRIPT_CACHE_RACY_SEC < key->built_sec) {
+            int64_t now = key->built_sec;
+            if (pwrite(fd, &now, sizeof(now), offsetof(cache_header, built_sec)) != sizeof(now)) {
+                // Harmless, the next run compares the hash again
+            }
+        }
+    }
+    close(fd);
+    if (!valid || attachImage(script, image, st.st_size) != 0) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+    script->image = image;
+    script->image_len = st.st_size;
+    script->mapped = 1;
+    script->from_cache = 1;
+    madvise(image, st.st_size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+int compiledLoad(compiled_script *script, const char *path) {
+    memset(script, 0, sizeof(*script));
+    char real[PATH_MAX];
+    if (realpath(path, real) == NULL) {
+        return -1;
+    }
+    int fd = open(real, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > SCRIPT_CACHE_MAX) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    cache_header key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.magic, CACHE_MAGIC, sizeof(key.magic));
+    key.version = SCRIPT_CACHE_VERSION;
+    key.builtins_sig = builtinsSignature();
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime_sec = st.st_mtim.tv_sec;
+    key.mtime_nsec = st.st_mtim.tv_nsec;
+    key.ctime_sec = st.st_ctim.tv_sec;
+    key.ctime_nsec = st.st_ctim.tv_nsec;
+    key.built_sec = time(NULL);     // Taken before the script is read, any later change looks racy
+
+    // Mapped only for the hash, which most runs never take
+    unsigned char *text = NULL;
+    if (st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    int status = 0;
+    if (mapCache(script, &key, real, text, st.st_size) != 0) {
+        key.content_hash = hashContent(text, st.st_size);
+        status = compileScript(real, &key, real, &script->image, &script->image_len);
+        if (status == 0 && attachImage(script, script->image, script->image_len) != 0) {
+            free(script->image);
+            script->image = NULL;
+            status = -1;
+        }
+        if (status == 0) {
+            saveImage(real, script->image, script->image_len);
+        }
+    }
+    if (text != NULL) {
+        munmap(text, st.st_size);
+    }
+    return status;
+}
+
+// Copies the words of cmd, starting with words[first], into chars and points argv at
+// them, returns the end of the copies. Commands may write into their arguments, and
+// the pool is shared by every command using a word.
+static char *loadArgv(const compiled_script *script, const struct cache_command *cmd, uint64_t first,
+                      char **argv, char *chars) {
+    for (uint32_t i = 0; i < cmd->argc; i++) {
+        const char *word = script->pool + script->words[first + i];
+        size_t len = strlen(word) + 1;
+        memcpy(chars, word, len);
+        argv[i] = chars;
+        chars += len;
+    }
+    argv[cmd->argc] = NULL;
+    return chars;
+}
+
+static bool runCompiled(const struct cache_command *cmd, char **argv) {
+    switch (cmd->id) {
+    case ID_PIPELINE:
+    case ID_BACKGROUND:
+        return parseCommand((command_line){argv, cmd->argc + 1});
+    case ID_LOOKUP:
+        return runArgv(cmd->argc, argv);
+    case ID_BAD_ARITY:
+        printWrongNumArgs();
+        return true;
+    default:
+        return runBuiltin(builtinById(cmd->id), cmd->argc, argv);
+    }
+}
+
+// Hands the commands to the scheduler SCRIPT_CACHE_CHUNK at a time, as parsed lines
+static bool runScheduled(const compiled_script *script, command_scheduler *sched) {
+    command_line *commands = malloc(SCRIPT_CACHE_CHUNK * sizeof(command_line));
+    char **argv = NULL;
+    char *chars = NULL;
+    size_t argv_cap = 0, chars_cap = 0;
+    bool running = true;
+    bool no_memory = commands == NULL;
+
+    uint64_t word = 0;
+    for (uint64_t first = 0; running && !no_memory && first < script->num_commands; first += SCRIPT_CACHE_CHUNK) {
+        uint64_t n = script->num_commands - first;
+        if (n > SCRIPT_CACHE_CHUNK) n = SCRIPT_CACHE_CHUNK;
+
+        // Every command of the chunk keeps its own copy of its words until the chunk is done
+        size_t slots = 0, bytes = 0;
+        for (uint64_t i = 0, w = word; i < n; i++) {
+            uint32_t argc = script->commands[first + i].argc;
+            for (uint32_t a = 0; a < argc; a++) {
+                bytes += strlen(script->pool + script->words[w + a]) + 1;
+            }
+            slots += argc + 1;
+            w += argc;
+        }
+        if (reserve((void **)&argv, &argv_cap, slots, sizeof(char *)) != 0 ||
+            reserve((void **)&chars, &chars_cap, bytes, 1) != 0) {
+            no_memory = true;
+            break;
+        }
+
+        char **next_argv = argv;
+        char *next_chars = chars;
+        for (uint64_t i = 0; i < n; i++) {
+            const struct cache_command *cmd = &script->commands[first + i];
+            next_chars = loadArgv(script, cmd, word, next_argv, next_chars);
+            word += cmd->argc;
+            commands[i].command_list = next_argv;
+            commands[i].num_token = cmd->argc + 1;
+            next_argv += cmd->argc + 1;
+        }
+        running = schedulerRun(sched, (parsed_line){commands, (int)n});
+    }
+    if (no_memory) {
+        outPrint("Error! out of memory\n");
+    }
+    free(commands);
+    free(argv);
+    free(chars);
+    return running;
+}
+
+bool compiledRun(compiled_script *script, command_scheduler *sched) {
+    if (sched != NULL) {
+        return runScheduled(script, sched);
+    }
+    const cache_header *header = (const cache_header *)script->image;
+    char **argv = malloc((header->max_argc + 1) * sizeof(char *));
+    char *chars = malloc(header->max_chars + 1);
+    bool running = argv != NULL && chars != NULL;
+    if (!running) {
+        outPrint("Error! out of memory\n");
+    }
+    uint64_t word = 0;
+    bool jobs = false;      // Finished jobs are looked for once the script has started one
+    for (uint64_t i = 0; running && i < script->num_commands; i++) {
+        loadArgv(script, &script->commands[i], word, argv, chars);
+        word += script->commands[i].argc;
+        running = runCompiled(&script->commands[i], argv);
+        jobs = jobs || script->commands[i].id == ID_BACKGROUND;
+        if (jobs)
+            jobsNotify();
+    }
+    free(argv);
+    free(chars);
+    return running;
+}
+
+void compiledFree(compiled_script *script) {
+    if (script->image == NULL) {
+        return;
+    }
+    if (script->mapped) {
+        munmap(script->image, script->image_len);
+    } else {
+        free(script->image);
+    }
+    script->image = NULL;
+}
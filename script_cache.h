@@ -0,0 +1,68 @@
+/*
+ * script_cache.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Compiled scripts for file mode. The first run of a script parses
+ *			 it once into a flat image: every command as a built-in ID with its
+ *			 arity already checked, and its words as offsets into a pool where
+ *			 each distinct string is stored once. The image is saved in the
+ *			 cache directory, and later runs map it and go straight to running
+ *			 commands, with no tokenizing and no name lookups.
+ *
+ *			 A cache file is keyed by the script's real path and is used only
+ *			 while the script's device, inode, size, mtime and ctime are those
+ *			 recorded in it. A script changed within SCRIPT_CACHE_RACY_SEC of
+ *			 being compiled could keep all of those, so its content hash is
+ *			 compared as well. Stale or damaged files are simply rebuilt.
+ *
+ *			 The cache lives in $PSEUDO_SHELL_CACHE, else in pseudo-shell under
+ *			 $XDG_CACHE_HOME or ~/.cache.
+ *
+ */
+
+#ifndef SCRIPT_CACHE_H_
+#define SCRIPT_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "scheduler.h"
+
+#define SCRIPT_CACHE_VERSION 2
+#define SCRIPT_CACHE_MAX (256L * 1024 * 1024)   // Larger scripts are streamed as before
+#define SCRIPT_CACHE_RACY_SEC 2                 // Timestamp granularity the stat check can't see through
+#define SCRIPT_CACHE_CHUNK 4096                 // Commands handed to the parallel scheduler at once
+
+struct cache_command;
+
+typedef struct
+{
+    char *image;                    // Whole compiled form, mapped from the cache or built this run
+    size_t image_len;
+    int mapped;                     // image is a mapping rather than malloc'd
+    const struct cache_command *commands;
+    const uint32_t *words;          // Pool offset of every word, each command's in a row
+    const char *pool;               // NUL terminated strings, each stored once
+    uint64_t num_commands;
+    uint64_t num_words;
+    uint64_t pool_size;
+    int from_cache;                 // 1 if image came from disk
+}compiled_script;
+
+//Gets the compiled form of the script at path, from the cache when it is up to
+//date and otherwise by compiling the script (and saving it if the cache
+//directory is writable). Returns 0, or -1 if the script can't be compiled
+//(not a regular file, or larger than SCRIPT_CACHE_MAX), in which case the
+//caller runs it the usual way.
+int compiledLoad(compiled_script *script, const char *path);
+
+//Runs every command of script in order, or through sched if it isn't NULL.
+//Output is the same as running the script's text. Returns false once exit has run.
+bool compiledRun(compiled_script *script, command_scheduler *sched);
+
+//Releases the image
+void compiledFree(compiled_script *script);
+
+
+#endif /* SCRIPT_CACHE_H_ */
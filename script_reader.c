@@ -0,0 +1,249 @@
+/*
+ * script_reader.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Mapped line reader for file mode. See script_reader.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "script_reader.h"
+
+/*
+    Description: Maps the window of the script starting at off (page aligned). The
+    mapping is private and writable so the parser can terminate tokens in place.
+        Args:
+            script_reader *reader : Reader whose window is replaced
+            off_t off : Page aligned offset of the new window
+            size_t min_len : The window is doubled until it is at least this long
+        Returns:
+            int : 0, or -1 if the file could not be mapped
+*/
+static int mapWindow(script_reader *reader, off_t off, size_t min_len) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->map_len);
+        reader->map = NULL;
+    }
+
+    size_t len = SCRIPT_WINDOW_SIZE;
+    while (len < min_len) len *= 2;
+    if ((off_t)len > reader->file_size - off) {
+        len = reader->file_size - off;
+    }
+
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, reader->fd, off);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    reader->map = map;
+    reader->map_len = len;
+    reader->map_off = off;
+    reader->released = 0;
+    return 0;
+}
+
+// Makes sure buf has room for at least need bytes
+static int reserveBuffer(script_reader *reader, size_t need) {
+    if (need <= reader->buf_cap) {
+        return 0;
+    }
+    size_t cap = reader->buf_cap ? reader->buf_cap : SCRIPT_CHUNK_SIZE + 1;
+    while (cap < need) cap *= 2;
+    char *grown = realloc(reader->buf, cap);
+    if (grown == NULL) {
+        return -1;
+    }
+    reader->buf = grown;
+    reader->buf_cap = cap;
+    return 0;
+}
+
+/*
+    Description: Gives back the pages of the window that lie wholly before the line
+    about to be returned. The parser wrote into them, so they are private copies;
+    dropping them keeps memory flat no matter how long the script is.
+        Args:
+            script_reader *reader : Mapped reader
+            size_t line_start : Offset in the window of the line being returned
+        Returns:
+            N/A
+*/
+static void releaseParsed(script_reader *reader, size_t line_start) {
+    if (line_start - reader->released < SCRIPT_RELEASE_SIZE) {
+        return;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = line_start - line_start % page;
+    madvise(reader->map + reader->released, end - reader->released, MADV_DONTNEED);
+    reader->released = end;
+}
+
+static char *nextChunked(script_reader *reader, size_t *len) {
+    while (1) {
+        char *start = reader->buf + reader->pos;
+        size_t avail = reader->buf_len - reader->pos;
+        char *newline = avail > 0 ? memchr(start, '\n', avail) : NULL;
+
+        if (newline != NULL) {
+            *len = newline - start;
+            reader->pos += *len + 1;
+            return start;
+        }
+        if (reader->eof) {
+            if (avail == 0) {
+                return NULL;
+            }
+            // Last line without a newline, reads always leave one spare byte for line[len]
+            reader->pos = reader->buf_len;
+            *len = avail;
+            return start;
+        }
+
+        // Move the partial line to the front and read the next chunk behind it
+        if (reader->buf != NULL) {
+            memmove(reader->buf, start, avail);
+        }
+        reader->buf_len = avail;
+        reader->pos = 0;
+        if (reserveBuffer(reader, avail + SCRIPT_CHUNK_SIZE + 1) != 0) {
+            reader->eof = 1;
+            continue;
+        }
+
+        ssize_t nread = read(reader->fd, reader->buf + reader->buf_len, reader->buf_cap - reader->buf_len - 1);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            reader->eof = 1;
+        } else {
+            reader->buf_len += nread;
+        }
+    }
+}
+
+static char *nextMapped(script_reader *reader, size_t *len) {
+    while (1) {
+        if (reader->map_off + (off_t)reader->pos >= reader->file_size) {
+            return NULL;
+        }
+
+        char *start = reader->map + reader->pos;
+        size_t avail = reader->map_len - reader->pos;
+        char *newline = memchr(start, '\n', avail);     // Vectorised by libc
+
+        if (newline != NULL) {
+            releaseParsed(reader, reader->pos);
+            *len = newline - start;
+            reader->pos += *len + 1;
+            return start;
+        }
+
+        off_t line_off = reader->map_off + reader->pos;
+        if (reader->map_off + (off_t)reader->map_len < reader->file_size) {
+            // The line runs past the window, slide the window so it starts with this line
+            off_t page = sysconf(_SC_PAGESIZE);
+            off_t aligned = line_off - line_off % page;
+            size_t lead = line_off - aligned;
+            if (mapWindow(reader, aligned, 2 * (lead + avail)) != 0) {
+                // Can't map any more, carry on with plain reads from this line
+                if (lseek(reader->fd, line_off, SEEK_SET) < 0) {
+                    return NULL;
+                }
+                reader->pos = 0;
+                reader->buf_len = 0;
+                return nextChunked(reader, len);
+            }
+            reader->pos = lead;
+            continue;
+        }
+
+        // Last line of the file has no newline, copy it so line[len] is writable
+        if (reserveBuffer(reader, avail + 1) != 0) {
+            return NULL;
+        }
+        memcpy(reader->buf, start, avail);
+        reader->pos = reader->map_len;
+        *len = avail;
+        return reader->buf;
+    }
+}
+
+int scriptOpen(script_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        reader->file_size = st.st_size;
+        if (mapWindow(reader, 0, 0) == 0) {
+            return 0;
+        }
+    }
+
+    // Not mappable, stream it instead
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return 0;
+}
+
+char *scriptNextLine(script_reader *reader, size_t *len) {
+    if (reader->map != NULL) {
+        return nextMapped(reader, len);
+    }
+    return nextChunked(reader, len);
+}
+
+char *scriptNextBlock(script_reader *reader, size_t max, size_t *len) {
+    char *start;
+    size_t avail;
+    if (reader->map != NULL) {
+        if (reader->map_off + (off_t)reader->pos >= reader->file_size) {
+            return NULL;
+        }
+        start = reader->map + reader->pos;
+        avail = reader->map_len - reader->pos;
+    } else {
+        start = reader->buf + reader->pos;
+        avail = reader->buf_len - reader->pos;
+    }
+
+    // Cut at the last newline in reach, anything harder (window edges, refills, the
+    // last line, a single line longer than max) is left to the line reader
+    char *newline = avail > 0 ? memrchr(start, '\n', avail < max ? avail : max) : NULL;
+    if (newline == NULL) {
+        return scriptNextLine(reader, len);
+    }
+    if (reader->map != NULL) {
+        releaseParsed(reader, reader->pos);
+    }
+    *len = newline - start;
+    reader->pos += *len + 1;
+    return start;
+}
+
+void scriptClose(script_reader *reader) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->map_len);
+    }
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    free(reader->buf);
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+}
@@ -0,0 +1,60 @@
+/*
+ * script_reader.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Line reader for file mode. The script is mapped a window at a time
+ *			 and lines are handed out in place, so a multi gigabyte script is
+ *			 never copied and memory use does not grow with its size. Inputs
+ *			 that can't be mapped (pipes, terminals) are read in large chunks.
+ *
+ */
+
+#ifndef SCRIPT_READER_H_
+#define SCRIPT_READER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SCRIPT_WINDOW_SIZE (64 * 1024 * 1024)   // Bytes of the script mapped at once
+#define SCRIPT_RELEASE_SIZE (8 * 1024 * 1024)   // Parsed pages are dropped in steps this big
+#define SCRIPT_CHUNK_SIZE (1024 * 1024)         // Read size when the script can't be mapped
+#define SCRIPT_BLOCK_SIZE (256 * 1024)          // Most bytes of whole lines handed out at once
+
+typedef struct
+{
+    int fd;
+    off_t file_size;
+
+    // Mapped mode
+    char *map;          // Current window, NULL when reading in chunks
+    size_t map_len;
+    off_t map_off;      // File offset of map[0]
+    size_t released;    // Bytes at the start of the window already given back
+
+    // Chunked mode, and the last line of a mapped file if it has no newline
+    char *buf;
+    size_t buf_len;
+    size_t buf_cap;
+    int eof;
+
+    size_t pos;         // Next unread byte, in map or buf
+}script_reader;
+
+//Opens path for reading. Returns 0, or -1 if it can't be opened.
+int scriptOpen(script_reader *reader, const char *path);
+
+//Returns the next line without its newline and stores its length in len, or NULL
+//at the end of the script. The line is writable, including line[len], and stays
+//valid until the next call.
+char *scriptNextLine(script_reader *reader, size_t *len);
+
+//Like scriptNextLine, but returns as many whole lines as fit in max bytes (at least
+//one), newlines included except the last, so the parser can tokenize them in one pass
+char *scriptNextBlock(script_reader *reader, size_t max, size_t *len);
+
+//Unmaps and closes the script
+void scriptClose(script_reader *reader);
+
+
+#endif /* SCRIPT_READER_H_ */
@@ -0,0 +1,431 @@
+/*
+ * server.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Unix socket daemon with an epoll event loop. See server.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+#include "dispatch.h"
+#include "jobs.h"
+#include "output.h"
+#include "session.h"
+#include "string_parser.h"
+#include "trace.h"
+#include "workers.h"
+
+typedef struct server_client
+{
+    int fd;
+    int slot;                   // Index in the server's client table
+    int trace_session;          // Session its lines are recorded under with -trace
+    shell_session session;      // Touched only by the worker running its job
+    output_stream out;
+    job_table *jobs;            // Its background jobs, reported on its own stream
+
+    // Owned by the event loop
+    char *in;                   // Received, not yet run
+    size_t in_len;
+    size_t in_cap;
+    int watching;               // Still registered for input
+    int eof;                    // Nothing more will be read
+    int busy;                   // A job is out on a worker
+
+    // Owned by the worker while busy
+    char *job;                  // Whole lines handed over to run
+    size_t job_len;
+    int exited;                 // exit ran, the client is closed once the job is back
+
+    struct server_client *next_done;    // Also links the closed clients
+    int closed;                 // Out of the table, freed once the current batch of events is done
+}server_client;
+
+typedef struct
+{
+    int listen_fd;
+    int epoll_fd;
+    int done_fd;                // eventfd the workers bump when they hand a client back
+    int signal_fd;
+    work_queue jobs;            // Clients with a job to run
+    pthread_mutex_t done_lock;
+    server_client *done;        // Clients whose job finished, guarded by done_lock
+    server_client *closed;      // Closed during the current batch of events, owned by the loop
+    server_client *clients[SERVER_MAX_CLIENTS];
+    int num_clients;
+    int clients_accepted;       // Numbers the clients' trace sessions
+}shell_server;
+
+// epoll data for the descriptors that aren't clients
+static int listen_tag, done_tag, signal_tag;
+
+// Creates and binds the listening socket, replacing a socket file nobody answers on
+static int listenOn(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        struct stat st;
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int alive = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (!alive && stat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path) == 0) {
+            bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        }
+    }
+    if (!bound) {
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int watch(shell_server *server, int fd, void *tag) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = tag;
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Takes client out of the server. Later events of the same epoll_wait batch may still
+// point at it, so it is only marked here and freed by freeClosed once they are handled.
+static void closeClient(shell_server *server, server_client *client) {
+    if (client->watching) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        client->watching = 0;
+    }
+    server->clients[client->slot] = NULL;
+    server->num_clients--;
+    client->closed = 1;
+    client->next_done = server->closed;
+    server->closed = client;
+}
+
+static void freeClosed(shell_server *server) {
+    while (server->closed != NULL) {
+        server_client *client = server->closed;
+        server->closed = client->next_done;
+        outClose(&client->out);
+        close(client->fd);
+        sessionFree(&client->session);
+        jobsRelease(client->jobs);
+        free(client->in);
+        free(client->job);
+        free(client);
+    }
+}
+
+static void acceptClients(shell_server *server) {
+    while (1) {
+        // Left blocking: the event loop reads with MSG_DONTWAIT, workers write the output
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;     // EAGAIN once the backlog is empty
+        }
+        int slot = 0;
+        while (slot < SERVER_MAX_CLIENTS && server->clients[slot] != NULL) {
+            slot++;
+        }
+        server_client *client = slot < SERVER_MAX_CLIENTS ? calloc(1, sizeof(server_client)) : NULL;
+        if (client != NULL) {
+            client->jobs = jobsCreate();
+        }
+        if (client == NULL || client->jobs == NULL || sessionClone(&client->session, currentSession()) != 0) {
+            if (client != NULL && client->jobs != NULL) jobsRelease(client->jobs);
+            free(client);
+            close(fd);
+            continue;
+        }
+        struct timeval timeout = {SERVER_SEND_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        client->fd = fd;
+        client->slot = slot;
+        client->trace_session = ++server->clients_accepted;
+        outInit(&client->out, fd, OUTPUT_FULL);
+        if (watch(server, fd, client) != 0) {
+            sessionFree(&client->session);
+            jobsRelease(client->jobs);
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->watching = 1;
+        server->clients[slot] = client;
+        server->num_clients++;
+    }
+}
+
+// Stops reading from client, once it has shut its side or too much is waiting
+static void unwatch(shell_server *server, server_client *client) {
+    if (client->watching) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        client->watching = 0;
+    }
+}
+
+/*
+    Description: Hands the client's complete lines to a worker if it has none out
+    already. Input that ends without a newline runs once the client has shut its
+    side. A client with nothing left to run and nothing more coming is closed.
+        Args:
+            shell_server *server : The server
+            server_client *client : Client whose input or job just changed
+        Returns:
+            N/A
+*/
+static void dispatchClient(shell_server *server, server_client *client) {
+    if (client->busy) {
+        return;
+    }
+    char *newline = client->in_len > 0 ? memrchr(client->in, '\n', client->in_len) : NULL;
+    size_t take = newline != NULL ? (size_t)(newline - client->in) + 1 : 0;
+    if (newline == NULL && (client->eof || client->in_len >= SERVER_INPUT_MAX)) {
+        take = client->in_len;      // The last line, or one too long to hold, runs as it is
+    }
+    if (take == 0) {
+        if (client->eof) {
+            closeClient(server, client);
+        }
+        return;
+    }
+
+    char *job = realloc(client->job, take + 1);     // parse_line writes one past the end
+    if (job == NULL) {
+        closeClient(server, client);
+        return;
+    }
+    memcpy(job, client->in, take);
+    job[take] = '\0';
+    client->job = job;
+    client->job_len = take;
+    memmove(client->in, client->in + take, client->in_len - take);
+    client->in_len -= take;
+
+    if (!client->watching && !client->eof) {
+        if (watch(server, client->fd, client) == 0) {   // Room again after a pause
+            client->watching = 1;
+        }
+    }
+    client->busy = 1;
+    queuePush(&server->jobs, client);   // Never full, it holds a slot per client
+}
+
+static void readClient(shell_server *server, server_client *client) {
+    while (client->in_len < SERVER_INPUT_MAX) {
+        if (client->in_cap - client->in_len < SERVER_READ_SIZE) {
+            size_t cap = client->in_cap * 2 > client->in_len + SERVER_READ_SIZE ? client->in_cap * 2
+                                                                                : client->in_len + SERVER_READ_SIZE;
+            char *grown = realloc(client->in, cap);
+            if (grown == NULL) break;
+            client->in = grown;
+            client->in_cap = cap;
+        }
+        ssize_t got = recv(client->fd, client->in + client->in_len, SERVER_READ_SIZE, MSG_DONTWAIT);
+        if (got > 0) {
+            client->in_len += got;
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        client->eof = 1;    // Shut down or reset
+        break;
+    }
+    if (client->eof || client->in_len >= SERVER_INPUT_MAX) {
+        unwatch(server, client);
+    }
+    dispatchClient(server, client);
+}
+
+// Runs the lines of one job inside the client's own session and output stream
+static void runJob(server_client *client, parse_arena *arena) {
+    sessionUse(&client->session);
+    outUse(&client->out);
+    jobsUse(client->jobs);
+    if (traceEnabled)
+        traceSession(client->trace_session);
+    parsed_line line = parse_line(arena, client->job, client->job_len);
+    for (int i = 0; i < line.num_commands; i++) {
+        bool more = parseCommand(line.commands[i]);
+        jobsNotify();   // Its jobs that finished meanwhile are reported to it alone
+        outFlush();     // Each command's output goes back as soon as it is done
+        if (!more) {
+            client->exited = 1;
+            break;
+        }
+    }
+    jobsUse(NULL);
+    outUse(NULL);
+    sessionUse(NULL);
+}
+
+static void *serverWorker(void *arg) {
+    shell_server *server = arg;
+    parse_arena arena;
+    arena_init(&arena);
+    server_client *client;
+    while ((client = queuePop(&server->jobs)) != NULL) {
+        runJob(client, &arena);
+        pthread_mutex_lock(&server->done_lock);
+        client->next_done = server->done;
+        server->done = client;
+        pthread_mutex_unlock(&server->done_lock);
+        uint64_t one = 1;
+        if (write(server->done_fd, &one, sizeof(one)) < 0) {
+            // Only fails if the counter would overflow, the loop is reading it anyway
+        }
+    }
+    arena_free(&arena);
+    return NULL;
+}
+
+// Takes back every client a worker finished with, closing those that ran exit
+static void collectDone(shell_server *server) {
+    uint64_t count;
+    if (read(server->done_fd, &count, sizeof(count)) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&server->done_lock);
+    server_client *client = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->done_lock);
+
+    while (client != NULL) {
+        server_client *next = client->next_done;
+        client->busy = 0;
+        if (client->exited) {
+            closeClient(server, client);
+        } else {
+            dispatchClient(server, client);
+        }
+        client = next;
+    }
+}
+
+int serverRun(const char *socket_path, int threads) {
+    shell_server server;
+    memset(&server, 0, sizeof(server));
+    if (threads < 1) {
+        threads = SERVER_THREADS;
+    }
+
+    // SIGINT and SIGTERM arrive through the loop, a client that goes away mustn't kill us
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    currentSession();   // Every client starts where the server was started
+    parser_select_kernel(SCAN_BEST);    // Before the workers, parse_line would pick it lazily on each of them
+    server.listen_fd = listenOn(socket_path);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server.listen_fd < 0 || server.epoll_fd < 0 || server.done_fd < 0 || server.signal_fd < 0 ||
+        watch(&server, server.listen_fd, &listen_tag) != 0 || watch(&server, server.done_fd, &done_tag) != 0 ||
+        watch(&server, server.signal_fd, &signal_tag) != 0 ||
+        queueInit(&server.jobs, SERVER_MAX_CLIENTS) != 0) {
+        outPrintf("Error! can't serve on %s\n", socket_path);
+        outFlush();
+        if (server.listen_fd >= 0) close(server.listen_fd);
+        if (server.epoll_fd >= 0) close(server.epoll_fd);
+        if (server.done_fd >= 0) close(server.done_fd);
+        if (server.signal_fd >= 0) close(server.signal_fd);
+        return -1;
+    }
+    pthread_mutex_init(&server.done_lock, NULL);
+
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    while (workers != NULL && started < threads &&
+           pthread_create(&workers[started], NULL, serverWorker, &server) == 0) {
+        started++;
+    }
+    if (started > 0) {
+        outPrintf("Serving on %s with %d workers\n", socket_path, started);
+        outFlush();
+    }
+
+    int running = started > 0;
+    struct epoll_event events[64];
+    while (running) {
+        int n = epoll_wait(server.epoll_fd, events, 64, -1);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &listen_tag) {
+                acceptClients(&server);
+            } else if (tag == &done_tag) {
+                collectDone(&server);
+            } else if (tag == &signal_tag) {
+                // Taken off the queue, or unblocking it at the end would still kill us on the way out
+                struct signalfd_siginfo info;
+                if (read(server.signal_fd, &info, sizeof(info)) != sizeof(info)) {
+                    // Nothing there after all, stopping is what was asked either way
+                }
+                running = 0;
+            } else if (!((server_client *)tag)->closed) {
+                readClient(&server, tag);
+            }
+        }
+        freeClosed(&server);
+    }
+
+    // Jobs already handed out are finished, then everything is closed
+    queueClose(&server.jobs);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (server.clients[i] != NULL) {
+            closeClient(&server, server.clients[i]);
+        }
+    }
+    freeClosed(&server);
+    queueFree(&server.jobs);
+    pthread_mutex_destroy(&server.done_lock);
+    close(server.listen_fd);
+    close(server.epoll_fd);
+    close(server.done_fd);
+    close(server.signal_fd);
+    unlink(socket_path);
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+    return started > 0 ? 0 : -1;
+}
@@ -0,0 +1,32 @@
+/*
+ * server.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Daemon mode. One long lived process listens on a Unix domain
+ *			 socket and runs the command lines its clients send, so a batch
+ *			 job costs a connection instead of a process. An epoll loop owns
+ *			 every socket; complete lines are handed to a pool of workers.
+ *			 Each client has its own session (working directory) and output
+ *			 stream, its commands run in the order sent, and the output of
+ *			 each one is written back over the socket as soon as it is done.
+ *			 exit ends the client's session, not the server.
+ *
+ */
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#define SERVER_MAX_CLIENTS 1024         // Connected at once, later ones are turned away
+#define SERVER_THREADS 4                // Workers running commands, unless -j says otherwise
+#define SERVER_READ_SIZE (64 * 1024)    // Bytes taken from a client socket per read
+#define SERVER_INPUT_MAX (1024 * 1024)  // Unrun input held per client before reading pauses
+#define SERVER_SEND_TIMEOUT 30          // Seconds a worker waits on a client that stopped reading
+
+//Serves clients on socket_path with threads workers until SIGINT or SIGTERM.
+//A stale socket file left by a dead server is replaced. Returns 0, or -1 after
+//printing an error if the socket couldn't be set up.
+int serverRun(const char *socket_path, int threads);
+
+
+#endif /* SERVER_H_ */
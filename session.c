@@ -0,0 +1,212 @@
+/*
+ * session.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Working directory state for the shell. See session.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "session.h"
+
+// Directory descriptors are only ever used as the base of *at() calls
+#ifdef O_PATH
+#define DIR_OPEN_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define DIR_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+static shell_session default_session = { -1, NULL, 0, 0, 0, 0 };
+static _Thread_local shell_session *current = &default_session;    // Each thread acts on its own
+
+// Replaces the cached path, growing the buffer only when needed
+static int setPath(shell_session *session, const char *path, size_t len) {
+    if (len + 1 > session->cwd_cap) {
+        size_t cap = session->cwd_cap ? session->cwd_cap : 256;
+        while (cap < len + 1) cap *= 2;
+        char *grown = realloc(session->cwd_path, cap);
+        if (grown == NULL) return -1;
+        session->cwd_path = grown;
+        session->cwd_cap = cap;
+    }
+    memcpy(session->cwd_path, path, len);
+    session->cwd_path[len] = '\0';
+    session->cwd_len = len;
+    return 0;
+}
+
+// Takes fd as the session's directory, recording which directory it is
+static void setDir(shell_session *session, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        session->cwd_dev = st.st_dev;
+        session->cwd_ino = st.st_ino;
+    } else {
+        session->cwd_dev = 0;
+        session->cwd_ino = 0;   // Never matches a cached directory
+    }
+    session->cwd_fd = fd;
+}
+
+/*
+    Description: Resolves rel against the absolute path base without touching the
+    filesystem, dropping "." components and letting ".." remove the previous one.
+        Args:
+            const char *base : Normalised absolute path ("/" or no trailing slash)
+            size_t base_len : Length of base
+            const char *rel : Relative or absolute path to apply
+            size_t *out_len : Receives the length of the result
+            int *went_up : Set to 1 if rel contained a ".." component
+        Returns:
+            char* : Newly allocated normalised absolute path, NULL if memory ran out
+*/
+static char *resolvePath(const char *base, size_t base_len, const char *rel, size_t *out_len, int *went_up) {
+    size_t rel_len = strlen(rel);
+    char *out = malloc(base_len + rel_len + 2);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    if (rel[0] != '/') {
+        memcpy(out, base, base_len);
+        len = base_len == 1 ? 0 : base_len;   // "/" is written back at the end if nothing follows
+    }
+
+    *went_up = 0;
+    const char *p = rel;
+    while (*p != '\0') {
+        while (*p == '/') p++;
+        const char *start = p;
+        while (*p != '\0' && *p != '/') p++;
+        size_t n = p - start;
+
+        if (n == 0 || (n == 1 && start[0] == '.')) {
+            continue;
+        }
+        if (n == 2 && start[0] == '.' && start[1] == '.') {
+            while (len > 0 && out[len - 1] != '/') len--;
+            if (len > 0) len--;
+            *went_up = 1;
+            continue;
+        }
+        out[len++] = '/';
+        memcpy(out + len, start, n);
+        len += n;
+    }
+
+    if (len == 0) {
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    *out_len = len;
+    return out;
+}
+
+int sessionInit(shell_session *session) {
+    session->cwd_fd = -1;
+    session->cwd_path = NULL;
+    session->cwd_len = 0;
+    session->cwd_cap = 0;
+
+    // The only getcwd the shell ever makes, the path is tracked by cd from here on
+    char *path = getcwd(NULL, 0);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(".", DIR_OPEN_FLAGS);
+    if (fd < 0 || setPath(session, path, strlen(path)) != 0) {
+        if (fd >= 0) close(fd);
+        free(path);
+        return -1;
+    }
+    free(path);
+    setDir(session, fd);
+    return 0;
+}
+
+int sessionClone(shell_session *session, const shell_session *from) {
+    session->cwd_fd = -1;
+    session->cwd_path = NULL;
+    session->cwd_len = 0;
+    session->cwd_cap = 0;
+
+    int fd = fcntl(from->cwd_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (setPath(session, from->cwd_path, from->cwd_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    session->cwd_fd = fd;
+    session->cwd_dev = from->cwd_dev;
+    session->cwd_ino = from->cwd_ino;
+    return 0;
+}
+
+void sessionFree(shell_session *session) {
+    if (session->cwd_fd >= 0) {
+        close(session->cwd_fd);
+    }
+    free(session->cwd_path);
+    session->cwd_fd = -1;
+    session->cwd_path = NULL;
+    session->cwd_len = 0;
+    session->cwd_cap = 0;
+}
+
+shell_session *currentSession(void) {
+    if (current->cwd_fd < 0) {
+        sessionInit(current);
+    }
+    return current;
+}
+
+void sessionUse(shell_session *session) {
+    current = session != NULL ? session : &default_session;
+}
+
+int sessionChdir(shell_session *session, const char *dirName) {
+    size_t len;
+    int went_up;
+    char *path = resolvePath(session->cwd_path, session->cwd_len, dirName, &len, &went_up);
+    if (path == NULL) {
+        return -1;
+    }
+
+    // Plain descents are opened relative to the current directory, ".." has to follow the
+    // cached path (like a shell's logical cd), so those go through the resolved path
+    int fd = went_up ? open(path, DIR_OPEN_FLAGS) : openat(session->cwd_fd, dirName, DIR_OPEN_FLAGS);
+    if (fd < 0 || setPath(session, path, len) != 0) {
+        if (fd >= 0) close(fd);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    close(session->cwd_fd);
+    setDir(session, fd);
+    return 0;
+}
+
+char *sessionResolve(const shell_session *session, const char *path, size_t *len) {
+    int went_up;
+    return resolvePath(session->cwd_path, session->cwd_len, path, len, &went_up);
+}
+
+int cwdFd(void) {
+    return currentSession()->cwd_fd;
+}
+
+const char *cwdPath(void) {
+    shell_session *session = currentSession();
+    return session->cwd_path != NULL ? session->cwd_path : "";
+}
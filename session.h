@@ -0,0 +1,58 @@
+/*
+ * session.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Per shell session state. The working directory is held as an open
+ *			 descriptor plus a cached path string, both only changed by cd, so
+ *			 built-ins resolve their arguments with the *at() calls relative to
+ *			 cwd_fd instead of calling getcwd and rebuilding absolute paths.
+ *
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct
+{
+    int cwd_fd;         // Open descriptor of the working directory, -1 until initialised
+    char *cwd_path;     // Absolute path of the working directory, NUL terminated
+    size_t cwd_len;
+    size_t cwd_cap;
+    dev_t cwd_dev;      // Identity of the working directory, taken when it is opened, so
+    ino_t cwd_ino;      // the listing cache can find it without a stat per ls
+}shell_session;
+
+//Starts a session in the process' working directory. Returns 0 or -1.
+int sessionInit(shell_session *session);
+
+//Starts a session in the same directory as another one (the descriptor is duplicated)
+int sessionClone(shell_session *session, const shell_session *from);
+
+//Closes the descriptor and frees the path
+void sessionFree(shell_session *session);
+
+//The session built-ins act on, set up from the process' working directory on first use
+shell_session *currentSession(void);
+
+//Makes session the one built-ins on the calling thread act on, NULL goes back to
+//the default session (which threads start out with)
+void sessionUse(shell_session *session);
+
+//Moves the session into dirName (relative or absolute). ".." components are
+//resolved against the cached path the way a shell does. Returns 0 or -1.
+int sessionChdir(shell_session *session, const char *dirName);
+
+//Absolute form of path as seen from the session, worked out from the cached path
+//alone (no symlinks are followed). The result is malloc'd, NULL if memory ran out.
+char *sessionResolve(const shell_session *session, const char *path, size_t *len);
+
+//Shorthands for the current session's directory descriptor and path
+int cwdFd(void);
+const char *cwdPath(void);
+
+
+#endif /* SESSION_H_ */
@@ -0,0 +1,307 @@
+/*
+ * stats.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Per-command counters and latency histograms for -stats. See stats.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "stats.h"
+
+#define IO_FIELDS 4
+
+struct stats_entry
+{
+    const char *name;
+    atomic_llong calls;
+    atomic_llong errors;
+    atomic_llong wall_ns;
+    atomic_llong cpu_ns;
+    atomic_llong io[IO_FIELDS];     // Bytes read and written, read and write syscalls
+    atomic_llong max_ns;
+    atomic_llong buckets[STATS_BUCKETS];
+};
+
+int statsEnabled = 0;
+
+static int report_format = STATS_TABLE;
+static stats_entry *entries[STATS_MAX_ENTRIES];
+static atomic_int num_entries;
+static pthread_mutex_t entries_lock = PTHREAD_MUTEX_INITIALIZER;
+static int io_fd = -1;                      // /proc/self/io, -1 where there is none
+static long long io_overhead[IO_FIELDS];    // What reading /proc/self/io itself adds to a sample
+
+static const char *io_names[IO_FIELDS] = {"rchar", "wchar", "syscr", "syscw"};
+
+static long long clockNanos(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void statsReadIo(long long *io) {
+    memset(io, 0, IO_FIELDS * sizeof(long long));
+    char buf[512];
+    ssize_t len = io_fd >= 0 ? pread(io_fd, buf, sizeof(buf) - 1, 0) : -1;
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+    for (char *line = buf; line != NULL && *line != '\0'; ) {
+        for (int i = 0; i < IO_FIELDS; i++) {
+            size_t name_len = strlen(io_names[i]);
+            if (strncmp(line, io_names[i], name_len) == 0 && line[name_len] == ':') {
+                io[i] = strtoll(line + name_len + 1, NULL, 10);
+            }
+        }
+        line = strchr(line, '\n');
+        if (line != NULL) line++;
+    }
+}
+
+// Bucket holding a latency of ns nanoseconds
+static int bucketOf(long long ns) {
+    if (ns < (1 << STATS_SUB_BITS)) {
+        return ns < 0 ? 0 : (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll((unsigned long long)ns);
+    if (exponent > STATS_MAX_EXPONENT) {
+        return STATS_BUCKETS - 1;
+    }
+    int sub = (int)(ns >> (exponent - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1);
+    return ((exponent - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+// Largest latency that falls into bucket
+static long long bucketTop(int bucket) {
+    if (bucket < (1 << STATS_SUB_BITS)) {
+        return bucket;
+    }
+    int exponent = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    long long sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+    long long width = 1LL << (exponent - STATS_SUB_BITS);
+    return (((1LL << STATS_SUB_BITS) + sub) << (exponent - STATS_SUB_BITS)) + width - 1;
+}
+
+// Latency below which fraction of the calls fall, as the top of the bucket it is found in
+static long long percentile(stats_entry *entry, long long calls, double fraction) {
+    long long wanted = (long long)(fraction * calls + 0.5);
+    if (wanted < 1) wanted = 1;
+    long long seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += atomic_load(&entry->buckets[i]);
+        if (seen >= wanted) {
+            long long top = bucketTop(i);
+            long long max = atomic_load(&entry->max_ns);
+            return top < max ? top : max;
+        }
+    }
+    return atomic_load(&entry->max_ns);
+}
+
+stats_entry *statsEntry(const char *name) {
+    int n = atomic_load_explicit(&num_entries, memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        if (entries[i]->name == name || strcmp(entries[i]->name, name) == 0) {
+            return entries[i];
+        }
+    }
+
+    // Not seen yet, check again under the lock in case another thread just added it
+    pthread_mutex_lock(&entries_lock);
+    stats_entry *found = NULL;
+    n = atomic_load(&num_entries);
+    for (int i = 0; i < n && found == NULL; i++) {
+        if (strcmp(entries[i]->name, name) == 0) {
+            found = entries[i];
+        }
+    }
+    if (found == NULL && n < STATS_MAX_ENTRIES && (found = calloc(1, sizeof(stats_entry))) != NULL) {
+        found->name = name;
+        entries[n] = found;
+        atomic_store_explicit(&num_entries, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&entries_lock);
+    return found;
+}
+
+void statsStart(stats_sample *sample) {
+    statsReadIo(sample->io);
+    sample->cpu_ns = clockNanos(CLOCK_PROCESS_CPUTIME_ID);
+    sample->wall_ns = clockNanos(CLOCK_MONOTONIC);
+}
+
+void statsStop(stats_entry *entry, const stats_sample *sample, int failed) {
+    long long wall = clockNanos(CLOCK_MONOTONIC) - sample->wall_ns;
+    long long cpu = clockNanos(CLOCK_PROCESS_CPUTIME_ID) - sample->cpu_ns;
+    long long io[IO_FIELDS];
+    statsIoSince(sample->io, io);
+    if (entry == NULL) {
+        return;
+    }
+
+    atomic_fetch_add(&entry->calls, 1);
+    if (failed) {
+        atomic_fetch_add(&entry->errors, 1);
+    }
+    atomic_fetch_add(&entry->wall_ns, wall);
+    atomic_fetch_add(&entry->cpu_ns, cpu);
+    for (int i = 0; i < IO_FIELDS; i++) {
+        if (io[i] > 0) {
+            atomic_fetch_add(&entry->io[i], io[i]);
+        }
+    }
+    atomic_fetch_add(&entry->buckets[bucketOf(wall)], 1);
+    long long max = atomic_load(&entry->max_ns);
+    while (wall > max && !atomic_compare_exchange_weak(&entry->max_ns, &max, wall)) {
+    }
+}
+
+static void reportTable(FILE *out) {
+    fprintf(out, "%-10s %8s %6s %10s %10s %9s %9s %9s %9s %12s %12s %8s %8s\n",
+            "command", "calls", "errors", "wall_ms", "cpu_ms", "p50_us", "p90_us", "p99_us", "max_us",
+            "read_bytes", "write_bytes", "reads", "writes");
+    int n = atomic_load(&num_entries);
+    for (int i = 0; i < n; i++) {
+        stats_entry *entry = entries[i];
+        long long calls = atomic_load(&entry->calls);
+        if (calls == 0) {
+            continue;
+        }
+        fprintf(out, "%-10s %8lld %6lld %10.3f %10.3f %9.1f %9.1f %9.1f %9.1f %12lld %12lld %8lld %8lld\n",
+                entry->name, calls, atomic_load(&entry->errors),
+                atomic_load(&entry->wall_ns) / 1e6, atomic_load(&entry->cpu_ns) / 1e6,
+                percentile(entry, calls, 0.50) / 1e3, percentile(entry, calls, 0.90) / 1e3,
+                percentile(entry, calls, 0.99) / 1e3, atomic_load(&entry->max_ns) / 1e3,
+                atomic_load(&entry->io[0]), atomic_load(&entry->io[1]),
+                atomic_load(&entry->io[2]), atomic_load(&entry->io[3]));
+    }
+}
+
+static void reportJson(FILE *out) {
+    fprintf(out, "{\"commands\":[");
+    int n = atomic_load(&num_entries);
+    int first = 1;
+    for (int i = 0; i < n; i++) {
+        stats_entry *entry = entries[i];
+        long long calls = atomic_load(&entry->calls);
+        if (calls == 0) {
+            continue;
+        }
+        fprintf(out, "%s{\"name\":\"%s\",\"calls\":%lld,\"errors\":%lld,\"wall_ns\":%lld,\"cpu_ns\":%lld,"
+                     "\"p50_ns\":%lld,\"p90_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld,"
+                     "\"read_bytes\":%lld,\"write_bytes\":%lld,\"read_calls\":%lld,\"write_calls\":%lld,"
+                     "\"histogram\":[",
+                first ? "" : ",", entry->name, calls, atomic_load(&entry->errors),
+                atomic_load(&entry->wall_ns), atomic_load(&entry->cpu_ns),
+                percentile(entry, calls, 0.50), percentile(entry, calls, 0.90),
+                percentile(entry, calls, 0.99), atomic_load(&entry->max_ns),
+                atomic_load(&entry->io[0]), atomic_load(&entry->io[1]),
+                atomic_load(&entry->io[2]), atomic_load(&entry->io[3]));
+        // Only the buckets in use, as [highest latency in ns, count]
+        int first_bucket = 1;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            long long count = atomic_load(&entry->buckets[b]);
+            if (count > 0) {
+                fprintf(out, "%s[%lld,%lld]", first_bucket ? "" : ",", bucketTop(b), count);
+                first_bucket = 0;
+            }
+        }
+        fprintf(out, "]}");
+        first = 0;
+    }
+    fprintf(out, "]}\n");
+}
+
+void statsReport(int fd) {
+    // Built in memory and written at once, so a report never interleaves with anything
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL) {
+        return;
+    }
+    if (report_format == STATS_JSON) {
+        reportJson(out);
+    } else {
+        reportTable(out);
+    }
+    fclose(out);
+    for (size_t done = 0; done < len; ) {
+        ssize_t written = write(fd, text + done, len - done);
+        if (written <= 0) break;
+        done += written;
+    }
+    free(text);
+}
+
+static void reportAtExit(void) {
+    statsReport(STDERR_FILENO);
+}
+
+// Waits for SIGUSR1, which stays blocked in every other thread, and reports each time
+static void *signalThread(void *arg) {
+    sigset_t *set = arg;
+    int received;
+    while (sigwait(set, &received) == 0) {
+        statsReport(STDERR_FILENO);
+    }
+    return NULL;
+}
+
+void statsIoInit(void) {
+    if (io_fd >= 0) {
+        return;
+    }
+    io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+
+    // Two samples back to back show what taking a sample costs, so it can be left out
+    long long first[IO_FIELDS], second[IO_FIELDS];
+    statsReadIo(first);
+    statsReadIo(second);
+    for (int i = 0; i < IO_FIELDS; i++) {
+        io_overhead[i] = second[i] - first[i];
+    }
+}
+
+void statsIoSince(const long long *start, long long *delta) {
+    statsReadIo(delta);
+    for (int i = 0; i < IO_FIELDS; i++) {
+        delta[i] -= start[i] + io_overhead[i];
+        if (delta[i] < 0) {
+            delta[i] = 0;   // Other threads' reads of the counters can make up the overhead
+        }
+    }
+}
+
+int statsEnable(int format) {
+    report_format = format;
+    statsIoInit();
+
+    statsEnabled = 1;
+    atexit(reportAtExit);
+
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, signalThread, &set) != 0) {
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        signal(SIGUSR1, SIG_IGN);   // Better no report than being killed by it
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
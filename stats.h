@@ -0,0 +1,75 @@
+/*
+ * stats.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Optional instrumentation behind -stats. Every built-in (and the
+ *			 parse phase of file mode) gets call and error counts, wall and CPU
+ *			 time, bytes and read/write syscalls from /proc/self/io, and a log
+ *			 bucket latency histogram. The numbers are process wide, so they
+ *			 include a command's helper threads; under -j commands that overlap
+ *			 share them. When -stats is off the only cost is testing statsEnabled.
+ *
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+// Report formats
+#define STATS_TABLE 0
+#define STATS_JSON  1
+
+// Histogram layout: values below 2^STATS_SUB_BITS ns get a bucket each, every power
+// of two above that is split into 2^STATS_SUB_BITS buckets (about 12% wide)
+#define STATS_SUB_BITS 3
+#define STATS_MAX_EXPONENT 44   // About five hours, anything longer lands in the last bucket
+#define STATS_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BITS + 2) << STATS_SUB_BITS)
+
+// Most distinct names that can be tracked, later ones are ignored
+#define STATS_MAX_ENTRIES 64
+
+typedef struct stats_entry stats_entry;
+
+// Counters taken when a timed section starts
+typedef struct
+{
+    long long wall_ns;
+    long long cpu_ns;
+    long long io[4];        // rchar, wchar, syscr, syscw
+}stats_sample;
+
+//Nonzero once statsEnable has run, test it before calling anything else here
+extern int statsEnabled;
+
+//Turns collection on. The report is printed on stderr at exit and whenever the
+//process gets SIGUSR1. Call before any thread is started, so they all inherit
+//the blocked signal. Returns 0, or -1 if the signal thread couldn't start (the
+//report at exit still happens).
+int statsEnable(int format);
+
+//The entry for name, created on first use. name must outlive the process (built-in
+//names and string literals do). NULL once STATS_MAX_ENTRIES names are taken.
+stats_entry *statsEntry(const char *name);
+
+//Takes the counters at the start of a timed section
+void statsStart(stats_sample *sample);
+
+//Adds the section begun with sample to entry, failed counts it as an error
+void statsStop(stats_entry *entry, const stats_sample *sample, int failed);
+
+//Opens /proc/self/io, for reading the counters below without -stats. statsEnable
+//does it too. Call it before any thread starts.
+void statsIoInit(void);
+
+//The whole process' I/O counters: bytes read and written, read and write
+//syscalls. Zeros where the kernel doesn't keep them or statsIoInit hasn't run.
+void statsReadIo(long long *io);
+
+//What the counters moved since start was read, less what reading them costs
+void statsIoSince(const long long *start, long long *delta);
+
+//Writes the report to fd in the format given to statsEnable
+void statsReport(int fd);
+
+
+#endif /* STATS_H_ */
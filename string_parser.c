@@ -11,41 +11,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "string_parser.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
 
 #define _GUN_SOURCE
 
-int count_token(char* buf, const char* delim) {
-    
-    // Checks if line is empty and returns 0 if so
-    if (buf == NULL || strlen(buf) == 0) {
-        return 0;
-    }
-
-    // Initialize a count for each token
-    int token_count = 0;
+// Character classes used by parse_line
+#define CLASS_SPACE 1   // Separates arguments
+#define CLASS_END   2   // Ends a command
 
-    // Make a place to save the information
-    char* saveptr = buf;
+static const unsigned char char_class[256] = {
+    [' '] = CLASS_SPACE, ['\t'] = CLASS_SPACE, ['\r'] = CLASS_SPACE,
+    [';'] = CLASS_END, ['\n'] = CLASS_END, ['\0'] = CLASS_END
+};
 
-    // Make a place to save tokens temporarily
-    char* token;
+// Builds a lookup table marking every character of delim (and the terminator)
+static void build_delim_table(const char* delim, unsigned char table[256]) {
+    memset(table, 0, 256);
+    for (const unsigned char* d = (const unsigned char*)delim; *d != '\0'; d++) {
+        table[*d] = 1;
+    }
+    table['\0'] = 1;
+}
 
-    // Go through buf until token is NULL adding to the token_count for each occurrence
-    while ((token = strtok_r(saveptr, delim, &saveptr))) {
+int count_token(char* buf, const char* delim) {
 
-        // Skip empty tokens
-        if (strlen(token) > 0) {
-            token_count++;
-        }
+    // Checks if line is empty and returns 0 if so
+    if (buf == NULL || buf[0] == '\0') {
+        return 0;
     }
 
-    // Accounts for a string ending with a delimiter, but not a newline
-    if ((strlen(buf) > 0 && buf[strlen(buf) - 1] == delim[0])|| buf[strlen(buf) - 1] != '\n') {
+    unsigned char is_delim[256];
+    build_delim_table(delim, is_delim);
+
+    // Count every run of non delimiter characters, without touching buf
+    int token_count = 0;
+    const unsigned char* p = (const unsigned char*)buf;
+    while (*p != '\0') {
+        while (*p != '\0' && is_delim[*p]) p++;
+        if (*p == '\0') break;
         token_count++;
+        while (!is_delim[*p]) p++;
     }
 
-    return token_count;
+    // Leave room for the NULL that terminates the list
+    return token_count + 1;
 }
 
 command_line str_filler(char* buf, const char* delim) {
@@ -54,67 +68,272 @@ command_line str_filler(char* buf, const char* delim) {
     cmd_line.command_list = NULL;
     cmd_line.num_token = 0;
 
+    size_t len = strlen(buf);
+
     // Delete newline charcter if present
-    if (strlen(buf) > 0 && buf[strlen(buf) - 1] == '\n') {
-        buf[strlen(buf) - 1] = '\0';
+    if (len > 0 && buf[len - 1] == '\n') {
+        buf[--len] = '\0';
     }
 
-    // Make copy of the buffer to be sent to count_token
-    char* temp_buf = malloc(strlen(buf) + 1);
-    strcpy(temp_buf, buf);
-
-    // Count the number of tokens with the count_token function
-    cmd_line.num_token = count_token(temp_buf, delim);
+    // Tokens are separated by at least one delimiter, so this many slots (plus NULL) always fit.
+    // The slots and a private copy of the string share one allocation.
+    size_t max_tokens = len / 2 + 2;
+    char** block = malloc(max_tokens * sizeof(char*) + len + 1);
+    if (block == NULL) {
+        return cmd_line;
+    }
+    char* copy = (char*)(block + max_tokens);
+    memcpy(copy, buf, len + 1);
 
-    // Allocate memory for the token array inside the command_line variable based on the number of tokens
-    cmd_line.command_list = (char**)malloc(sizeof(char*) * (cmd_line.num_token));
+    unsigned char is_delim[256];
+    build_delim_table(delim, is_delim);
 
-    // Find the tokens using strtok_r
-    char* saveptr;
-    char* token = strtok_r(buf, delim, &saveptr);
+    // Cut the copy into tokens in place
     int i = 0;
-    while (token != NULL) {
-        int tok_len = strlen(token);
-
-        // Skip the last token if it's an empty string
-        if (i == cmd_line.num_token - 1 && tok_len == 0) {
-            break;
-        }
-
-        // Allocate memory for each token and copy it into the command_list
-        cmd_line.command_list[i] = (char*)malloc(sizeof(char) * (tok_len + 1));
-        
-        // Handle memory allocation failure
-        if (cmd_line.command_list == NULL) {
-            return cmd_line;
+    unsigned char* p = (unsigned char*)copy;
+    while (*p != '\0') {
+        if (is_delim[*p]) {
+            *p++ = '\0';
+            continue;
         }
-
-        // Insert token into command line list
-        strcpy(cmd_line.command_list[i], token);
+        block[i++] = (char*)p;
+        while (!is_delim[*p]) p++;
 
         // Remove the last newline character, if present
-        if (tok_len > 0 && cmd_line.command_list[i][tok_len - 1] == '\n') {
-            cmd_line.command_list[i][tok_len - 1] = '\0';
+        if (p[-1] == '\n') {
+            p[-1] = '\0';
         }
-
-        // Increment counter
-        i++;
-
-        // Iterate to next token in temporary buffer
-        token = strtok_r(NULL, delim, &saveptr);
     }
+    block[i] = NULL;
 
-    free(temp_buf);
+    cmd_line.command_list = block;
+    cmd_line.num_token = i + 1;
     return cmd_line;
 }
 
 void free_command_line(command_line* command)
 {
-	// Go through the indencies and free each token occurance
-	for (int i = 0; i < command->num_token; i++){
-		free(command->command_list[i]);
-	}
-	
-	// Free the empty command_list
+	// The tokens live in the same allocation as the list, so one free releases everything
 	free(command->command_list);
-}
\ No newline at end of file
+	command->command_list = NULL;
+	command->num_token = 0;
+}
+
+void arena_init(parse_arena* arena)
+{
+    arena->slots = NULL;
+    arena->slot_cap = 0;
+    arena->commands = NULL;
+    arena->command_cap = 0;
+}
+
+void arena_reset(parse_arena* arena)
+{
+    // Every parse overwrites the arena from the start, so there is nothing to clear
+    (void)arena;
+}
+
+void arena_free(parse_arena* arena)
+{
+    free(arena->slots);
+    free(arena->commands);
+    arena_init(arena);
+}
+
+// Makes sure the arena can hold the worst case for a line of len bytes
+static int arena_reserve(parse_arena* arena, size_t len)
+{
+    // Every token takes at least one byte plus a separator and every command holds at least
+    // one token, so tokens + terminators never exceed len + 1 and commands never exceed len / 2 + 1
+    size_t slots_needed = len + 2;
+    size_t commands_needed = len / 2 + 2;
+
+    if (slots_needed > arena->slot_cap) {
+        size_t cap = arena->slot_cap ? arena->slot_cap : 64;
+        while (cap < slots_needed) cap *= 2;
+        char** slots = realloc(arena->slots, cap * sizeof(char*));
+        if (slots == NULL) return -1;
+        arena->slots = slots;
+        arena->slot_cap = cap;
+    }
+    if (commands_needed > arena->command_cap) {
+        size_t cap = arena->command_cap ? arena->command_cap : 16;
+        while (cap < commands_needed) cap *= 2;
+        command_line* commands = realloc(arena->commands, cap * sizeof(command_line));
+        if (commands == NULL) return -1;
+        arena->commands = commands;
+        arena->command_cap = cap;
+    }
+    return 0;
+}
+
+/*
+ * Delimiter scanning kernels. Each one looks at a 64 byte block, overwrites every
+ * delimiter in it with '\0' (which terminates the tokens) and returns two bitmasks,
+ * bit i standing for p[i]: every delimiter (CLASS_SPACE or CLASS_END) and the
+ * command ends alone (CLASS_END). parse_line only ever looks at the bits.
+ */
+typedef void (*scan_kernel)(unsigned char* p, uint64_t* delim, uint64_t* end);
+
+// Portable version for CPUs without a vector kernel
+static void scan_scalar(unsigned char* p, uint64_t* delim, uint64_t* end)
+{
+    uint64_t d = 0, e = 0;
+    for (int i = 0; i < 64; i++) {
+        unsigned char cls = char_class[p[i]];
+        d |= (uint64_t)(cls != 0) << i;
+        e |= (uint64_t)(cls == CLASS_END) << i;
+        if (cls != 0) p[i] = '\0';
+    }
+    *delim = d;
+    *end = e;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void scan_sse2(unsigned char* p, uint64_t* delim, uint64_t* end)
+{
+    uint64_t d = 0, e = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i ends = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+                                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                                    _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        __m128i spaces = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        __m128i delims = _mm_or_si128(ends, spaces);
+        _mm_storeu_si128((__m128i*)(p + i), _mm_andnot_si128(delims, v));
+        e |= (uint64_t)(uint16_t)_mm_movemask_epi8(ends) << i;
+        d |= (uint64_t)(uint16_t)_mm_movemask_epi8(delims) << i;
+    }
+    *delim = d;
+    *end = e;
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(unsigned char* p, uint64_t* delim, uint64_t* end)
+{
+    uint64_t d = 0, e = 0;
+    for (int i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i ends = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+                                                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+                                       _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        __m256i spaces = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        __m256i delims = _mm256_or_si256(ends, spaces);
+        _mm256_storeu_si256((__m256i*)(p + i), _mm256_andnot_si256(delims, v));
+        e |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ends) << i;
+        d |= (uint64_t)(uint32_t)_mm256_movemask_epi8(delims) << i;
+    }
+    *delim = d;
+    *end = e;
+}
+#endif
+
+static scan_kernel active_kernel = NULL;   // Picked on first use
+static int active_kind = SCAN_SCALAR;
+
+int parser_select_kernel(int kind)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (kind == SCAN_BEST) {
+        kind = __builtin_cpu_supports("avx2") ? SCAN_AVX2 :
+               __builtin_cpu_supports("sse2") ? SCAN_SSE2 : SCAN_SCALAR;
+    }
+    if (kind == SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        active_kernel = scan_avx2;
+        active_kind = SCAN_AVX2;
+        return active_kind;
+    }
+    if (kind >= SCAN_SSE2 && __builtin_cpu_supports("sse2")) {
+        active_kernel = scan_sse2;
+        active_kind = SCAN_SSE2;
+        return active_kind;
+    }
+#else
+    (void)kind;
+#endif
+    active_kernel = scan_scalar;
+    active_kind = SCAN_SCALAR;
+    return active_kind;
+}
+
+// Stores a pointer for every set bit of bits, in order, and returns how many
+static inline size_t emit_starts(char** out, char* base, uint64_t bits)
+{
+    size_t count = 0;
+    for (; bits != 0; bits &= bits - 1) out[count++] = base + __builtin_ctzll(bits);
+    return count;
+}
+
+parsed_line parse_line(parse_arena* arena, char* buf, size_t len)
+{
+    parsed_line line;
+    line.commands = NULL;
+    line.num_commands = 0;
+
+    arena_reset(arena);
+    if (arena_reserve(arena, len) != 0) {
+        return line;
+    }
+    buf[len] = '\0';
+
+    if (active_kernel == NULL) {
+        parser_select_kernel(SCAN_BEST);
+    }
+
+    char** slots = arena->slots;
+    size_t used = 0;        // Slots handed out so far
+    size_t cmd_start = 0;   // First slot of the command being built
+    int num_commands = 0;
+    unsigned char* p = (unsigned char*)buf;
+    uint64_t prev_delim = 1;    // The line start behaves like a delimiter came before it
+
+    // Walk the line (and its terminator) 64 bytes at a time
+    for (size_t base = 0; base <= len; base += 64) {
+        size_t n = len + 1 - base;
+        uint64_t delim, end;
+        if (n >= 64) {
+            n = 64;
+            active_kernel(p + base, &delim, &end);
+        } else {
+            // Never touch the bytes after the terminator, scan a padded copy of the tail
+            unsigned char tail[64];
+            memset(tail + n, 'x', 64 - n);
+            memcpy(tail, p + base, n);
+            active_kernel(tail, &delim, &end);
+            memcpy(p + base, tail, n);
+        }
+        uint64_t valid = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+
+        // A token starts where a non-delimiter follows a delimiter
+        uint64_t starts = ~delim & ((delim << 1) | prev_delim) & valid;
+        prev_delim = delim >> 63;
+
+        // Command ends are rare, so hand out the token starts in runs between them
+        uint64_t pending = starts;
+        for (uint64_t bits = end; bits != 0; bits &= bits - 1) {
+            uint64_t before = (bits & -bits) - 1;
+            used += emit_starts(slots + used, (char*)p + base, pending & before);
+            pending &= ~before;
+
+            // Close the command if it got any tokens, blank ones are dropped
+            if (used > cmd_start) {
+                arena->commands[num_commands].command_list = slots + cmd_start;
+                arena->commands[num_commands].num_token = (int)(used - cmd_start) + 1;
+                num_commands++;
+                slots[used++] = NULL;
+                cmd_start = used;
+            }
+        }
+        used += emit_starts(slots + used, (char*)p + base, pending);
+    }
+
+    line.commands = arena->commands;
+    line.num_commands = num_commands;
+    return line;
+}
@@ -17,14 +17,34 @@
 #define _GUN_SOURCE
 
 
+//command_list is NULL terminated, and num_token counts that NULL slot as well,
+//so a command with one argument has num_token == 3
 typedef struct
 {
     char** command_list;
     int num_token;
 }command_line;
 
+//All the commands found on one line. The commands point into a parse_arena
+//and their tokens point into the line itself, so nothing here is freed.
+typedef struct
+{
+    command_line* commands;
+    int num_commands;
+}parsed_line;
+
+//Grow-only storage reused for every line, it is only ever enlarged when a
+//line longer than any before it comes along
+typedef struct
+{
+    char** slots;           //argv pointers of every command, each run ends in NULL
+    size_t slot_cap;
+    command_line* commands;
+    size_t command_cap;
+}parse_arena;
+
 //this functions returns the number of tokens needed for the string array
-//based on the delimeter
+//based on the delimeter (the tokens plus the NULL terminator, 0 for "")
 int count_token (char* buf, const char* delim);
 
 //This functions can tokenize a string to token arrays base on a specified delimeter,
@@ -36,4 +56,30 @@ command_line str_filler (char* buf, const char* delim);
 void free_command_line(command_line* command);
 
 
+//sets up an empty arena, nothing is allocated until the first line
+void arena_init(parse_arena* arena);
+
+//forgets the previous line without giving any memory back
+void arena_reset(parse_arena* arena);
+
+//releases everything the arena holds
+void arena_free(parse_arena* arena);
+
+//Delimiter scanning kernels for parse_line
+#define SCAN_SCALAR 0
+#define SCAN_SSE2   1
+#define SCAN_AVX2   2
+#define SCAN_BEST   3   //the fastest one this CPU supports, chosen by default
+
+//Chooses the kernel parse_line uses to find delimiters, falling back to the next
+//best one if the CPU lacks it. Returns the kernel actually selected.
+int parser_select_kernel(int kind);
+
+//Splits buf into ';' separated commands and whitespace separated arguments in a
+//single pass over SIMD delimiter bitmasks. Delimiters are overwritten with '\0' in place, so buf must stay
+//alive (and unchanged) while the result is used, and buf[len] must be writable.
+//Blank commands are dropped. The previous result from the same arena is invalidated.
+parsed_line parse_line(parse_arena* arena, char* buf, size_t len);
+
+
 #endif /* STRING_PARSER_H_ */
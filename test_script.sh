@@ -81,6 +81,38 @@ EOF
 }
 
 
+test_ls_sorted_command() {
+    echo "Testing 'ls --sort' command..."
+    cd $TEST_DIR
+
+    valgrind_output=$(valgrind ../$EXECUTABLE 2>&1 <<-EOF
+ls --sort
+exit
+EOF
+    )
+    pseudo_shell_output=$(../$EXECUTABLE <<-EOF
+ls --sort
+exit
+EOF
+    )
+
+    # Sorted output is deterministic, so it can be compared exactly (byte order like LC_ALL=C)
+    expected_output=">>> $(ls -a | LC_ALL=C sort | tr '\n' ' ')
+>>> "
+
+    process_valgrind_output "$valgrind_output"
+
+    if [ "$pseudo_shell_output" == "$expected_output" ]; then
+        echo "'ls --sort' command output matches expected output."
+    else
+        echo "Error: 'ls --sort' command output does not match expected output."
+        diff -u <(echo "$pseudo_shell_output") <(echo "$expected_output")
+    fi
+
+    echo ""
+    cd ..
+}
+
 # Function to test 'cat' command
 test_cat_command() {
     echo "Testing 'cat' command..."
@@ -133,6 +165,38 @@ EOF
     cd ..
 }
 
+test_cat_multiple_files() {
+    echo "Testing 'cat' command with several files..."
+    cd $TEST_DIR
+
+    echo "First file for cat." > test_cat_first.txt
+    echo "Second file for cat." > test_cat_second.txt
+
+    valgrind_output=$(valgrind ../$EXECUTABLE 2>&1 <<-EOF
+cat test_cat_first.txt test_cat_second.txt
+exit
+EOF
+    )
+    pseudo_shell_output=$(../$EXECUTABLE <<-EOF
+cat test_cat_first.txt test_cat_second.txt
+exit
+EOF
+    )
+
+    process_valgrind_output "$valgrind_output"
+
+    # Both files have to show up, in the order they were given
+    if echo "$pseudo_shell_output" | tr -d "\n" | grep -q "First file for cat\..*Second file for cat\."; then
+        echo "'cat' printed every file in order."
+    else
+        echo "Error: 'cat' did not print every file in order."
+        echo "$pseudo_shell_output"
+    fi
+
+    echo ""
+    cd ..
+}
+
 test_pwd_command() {
     echo "Testing 'pwd' command..."
     cd $TEST_DIR
@@ -347,6 +411,42 @@ EOF
 #---------------------------
 # CP tests
 
+test_rm_recursive() {
+    echo "Testing 'rm -r' command..."
+    cd $TEST_DIR
+
+    for dir in rm_tree rm_tree_valgrind; do
+        mkdir -p $dir/sub/deeper $dir/other
+        echo "file" > $dir/top.txt
+        echo "file" > $dir/sub/deeper/nested.txt
+        ln -s ../top.txt $dir/other/link.txt
+    done
+
+    valgrind_output=$(valgrind ../$EXECUTABLE 2>&1 <<-EOF
+rm -r rm_tree_valgrind
+exit
+EOF
+    )
+    pseudo_shell_output=$(../$EXECUTABLE <<-EOF
+rm -r rm_tree
+exit
+EOF
+    )
+
+    process_valgrind_output "$valgrind_output"
+
+    if [ ! -e rm_tree ]; then
+        echo "'rm -r' removed the whole tree."
+    else
+        echo "ERROR: 'rm -r' left part of the tree behind."
+        echo "$pseudo_shell_output"
+    fi
+    rm -rf rm_tree rm_tree_valgrind
+
+    echo ""
+    cd ..
+}
+
 test_cp_base() {
 
     local description="$1"
@@ -449,6 +549,139 @@ test_cp_file_to_subdir() {
 
 #---------------------------
 # MV
+test_cp_onto_itself() {
+    echo "=== Testing 'cp' command: file onto itself ==="
+    cd $TEST_DIR
+
+    echo "keep me" > same_file.txt
+    pseudo_shell_output=$(../$EXECUTABLE <<-EOF
+cp same_file.txt same_file.txt
+cp same_file.txt .
+exit
+EOF
+    )
+    if [ "$(cat same_file.txt)" = "keep me" ] &&
+       [ "$(echo "$pseudo_shell_output" | grep -c "same file")" = "2" ]; then
+        echo "'cp' refused to copy a file onto itself."
+    else
+        echo "ERROR: 'cp' copied a file onto itself."
+        echo "$pseudo_shell_output"
+    fi
+    rm -f same_file.txt
+
+    echo ""
+    cd ..
+}
+
+test_cp_recursive() {
+    echo "Testing 'cp -r' command..."
+    cd $TEST_DIR
+
+    mkdir -p cp_tree/sub/deeper
+    echo "top file" > cp_tree/top.txt
+    echo "nested file" > cp_tree/sub/deeper/nested.txt
+    ln -s top.txt cp_tree/link.txt
+
+    valgrind_output=$(valgrind ../$EXECUTABLE 2>&1 <<-EOF
+cp -r cp_tree cp_tree_valgrind
+exit
+EOF
+    )
+    pseudo_shell_output=$(../$EXECUTABLE <<-EOF
+cp -r cp_tree cp_tree_copy
+exit
+EOF
+    )
+
+    process_valgrind_output "$valgrind_output"
+
+    if diff -r cp_tree cp_tree_copy > /dev/null && [ -L cp_tree_copy/link.txt ]; then
+        echo "'cp -r' copied the whole tree."
+    else
+        echo "ERROR: 'cp -r' did not copy the tree."
+        echo "$pseudo_shell_output"
+    fi
+    if ! echo "$pseudo_shell_output" | grep -q "MB/s"; then
+        echo "ERROR: 'cp -r' did not report its throughput."
+    fi
+
+    # Copies that would land on the source itself must be refused before anything is truncated
+    self_output=$(../$EXECUTABLE <<-EOF
+cp -r cp_tree .
+cp -r cp_tree cp_tree
+exit
+EOF
+    )
+    if [ "$(echo "$self_output" | grep -c "Can't copy a directory into itself")" = "2" ] &&
+       [ "$(cat cp_tree/top.txt)" = "top file" ] && [ ! -e cp_tree/cp_tree ]; then
+        echo "'cp -r' refused to copy a directory onto itself."
+    else
+        echo "ERROR: 'cp -r' copied a directory onto itself."
+        echo "$self_output"
+    fi
+    rm -rf cp_tree cp_tree_copy cp_tree_valgrind
+
+    echo ""
+    cd ..
+}
+
+test_mv_across_filesystems() {
+    echo "Testing 'mv' onto another filesystem..."
+    cd $TEST_DIR
+
+    # /dev/shm is usually tmpfs, skip when it is the same filesystem as the test directory
+    if [ ! -d /dev/shm ] || [ "$(stat -c %d /dev/shm)" = "$(stat -c %d .)" ]; then
+        echo "No second filesystem, skipped."
+        echo ""
+        cd ..
+        return
+    fi
+    local far=/dev/shm/pseudo_shell_mv_$$
+    mkdir -p $far mv_tree/sub
+    echo "moved file" > mv_file.txt
+    echo "renamed file" > mv_renamed.txt
+    echo "nested file" > mv_tree/sub/nested.txt
+    chmod 640 mv_file.txt
+    touch -d "2001-02-03 04:05:06" mv_file.txt mv_tree/sub
+    cp -a mv_tree mv_tree_expected
+
+    pseudo_shell_output=$(../$EXECUTABLE <<-EOF
+mv mv_file.txt $far
+mv mv_tree $far/mv_tree
+mv mv_renamed.txt $far/far_name.txt
+mv $far/far_name.txt mv_back.txt
+exit
+EOF
+    )
+
+    if [ ! -e mv_file.txt ] && [ "$(cat $far/mv_file.txt)" = "moved file" ] &&
+       [ "$(stat -c %a.%Y $far/mv_file.txt)" = "640.$(date -d "2001-02-03 04:05:06" +%s)" ]; then
+        echo "'mv' moved a file across filesystems."
+    else
+        echo "ERROR: 'mv' did not move the file across filesystems."
+        echo "$pseudo_shell_output"
+    fi
+    if [ ! -e mv_tree ] && diff -r mv_tree_expected $far/mv_tree > /dev/null &&
+       [ "$(stat -c %Y $far/mv_tree/sub)" = "$(stat -c %Y mv_tree_expected/sub)" ]; then
+        echo "'mv' moved a directory across filesystems."
+    else
+        echo "ERROR: 'mv' did not move the directory across filesystems."
+        echo "$pseudo_shell_output"
+    fi
+    # Onto a new name, both ways
+    if [ ! -e mv_renamed.txt ] && [ ! -e $far/far_name.txt ] && [ "$(cat mv_back.txt)" = "renamed file" ] &&
+       ! echo "$pseudo_shell_output" | grep -q "Error!"; then
+        echo "'mv' renamed a file across filesystems and back."
+    else
+        echo "ERROR: 'mv' did not rename the file across filesystems."
+        echo "$pseudo_shell_output"
+    fi
+    rm -rf $far mv_tree_expected mv_file.txt mv_tree mv_renamed.txt mv_back.txt
+
+    echo ""
+    cd ..
+}
+
 test_mv_base() {
     local description="$1"
     local src="$2"
@@ -686,6 +919,440 @@ ls" > input.txt
     cd ..
 }
 
+test_file_mode_parallel() {
+    echo "=== Testing Parallel File Mode ==="
+    mkdir -p parallel_seq parallel_par
+    for dir in parallel_seq parallel_par; do
+        echo "first file" > $dir/a.txt
+        echo "second file" > $dir/b.txt
+        echo "cp a.txt c.txt; cat b.txt; cp b.txt d.txt; cat c.txt
+mkdir sub; cp c.txt sub; ls --sort sub; mv d.txt e.txt; cat e.txt
+cd sub; cat c.txt; cd ..; rm c.txt; cat c.txt; pwd" > $dir/input.txt
+    done
+
+    # Same script, once in order and once on four workers
+    (cd parallel_seq && ../$EXECUTABLE -f input.txt)
+    (cd parallel_par && ../$EXECUTABLE -f input.txt -j 4)
+
+    if cmp -s <(sed "s#parallel_seq#DIR#" parallel_seq/output.txt) <(sed "s#parallel_par#DIR#" parallel_par/output.txt); then
+        echo "Success: Parallel output matches sequential output."
+    else
+        echo "ERROR: Parallel output differs from sequential output."
+        diff -u parallel_seq/output.txt parallel_par/output.txt
+    fi
+    rm -rf parallel_seq parallel_par
+
+    echo ""
+}
+
+
+test_stats() {
+    echo "=== Testing -stats ==="
+    mkdir -p stats_dir
+    echo "hello" > stats_dir/a.txt
+    echo "cp a.txt b.txt; cat b.txt; cat b.txt; pwd" > stats_dir/input.txt
+
+    # The report goes to stderr, output.txt has to stay the same as without -stats
+    (cd stats_dir && ../$EXECUTABLE -f input.txt && mv output.txt plain.txt)
+    stats_table=$(cd stats_dir && ../$EXECUTABLE -f input.txt -stats 2>&1)
+    stats_json=$(cd stats_dir && ../$EXECUTABLE -f input.txt -stats=json 2>&1)
+
+    if echo "$stats_table" | grep -qE "^cat +2 +0 " && echo "$stats_table" | grep -qE "^cp +1 "; then
+        echo "Success: -stats counted every command."
+    else
+        echo "ERROR: -stats table is wrong."
+        echo "$stats_table"
+    fi
+    if echo "$stats_json" | grep -q '"name":"cat","calls":2,'; then
+        echo "Success: -stats=json counted every command."
+    else
+        echo "ERROR: -stats=json report is wrong."
+        echo "$stats_json"
+    fi
+    if ! cmp -s stats_dir/plain.txt stats_dir/output.txt; then
+        echo "ERROR: -stats changed output.txt."
+    fi
+    rm -rf stats_dir
+
+    echo ""
+}
+
+test_daemon() {
+    echo "=== Testing Daemon Mode ==="
+    mkdir -p daemon_dir/one daemon_dir/two
+    cd daemon_dir
+    ../$EXECUTABLE -d shell.sock -j 2 > server.log &
+    local server=$!
+    for i in $(seq 50); do
+        [ -S shell.sock ] && break
+        sleep 0.1
+    done
+
+    # Two clients at once, each in its own directory, exit only ends its own session
+    echo "cd one
+mkdir made
+pwd
+exit
+pwd" > script_one.txt
+    echo "cd two; pwd; ls" > script_two.txt
+    ../pseudo-client shell.sock script_one.txt > out_one.txt &
+    ../pseudo-client shell.sock script_two.txt > out_two.txt
+    wait $!
+
+    if [ "$(cat out_one.txt)" = "$(pwd)/one" ] && [ -d one/made ] &&
+       [ "$(head -1 out_two.txt)" = "$(pwd)/two" ]; then
+        echo "Success: Clients got their own sessions and output."
+    else
+        echo "ERROR: Daemon sessions are wrong."
+        cat out_one.txt out_two.txt
+    fi
+
+    # Background jobs belong to the client that started them
+    echo "client one data" > one/data.txt
+    printf 'cd one\ncat data.txt &\nwait\ncat data.txt &\n' > jobs_one.txt
+    printf 'jobs\nwait\npwd\n' > jobs_two.txt
+    ../pseudo-client shell.sock jobs_one.txt > jobs_out_one.txt
+    ../pseudo-client shell.sock jobs_two.txt > jobs_out_two.txt
+    if grep -q "Done  cat data.txt" jobs_out_one.txt && grep -q "client one data" jobs_out_one.txt &&
+       [ "$(cat jobs_out_two.txt)" = "$(pwd)" ]; then
+        echo "Success: Clients only saw their own background jobs."
+    else
+        echo "ERROR: Background jobs leaked between daemon clients."
+        cat jobs_out_one.txt jobs_out_two.txt
+    fi
+
+    kill -TERM $server
+    wait $server
+    if [ -e shell.sock ]; then
+        echo "ERROR: Daemon left its socket behind."
+    fi
+    cd ..
+    rm -rf daemon_dir
+
+    echo ""
+}
+
+test_pipes_and_redirection() {
+    echo "=== Testing pipes and redirection ==="
+    mkdir -p pipe_dir
+    cd pipe_dir
+    echo "hello" > a.txt
+    head -c 3000000 /dev/urandom > big.bin
+
+    ../$EXECUTABLE > /dev/null <<-EOF
+cat a.txt > once.txt
+cat a.txt > twice.txt
+cat a.txt >> twice.txt
+cat a.txt | cat | cat > piped.txt
+cat big.bin | cat | cat > big_copy.bin
+pwd > where.txt
+exit
+EOF
+
+    # cat ends every file with a newline of its own
+    if [ "$(cat once.txt)" = "hello" ] && [ "$(grep -c hello twice.txt)" = "2" ] &&
+       [ "$(cat piped.txt)" = "hello" ] && [ "$(cat where.txt)" = "$(pwd)" ]; then
+        echo "Success: Redirection and pipes carried the output."
+    else
+        echo "ERROR: Redirection or pipes lost output."
+    fi
+    if cmp -s <(cat big.bin; echo) big_copy.bin; then
+        echo "Success: A large file went through the pipeline intact."
+    else
+        echo "ERROR: The pipeline changed a large file."
+    fi
+
+    bad_output=$(../$EXECUTABLE <<-EOF
+cat a.txt >
+| cat
+exit
+EOF
+    )
+    if [ "$(echo "$bad_output" | grep -c "Invalid pipe or redirection")" != "2" ]; then
+        echo "ERROR: Bad pipelines were not rejected."
+        echo "$bad_output"
+    fi
+    cd ..
+    rm -rf pipe_dir
+
+    echo ""
+}
+
+test_external_commands() {
+    echo "=== Testing external commands ==="
+    mkdir -p ext_dir/sub
+    cd ext_dir
+    echo "hello" > a.txt
+    printf '#!/bin/sh\npwd > ran_here.txt\n' > sub/where.sh
+    chmod +x sub/where.sh
+
+    ext_output=$(../$EXECUTABLE <<-EOF
+echo from PATH
+echo redirected > echoed.txt
+cat a.txt | wc -c > counted.txt
+cd sub
+./where.sh
+no_such_program_xyz
+exit
+EOF
+    )
+    if echo "$ext_output" | grep -q "from PATH" && [ "$(cat echoed.txt)" = "redirected" ] &&
+       [ "$(tr -d ' ' < counted.txt)" = "7" ] && [ "$(cat sub/ran_here.txt)" = "$(pwd)/sub" ]; then
+        echo "Success: External commands ran with the shell's output and directory."
+    else
+        echo "ERROR: External commands did not run as expected."
+        echo "$ext_output"
+    fi
+    if ! echo "$ext_output" | grep -q "Unrecognized command: no_such_program_xyz"; then
+        echo "ERROR: A missing program was not reported."
+    fi
+    cd ..
+    rm -rf ext_dir
+
+    echo ""
+}
+
+test_cp_update() {
+    echo "=== Testing cp --update ==="
+    mkdir -p upd_dir/src_tree/sub upd_dir/backup
+    cd upd_dir
+    head -c 1000000 /dev/urandom > src.bin
+    echo "one" > src_tree/a.txt
+    echo "two" > src_tree/sub/b.txt
+
+    ../$EXECUTABLE > /dev/null <<-EOF
+cp -u src.bin dst.bin
+cp -r --update src_tree backup
+exit
+EOF
+    local inode_before=$(stat -c %i dst.bin)
+    # Same size, one changed byte in the middle, and a file that shrank
+    printf 'X' | dd of=src.bin bs=1 seek=500000 conv=notrunc 2> /dev/null
+    echo "2" > src_tree/sub/b.txt
+    update_output=$(../$EXECUTABLE <<-EOF
+cp --update src.bin dst.bin
+cp -r -u src_tree backup
+exit
+EOF
+    )
+
+    if cmp -s src.bin dst.bin && [ "$(stat -c %i dst.bin)" = "$inode_before" ] &&
+       cmp -s src_tree/a.txt backup/src_tree/a.txt && cmp -s src_tree/sub/b.txt backup/src_tree/sub/b.txt &&
+       echo "$update_output" | grep -q "Updated 2 files"; then
+        echo "Success: cp --update brought the copies up to date in place."
+    else
+        echo "ERROR: cp --update left a stale or replaced copy."
+        echo "$update_output"
+    fi
+    cd ..
+    rm -rf upd_dir
+
+    echo ""
+}
+
+test_script_cache() {
+    echo "=== Testing the compiled script cache ==="
+    mkdir -p cache_dir
+    cd cache_dir
+    export PSEUDO_SHELL_CACHE="$(pwd)/compiled"
+    printf 'mkdir sub\ncd sub\npwd\nlsl\nmkdir\nls\ncd ..\n' > script.txt
+
+    ../$EXECUTABLE -f script.txt -nocache
+    mv output.txt parsed.txt
+    rm -rf sub
+    ../$EXECUTABLE -f script.txt
+    mv output.txt compiled.txt
+    rm -rf sub
+    ../$EXECUTABLE -f script.txt
+    mv output.txt cached.txt
+    rm -rf sub
+
+    if [ "$(ls compiled/*.psc 2> /dev/null | wc -l)" = "1" ] && cmp -s parsed.txt compiled.txt &&
+       cmp -s parsed.txt cached.txt; then
+        echo "Success: A cached script ran like its text."
+    else
+        echo "ERROR: The cached script ran differently."
+        diff parsed.txt cached.txt
+    fi
+
+    # Background commands start jobs whether the script is cached or not
+    printf 'job data\n' > a.txt
+    printf 'cp a.txt b.txt &\nwait\ncat b.txt &\nwait\n' > jobs.txt
+    ../$EXECUTABLE -f jobs.txt -nocache
+    mv output.txt jobs_parsed.txt
+    rm -f b.txt
+    ../$EXECUTABLE -f jobs.txt
+    ../$EXECUTABLE -f jobs.txt
+    if cmp -s jobs_parsed.txt output.txt && grep -q "Done  cat b.txt" output.txt && grep -q "job data" output.txt; then
+        echo "Success: A cached script started its background jobs."
+    else
+        echo "ERROR: The cached script ran background commands differently."
+        diff jobs_parsed.txt output.txt
+    fi
+
+    # Edited and damaged caches are rebuilt from the script
+    printf 'pwd\n' > script.txt
+    ../$EXECUTABLE -f script.txt
+    local edited=$(head -1 output.txt)
+    truncate -s 100 compiled/*.psc
+    ../$EXECUTABLE -f script.txt
+    local truncated=$(head -1 output.txt)
+    # A header whose max_chars is too small for the words
+    dd if=/dev/zero of="$(ls compiled/*.psc)" bs=1 seek=128 count=8 conv=notrunc 2> /dev/null
+    ../$EXECUTABLE -f script.txt
+    if [ "$edited" = "$(pwd)" ] && [ "$truncated" = "$(pwd)" ] && [ "$(head -1 output.txt)" = "$(pwd)" ]; then
+        echo "Success: Stale and damaged caches were rebuilt."
+    else
+        echo "ERROR: A stale cache was used."
+    fi
+    unset PSEUDO_SHELL_CACHE
+    cd ..
+    rm -rf cache_dir
+
+    echo ""
+}
+
+test_background_jobs() {
+    echo "=== Testing background jobs ==="
+    mkdir -p jobs_dir
+    cd jobs_dir
+    head -c 20000000 /dev/urandom > big.bin
+    printf 'first\nsecond' > lines.txt
+
+    jobs_output=$(../$EXECUTABLE <<-EOF
+cp big.bin copy.bin &
+cat lines.txt &
+wait
+jobs
+wait 1
+exit
+EOF
+    )
+    # The job's output comes out whole, ended with a newline, before its Done line
+    if cmp -s big.bin copy.bin && echo "$jobs_output" | grep -q "\[1\] Done  cp big.bin copy.bin" &&
+       echo "$jobs_output" | grep -A1 "first$" | grep -q "^second$" &&
+       echo "$jobs_output" | grep -A1 "^second$" | grep -q "Done  cat lines.txt" &&
+       echo "$jobs_output" | grep -q "Error! no such job"; then
+        echo "Success: Background jobs ran and were reported."
+    else
+        echo "ERROR: Background jobs were not run or reported properly."
+        echo "$jobs_output"
+    fi
+    cd ..
+    rm -rf jobs_dir
+
+    echo ""
+}
+
+test_ls_cache() {
+    echo "=== Testing the ls cache ==="
+    mkdir -p lscache_dir
+    cd lscache_dir
+    mkdir sub
+    printf 'data' > sub/a.txt
+    cat > ls_script.txt <<-EOF
+ls --sort sub
+mkdir sub/new
+cp sub/a.txt sub/b.txt
+ls --sort sub
+mv sub/a.txt sub/c.txt
+rm sub/b.txt
+ls --sort sub
+touch sub/external
+ls --sort sub
+cat sub/c.txt > sub/redirected
+cd sub
+ls --sort
+exit
+EOF
+
+    # The same commands with and without the cache have to print the same listings
+    plain_output=$(../$EXECUTABLE < ls_script.txt)
+    rm -rf sub
+    mkdir sub
+    printf 'data' > sub/a.txt
+    cached_output=$(../$EXECUTABLE -lscache < ls_script.txt)
+    if [ "$plain_output" = "$cached_output" ] && echo "$cached_output" | grep -q ". .. c.txt external new redirected $"; then
+        echo "Success: Cached listings followed every change."
+    else
+        echo "ERROR: Cached listings differ from fresh ones."
+        echo "$plain_output"
+        echo "$cached_output"
+    fi
+    cd ..
+    rm -rf lscache_dir
+
+    echo ""
+}
+
+test_trace_replay() {
+    echo "=== Testing trace recording and replay ==="
+    mkdir -p trace_dir/seed
+    cd trace_dir/seed
+    printf 'some text' > notes.txt
+    ../../$EXECUTABLE -trace ../session.trace > /dev/null <<-EOF
+mkdir sub
+cp notes.txt sub/copy.txt
+ls --sort sub
+cat notes.txt
+cat /etc/hostname
+mkdir ../escaped
+rm sub/copy.txt
+exit
+EOF
+    cd ..
+    rm -rf escaped
+    rm -rf seed/sub
+
+    # Every line comes back, the two naming paths outside a session are skipped in each of the 3
+    make -C .. pseudo-replay > /dev/null
+    mkdir scratch
+    replay_output=$(../pseudo-replay -fast -sessions 3 -seed seed -dir scratch session.trace)
+    replay_status=$?
+    if [ $replay_status -eq 0 ] && echo "$replay_output" | grep -q '"lines":8,"sessions":3,' &&
+       echo "$replay_output" | grep -q '"skipped":6,"escaped":0' && [ ! -e escaped ] && [ -z "$(ls scratch)" ] &&
+       ! echo "$replay_output" | grep -q '"seconds":0.000000'; then
+        echo "Success: The trace was recorded and replayed."
+    else
+        echo "ERROR: The trace was not recorded or replayed properly."
+        echo "$replay_output"
+    fi
+    cd ..
+    rm -rf trace_dir
+
+    echo ""
+}
+
+test_mkdir_parents() {
+    echo "=== Testing mkdir -p and several directories at once ==="
+    mkdir -p mkdir_dir
+    cd mkdir_dir
+    touch plain_file
+    cat > mkdir_script.txt <<-EOF
+mkdir one two
+mkdir -p deep/a/b/c deep/a/b/d deep/e/f
+mkdir -p deep/a/b/c
+mkdir -p plain_file/sub deep/after
+mkdir -p $(printf 'many/d%02d ' $(seq 1 70)) $(pwd)/absolute/x
+cd deep/a/b/c
+pwd
+exit
+EOF
+
+    output=$(../$EXECUTABLE < mkdir_script.txt)
+    if [ -d one ] && [ -d two ] && [ -d deep/a/b/c ] && [ -d deep/a/b/d ] && [ -d deep/e/f ] && [ -d deep/after ] &&
+       [ -d many/d70 ] && [ -d absolute/x ] && [ "$(find many -mindepth 2 | wc -l)" = "0" ] &&
+       echo "$output" | grep -q "mkdir_dir/deep/a/b/c" && echo "$output" | grep -q "Error! could not create plain_file/sub"; then
+        echo "Success: mkdir created every directory and its missing parents."
+    else
+        echo "ERROR: mkdir -p left directories out."
+        echo "$output"
+    fi
+    cd ..
+    rm -rf mkdir_dir
+
+    echo ""
+}
 
 #---------------------------
 
@@ -699,6 +1366,11 @@ if [ ! -f "$EXECUTABLE" ]; then
     exit 1
 fi
 
+# Tokenizer kernels against the reference str_filler
+if ! make check; then
+    echo "ERROR: parse_line disagrees with str_filler."
+fi
+
 # Start the tests
 echo ""
 echo "Dev Notes: Make sure you are printing '>>> ' when prompting.
@@ -711,11 +1383,14 @@ setup_test_environment
 echo ""
 
 test_ls_command
+test_ls_sorted_command
 test_cat_command
+test_cat_multiple_files
 test_pwd_command
 test_mkdir_command
 test_cd_command
 test_rm_command
+test_rm_recursive
 
 echo "----------------------------------"
 test_cp_file_to_file
@@ -724,6 +1399,8 @@ test_cp_file_to_dir_file
 test_cp_dir_file_to_current
 test_cp_dir_file_to_dir_file
 test_cp_file_to_subdir
+test_cp_onto_itself
+test_cp_recursive
 echo "----------------------------------"
 
 cleanup_test_environment
@@ -736,6 +1413,7 @@ test_mv_file_to_dir_file
 test_mv_dir_file_to_current
 test_mv_dir_file_to_dir_file
 test_mv_file_to_subdir
+test_mv_across_filesystems
 echo "----------------------------------"
 
 cleanup_test_environment
@@ -749,6 +1427,17 @@ test_error_handling
 cleanup_test_environment
 setup_test_environment
 test_file_mode
+test_file_mode_parallel
+test_stats
+test_daemon
+test_pipes_and_redirection
+test_external_commands
+test_cp_update
+test_script_cache
+test_background_jobs
+test_ls_cache
+test_trace_replay
+test_mkdir_parents
 
 cleanup_test_environment
 echo "All tests completed."
@@ -0,0 +1,260 @@
+/*
+ * trace.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Recording and reading session traces. See trace.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "session.h"
+#include "stats.h"
+#include "workers.h"
+
+#define VARINT_MAX 10           // Bytes a 64 bit varint can take
+#define RECORD_NUMBERS 7        // Varints ahead of the line
+
+int traceEnabled = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static char trace_buf[TRACE_BUFFER_SIZE];      // Guarded by trace_lock
+static size_t trace_len = 0;
+static long long trace_origin;                  // Monotonic clock when the trace was opened
+static long long last_start = 0;                // Start of the last record written
+static _Thread_local int trace_session = 0;
+
+static int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Called with trace_lock held
+static void flushTrace(void) {
+    if (trace_len > 0 && writeAll(trace_fd, trace_buf, trace_len) != 0) {
+        fprintf(stderr, "Error! can't write trace\n");
+    }
+    trace_len = 0;
+}
+
+// Called with trace_lock held, data larger than the buffer goes straight to the file
+static void appendTrace(const char *data, size_t len) {
+    if (trace_len + len > TRACE_BUFFER_SIZE) {
+        flushTrace();
+    }
+    if (len > TRACE_BUFFER_SIZE) {
+        if (writeAll(trace_fd, data, len) != 0)
+            fprintf(stderr, "Error! can't write trace\n");
+        return;
+    }
+    memcpy(trace_buf + trace_len, data, len);
+    trace_len += len;
+}
+
+static size_t putVarint(uint8_t *out, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static uint64_t zigzag(long long value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static long long unzigzag(uint64_t value) {
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+int traceOpen(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Error! can't write trace %s\n", path);
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const char *cwd = cwdPath();
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.cwd_len = (uint32_t)strlen(cwd);
+    header.started_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (writeAll(fd, (const char *)&header, sizeof(header)) != 0 || writeAll(fd, cwd, header.cwd_len) != 0) {
+        fprintf(stderr, "Error! can't write trace %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    statsIoInit();      // Bytes moved come from the same counters as -stats
+    trace_fd = fd;
+    trace_origin = nowNanos();
+    traceEnabled = 1;
+    atexit(traceClose);
+    return 0;
+}
+
+void traceClose(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        flushTrace();
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void traceSession(int session) {
+    trace_session = session;
+}
+
+void traceStart(trace_sample *sample) {
+    statsReadIo(sample->io);
+    sample->start_ns = nowNanos();
+}
+
+void traceStop(const trace_sample *sample, command_line cmd, int status) {
+    if (trace_session == TRACE_NO_SESSION) {
+        return;
+    }
+    long long end = nowNanos();
+    long long io[4];
+    statsIoSince(sample->io, io);
+
+    // The line as it was typed, give or take the spacing
+    int argc = cmd.num_token - 1;
+    size_t line_len = 0;
+    for (int i = 0; i < argc; i++) {
+        line_len += strlen(cmd.command_list[i]) + (i > 0);
+    }
+    if (line_len > TRACE_LINE_MAX) {
+        line_len = TRACE_LINE_MAX;
+    }
+
+    uint8_t numbers[RECORD_NUMBERS * VARINT_MAX];
+    long long start = sample->start_ns - trace_origin;
+    pthread_mutex_lock(&trace_lock);
+    size_t len = putVarint(numbers, (uint64_t)trace_session);
+    len += putVarint(numbers + len, zigzag(start - last_start));   // Records from several threads can cross
+    len += putVarint(numbers + len, (uint64_t)(end - sample->start_ns));
+    len += putVarint(numbers + len, zigzag(status));
+    len += putVarint(numbers + len, (uint64_t)io[0]);
+    len += putVarint(numbers + len, (uint64_t)io[1]);
+    len += putVarint(numbers + len, (uint64_t)line_len);
+    last_start = start;
+    appendTrace((const char *)numbers, len);
+
+    size_t left = line_len;
+    for (int i = 0; i < argc && left > 0; i++) {
+        if (i > 0) {
+            appendTrace(" ", 1);
+            left--;
+        }
+        size_t word_len = strlen(cmd.command_list[i]);
+        if (word_len > left) word_len = left;
+        appendTrace(cmd.command_list[i], word_len);
+        left -= word_len;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int traceRead(trace_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error! can't open trace %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    reader->len = (size_t)st.st_size;
+    reader->data = malloc(reader->len ? reader->len : 1);
+    size_t got = 0;
+    while (reader->data != NULL && got < reader->len) {
+        ssize_t nread = read(fd, reader->data + got, reader->len - got);
+        if (nread <= 0) break;
+        got += nread;
+    }
+    close(fd);
+    if (reader->data == NULL || got != reader->len) {
+        fprintf(stderr, "Error! can't read trace %s\n", path);
+        traceReadClose(reader);
+        return -1;
+    }
+
+    reader->header = (const trace_header *)reader->data;
+    if (reader->len < sizeof(trace_header) || memcmp(reader->header->magic, TRACE_MAGIC, 8) != 0 ||
+        reader->header->version != TRACE_VERSION ||
+        reader->header->cwd_len > reader->len - sizeof(trace_header)) {
+        fprintf(stderr, "Error! %s is not a trace this shell can read\n", path);
+        traceReadClose(reader);
+        return -1;
+    }
+    reader->cwd = reader->data + sizeof(trace_header);
+    reader->pos = sizeof(trace_header) + reader->header->cwd_len;
+    return 0;
+}
+
+static int getVarint(trace_reader *reader, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && reader->pos < reader->len; shift += 7) {
+        uint8_t byte = (uint8_t)reader->data[reader->pos++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int traceNext(trace_reader *reader, trace_record *record) {
+    if (reader->pos == reader->len) {
+        return 0;
+    }
+    uint64_t numbers[RECORD_NUMBERS];
+    for (int i = 0; i < RECORD_NUMBERS; i++) {
+        if (getVarint(reader, &numbers[i]) != 0) {
+            return -1;
+        }
+    }
+    if (numbers[6] > reader->len - reader->pos) {
+        return -1;
+    }
+    record->session = (uint32_t)numbers[0];
+    record->start_ns = reader->last_start + unzigzag(numbers[1]);
+    record->duration_ns = (long long)numbers[2];
+    record->status = (int)unzigzag(numbers[3]);
+    record->bytes_read = (long long)numbers[4];
+    record->bytes_written = (long long)numbers[5];
+    record->line = reader->data + reader->pos;
+    record->line_len = (size_t)numbers[6];
+    reader->pos += record->line_len;
+    reader->last_start = record->start_ns;
+    return 1;
+}
+
+void traceReadClose(trace_reader *reader) {
+    free(reader->data);
+    reader->data = NULL;
+    reader->header = NULL;
+}
@@ -0,0 +1,108 @@
+/*
+ * trace.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Session traces behind -trace FILE. Every command line the shell
+ *			 runs is written to a compact binary trace with the session it ran
+ *			 in, when it started, how long it took, the result of the built-in
+ *			 (or external program) and the bytes the process read and wrote
+ *			 meanwhile. The numbers are varint encoded after a fixed header,
+ *			 so a record costs a few bytes beside the line itself. Records are
+ *			 buffered and written in blocks, the trace is complete once the
+ *			 shell exits. pseudo-replay (replay.c) runs a trace again.
+ *
+ *			 Layout: trace_header, the working directory the shell started in
+ *			 (cwd_len bytes), then records of
+ *			     session, start, duration, status, bytes read, bytes written,
+ *			     line length, line
+ *			 with every number a LEB128 varint. start is the distance from the
+ *			 previous record's start and status is zigzag encoded, both can be
+ *			 negative.
+ *
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "string_parser.h"
+
+#define TRACE_MAGIC "PSHTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (64 * 1024)   // Records are written in blocks this big
+#define TRACE_LINE_MAX (64 * 1024)      // Longer lines are cut, they still replay as far as they go
+#define TRACE_NO_SESSION -1             // Session of threads whose lines are not recorded
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t cwd_len;
+    int64_t started_ns;     // Wall clock time the trace was opened, in ns since the epoch
+}trace_header;
+
+// One command line as recorded
+typedef struct
+{
+    uint32_t session;       // 0 for the shell's own session, daemon clients count up from 1
+    long long start_ns;     // Since the trace was opened
+    long long duration_ns;
+    int status;             // What the built-in returned, an external program's exit status
+    long long bytes_read;   // By the whole process while the line ran
+    long long bytes_written;
+    const char *line;       // Not NUL terminated, points into the reader's copy of the trace
+    size_t line_len;
+}trace_record;
+
+// A trace being read back
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t pos;
+    long long last_start;
+    const trace_header *header;
+    const char *cwd;        // Not NUL terminated, header->cwd_len bytes
+}trace_reader;
+
+// Taken when a command line starts
+typedef struct
+{
+    long long start_ns;
+    long long io[4];
+}trace_sample;
+
+//Nonzero once traceOpen has run, test it before calling anything else here
+extern int traceEnabled;
+
+//Starts recording into path, replacing what was there. Call before any thread
+//starts. Returns 0, or -1 (with nothing recorded) if the file can't be written.
+int traceOpen(const char *path);
+
+//Writes what is still buffered. Runs at exit as well.
+void traceClose(void);
+
+//Sets which session the calling thread's lines belong to, TRACE_NO_SESSION stops
+//them from being recorded (background jobs, whose "cmd &" line already was)
+void traceSession(int session);
+
+//Takes the clock and I/O counters as a command line starts
+void traceStart(trace_sample *sample);
+
+//Records cmd, started at sample, which ended with status
+void traceStop(const trace_sample *sample, command_line cmd, int status);
+
+//Loads the trace at path for traceNext. Returns 0, or -1 after printing what is
+//wrong with it on stderr.
+int traceRead(trace_reader *reader, const char *path);
+
+//The next record. Returns 1, 0 at the end of the trace, -1 if it is cut short.
+int traceNext(trace_reader *reader, trace_record *record);
+
+//Frees what traceRead loaded
+void traceReadClose(trace_reader *reader);
+
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,972 @@
+/*
+ * tree.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Recursive copy (and friends) over directory descriptors. See tree.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "tree.h"
+#include "command.h"
+#include "copy_engine.h"
+#include "list_cache.h"
+#include "output.h"
+#include "session.h"
+#include "workers.h"
+
+#ifdef __linux__
+// Record layout returned by getdents64
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY     // Descriptors only walked from, plain ones do elsewhere
+#endif
+
+// Entries of one open directory, a buffer of getdents64 records at a time
+typedef struct
+{
+#ifdef __linux__
+    int fd;
+    char *buf;
+    long len;
+    long pos;
+#else
+    DIR *dir;
+#endif
+}dir_reader;
+
+typedef struct tree_copy tree_copy;
+
+// A source directory and the destination directory it is copied into
+typedef struct
+{
+    int src_fd;
+    int dst_fd;
+    atomic_int refs;        // The walker while it lists the directory, plus one per queued file
+    tree_copy *copy;
+}dir_pair;
+
+// One regular file for a worker to copy
+typedef struct
+{
+    dir_pair *dir;
+    char name[];
+}copy_job;
+
+struct tree_copy
+{
+    work_queue queue;
+    int preserve;           // Keep timestamps too and flush everything to disk, for mv
+    int update;             // Rewrite only what differs in files that already exist, for cp -u
+    atomic_long files;
+    atomic_long dirs;
+    atomic_long errors;
+    atomic_llong bytes;
+};
+
+// A directory being removed. It goes once its own entries and all its subdirectories are gone.
+typedef struct rm_node
+{
+    struct rm_node *parent;     // NULL for the top of the tree
+    int fd;                     // Open while its entries are unlinked and until its children are gone
+    atomic_int pending;         // Its own scan plus every subdirectory not yet removed
+    char name[];                // Relative to the parent's fd
+}rm_node;
+
+typedef struct
+{
+    work_queue queue;           // Directories waiting for a worker to empty them
+    int top_fd;                 // Directory the top node's name is relative to
+    atomic_long errors;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int done;                   // Set once the top directory is removed (or failed)
+}tree_remove;
+
+// A directory mkdir -p has reached, so later paths under it start from its descriptor
+typedef struct
+{
+    char *path;                 // As it was spelled, without trailing slashes, "" for the root
+    size_t len;
+    int fd;                     // O_PATH descriptor to it
+}dir_prefix;
+
+typedef struct
+{
+    dir_prefix entries[TREE_PREFIX_CACHE];
+    int count;
+    int next;                   // Replaced next once every slot is taken
+}prefix_cache;
+
+// Starts reading the entries of fd, which stays open and owned by the caller
+static int readerOpen(dir_reader *reader, int fd) {
+#ifdef __linux__
+    reader->fd = fd;
+    reader->len = 0;
+    reader->pos = 0;
+    reader->buf = malloc(TREE_DENTS_SIZE);
+    return reader->buf != NULL ? 0 : -1;
+#else
+    int dup_fd = dup(fd);   // closedir() closes the descriptor it was given
+    reader->dir = dup_fd < 0 ? NULL : fdopendir(dup_fd);
+    if (reader->dir == NULL) {
+        if (dup_fd >= 0)
+            close(dup_fd);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+// Next entry other than "." and "..", or NULL at the end. type gets a DT_ value.
+static const char *readerNext(dir_reader *reader, unsigned char *type) {
+#ifdef __linux__
+    while (1) {
+        if (reader->pos >= reader->len) {
+            reader->len = syscall(SYS_getdents64, reader->fd, reader->buf, TREE_DENTS_SIZE);
+            reader->pos = 0;
+            if (reader->len <= 0) {
+                return NULL;
+            }
+        }
+        struct linux_dirent64 *entry = (struct linux_dirent64 *)(reader->buf + reader->pos);
+        reader->pos += entry->d_reclen;
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        *type = entry->d_type;
+        return name;
+    }
+#else
+    struct dirent *entry;
+    while ((entry = readdir(reader->dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        *type = entry->d_type;
+        return name;
+    }
+    return NULL;
+#endif
+}
+
+static void readerClose(dir_reader *reader) {
+#ifdef __linux__
+    free(reader->buf);
+    reader->buf = NULL;
+#else
+    closedir(reader->dir);
+    reader->dir = NULL;
+#endif
+}
+
+// Fills in the type when the filesystem doesn't report it in the directory entry
+static unsigned char entryType(int dirfd, const char *name, unsigned char type) {
+    if (type != DT_UNKNOWN) {
+        return type;
+    }
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return DT_UNKNOWN;
+    }
+    if (S_ISDIR(st.st_mode)) return DT_DIR;
+    if (S_ISREG(st.st_mode)) return DT_REG;
+    if (S_ISLNK(st.st_mode)) return DT_LNK;
+    return DT_UNKNOWN;
+}
+
+// The last reference goes once nothing more is written into the directory
+static void releaseDir(dir_pair *dir) {
+    if (atomic_fetch_sub(&dir->refs, 1) == 1) {
+        if (dir->copy->preserve) {
+            // Only now, since every entry created in it would move its mtime again
+            struct stat st;
+            if (fstat(dir->src_fd, &st) != 0 || fchmod(dir->dst_fd, st.st_mode & 07777) != 0 ||
+                futimens(dir->dst_fd, (struct timespec[2]){st.st_atim, st.st_mtim}) != 0 ||
+                fsync(dir->dst_fd) != 0) {
+                atomic_fetch_add(&dir->copy->errors, 1);
+            }
+        }
+        close(dir->src_fd);
+        close(dir->dst_fd);
+        free(dir);
+    }
+}
+
+/*
+    Description: Opens the source directory name and creates its copy dst_name with the
+    same permissions (plus owner access, so the copy can be filled in).
+        Args:
+            tree_copy *copy : Copy in progress, for the counters
+            int src_parent, int dst_parent : Directories name and dst_name are relative to
+            const char *name, const char *dst_name : Source and destination names
+        Returns:
+            dir_pair* : The pair holding one reference, NULL on failure
+*/
+static dir_pair *openPair(tree_copy *copy, int src_parent, const char *name, int dst_parent, const char *dst_name) {
+    struct stat st;
+    int src_fd = openat(src_parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (src_fd < 0 || fstat(src_fd, &st) != 0) {
+        if (src_fd >= 0) close(src_fd);
+        return NULL;
+    }
+    if (mkdirat(dst_parent, dst_name, (st.st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST) {
+        close(src_fd);
+        return NULL;
+    }
+    int dst_fd = openat(dst_parent, dst_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir_pair *dir = dst_fd >= 0 ? malloc(sizeof(dir_pair)) : NULL;
+    if (dir == NULL) {
+        if (dst_fd >= 0) close(dst_fd);
+        close(src_fd);
+        return NULL;
+    }
+    dir->src_fd = src_fd;
+    dir->dst_fd = dst_fd;
+    dir->copy = copy;
+    atomic_init(&dir->refs, 1);
+    atomic_fetch_add(&copy->dirs, 1);
+    return dir;
+}
+
+// Recreates a symbolic link rather than copying what it points to
+static int copyLink(int src_fd, const char *name, int dst_fd, const char *dst_name, int preserve) {
+    char target[4096];
+    ssize_t len = readlinkat(src_fd, name, target, sizeof(target) - 1);
+    if (len < 0) {
+        return -1;
+    }
+    target[len] = '\0';
+    if (symlinkat(target, dst_fd, dst_name) != 0) {
+        return -1;
+    }
+    struct stat st;
+    if (preserve && (fstatat(src_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                     utimensat(dst_fd, dst_name, (struct timespec[2]){st.st_atim, st.st_mtim}, AT_SYMLINK_NOFOLLOW) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Description: Copies one regular file through the copy engine. With preserve the copy
+    also gets the source's mode and timestamps and is flushed to disk before returning.
+        Args:
+            int src_fd, int dst_fd : Directories name and dst_name are relative to
+            const char *name, const char *dst_name : Source and destination names
+            int create : Extra open flags for the destination, O_TRUNC or O_EXCL, or 0
+                         to update an existing destination in place with updateFd
+            int preserve : Keep mode and times and fsync the copy
+            off_t *copied : Gets the number of bytes copied (written, when updating)
+        Returns:
+            int : 0, or -1 on any failure
+*/
+static int copyRegular(int src_fd, const char *name, int dst_fd, const char *dst_name,
+                       int create, int preserve, off_t *copied) {
+    struct stat st;
+    int inFD = openat(src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (inFD < 0 || fstat(inFD, &st) != 0) {
+        if (inFD >= 0) close(inFD);
+        return -1;
+    }
+    int rw = create != 0 ? O_WRONLY : O_RDWR;   // Updating reads the old contents back
+    int outFD = openat(dst_fd, dst_name, rw | O_CREAT | create | O_CLOEXEC, st.st_mode & 07777);
+    if (outFD < 0) {
+        close(inFD);
+        return -1;
+    }
+
+    copy_status copied_status = create != 0 ? copyFd(inFD, outFD, copied) : updateFd(inFD, outFD, copied);
+    int status = copied_status == COPY_OK ? 0 : -1;
+    if (status == 0 && preserve) {
+        // The mode is set explicitly since the umask trimmed it when the file was created
+        if (fchmod(outFD, st.st_mode & 07777) != 0 ||
+            futimens(outFD, (struct timespec[2]){st.st_atim, st.st_mtim}) != 0 ||
+            fsync(outFD) != 0) {
+            status = -1;
+        }
+    }
+    close(inFD);
+    if (close(outFD) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+// Copies one regular file for the workers
+static void copyEntry(tree_copy *copy, copy_job *job) {
+    off_t copied = 0;
+    int create = copy->update ? 0 : O_TRUNC;
+    if (copyRegular(job->dir->src_fd, job->name, job->dir->dst_fd, job->name, create, copy->preserve, &copied) == 0) {
+        atomic_fetch_add(&copy->files, 1);
+        atomic_fetch_add(&copy->bytes, copied);
+    } else {
+        atomic_fetch_add(&copy->errors, 1);
+    }
+}
+
+static void *copyWorker(void *arg) {
+    tree_copy *copy = arg;
+    copy_job *job;
+    while ((job = queuePop(&copy->queue)) != NULL) {
+        copyEntry(copy, job);
+        releaseDir(job->dir);
+        free(job);
+    }
+    return NULL;
+}
+
+/*
+    Description: Walks one directory depth first. Subdirectories are created and walked
+    right away, files are queued for the workers, links are recreated on the spot.
+        Args:
+            tree_copy *copy : Copy in progress
+            dir_pair *dir : Directory to walk, the caller keeps its reference
+        Returns:
+            N/A
+*/
+static void walkCopy(tree_copy *copy, dir_pair *dir) {
+    dir_reader reader;
+    if (readerOpen(&reader, dir->src_fd) != 0) {
+        atomic_fetch_add(&copy->errors, 1);
+        return;
+    }
+
+    const char *name;
+    unsigned char type;
+    while ((name = readerNext(&reader, &type)) != NULL) {
+        type = entryType(dir->src_fd, name, type);
+        if (type == DT_DIR) {
+            dir_pair *child = openPair(copy, dir->src_fd, name, dir->dst_fd, name);
+            if (child == NULL) {
+                atomic_fetch_add(&copy->errors, 1);
+                continue;
+            }
+            walkCopy(copy, child);
+            releaseDir(child);
+        } else if (type == DT_REG) {
+            size_t len = strlen(name);
+            copy_job *job = malloc(sizeof(copy_job) + len + 1);
+            if (job == NULL) {
+                atomic_fetch_add(&copy->errors, 1);
+                continue;
+            }
+            memcpy(job->name, name, len + 1);
+            job->dir = dir;
+            atomic_fetch_add(&dir->refs, 1);
+            queuePush(&copy->queue, job);   // Blocks while the workers are behind
+        } else if (type == DT_LNK) {
+            if (copyLink(dir->src_fd, name, dir->dst_fd, name, copy->preserve) != 0) {
+                atomic_fetch_add(&copy->errors, 1);
+            }
+        } else {
+            atomic_fetch_add(&copy->errors, 1);   // Devices, fifos and sockets aren't copied
+        }
+    }
+    readerClose(&reader);
+}
+
+static rm_node *newNode(rm_node *parent, const char *name) {
+    size_t len = strlen(name);
+    rm_node *node = malloc(sizeof(rm_node) + len + 1);
+    if (node == NULL) {
+        return NULL;
+    }
+    memcpy(node->name, name, len + 1);
+    node->parent = parent;
+    node->fd = -1;
+    atomic_init(&node->pending, 1);
+    return node;
+}
+
+/*
+    Description: Drops one reference to node. When the last one goes the directory is
+    empty, so it is removed from its parent, which in turn loses a reference.
+        Args:
+            tree_remove *rm : Removal in progress
+            rm_node *node : Directory whose scan or child just finished
+        Returns:
+            N/A
+*/
+static void finishNode(tree_remove *rm, rm_node *node) {
+    while (node != NULL && atomic_fetch_sub(&node->pending, 1) == 1) {
+        rm_node *parent = node->parent;
+        int parent_fd = parent != NULL ? parent->fd : rm->top_fd;
+        if (node->fd >= 0) {
+            close(node->fd);
+            if (unlinkat(parent_fd, node->name, AT_REMOVEDIR) != 0) {
+                atomic_fetch_add(&rm->errors, 1);
+            }
+        }
+        if (parent == NULL) {
+            pthread_mutex_lock(&rm->lock);
+            rm->done = 1;
+            pthread_cond_signal(&rm->finished);
+            pthread_mutex_unlock(&rm->lock);
+        }
+        free(node);
+        node = parent;
+    }
+}
+
+/*
+    Description: Unlinks every non-directory in node and hands its subdirectories to
+    the pool, or walks them right here when the queue is full so memory stays bounded.
+        Args:
+            tree_remove *rm : Removal in progress
+            rm_node *node : Directory to empty, its parent's fd is still open
+        Returns:
+            N/A
+*/
+static void scanNode(tree_remove *rm, rm_node *node) {
+    int parent_fd = node->parent != NULL ? node->parent->fd : rm->top_fd;
+    dir_reader reader;
+    node->fd = openat(parent_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (node->fd < 0 || readerOpen(&reader, node->fd) != 0) {
+        if (node->fd >= 0) {
+            close(node->fd);
+            node->fd = -1;      // Tells finishNode not to try removing it
+        }
+        atomic_fetch_add(&rm->errors, 1);
+        finishNode(rm, node);
+        return;
+    }
+
+    const char *name;
+    unsigned char type;
+    while ((name = readerNext(&reader, &type)) != NULL) {
+        if (entryType(node->fd, name, type) != DT_DIR) {
+            if (unlinkat(node->fd, name, 0) != 0) {
+                atomic_fetch_add(&rm->errors, 1);
+            }
+            continue;
+        }
+        rm_node *child = newNode(node, name);
+        if (child == NULL) {
+            atomic_fetch_add(&rm->errors, 1);
+            continue;
+        }
+        atomic_fetch_add(&node->pending, 1);
+        if (queueTryPush(&rm->queue, child) != 0) {
+            scanNode(rm, child);
+        }
+    }
+    readerClose(&reader);
+    finishNode(rm, node);     // The scan's own reference
+}
+
+static void *removeWorker(void *arg) {
+    tree_remove *rm = arg;
+    rm_node *node;
+    while ((node = queuePop(&rm->queue)) != NULL) {
+        scanNode(rm, node);
+    }
+    return NULL;
+}
+
+// Whether the directory dirfd is top or lies somewhere below it, found by climbing ".."
+static int isWithin(int dirfd, const struct stat *top) {
+    int fd = openat(dirfd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    int within = 0;
+    while (fd >= 0 && fstat(fd, &st) == 0) {
+        if (st.st_dev == top->st_dev && st.st_ino == top->st_ino) {
+            within = 1;
+            break;
+        }
+        int up = openat(fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        struct stat up_st;
+        if (up < 0 || fstat(up, &up_st) != 0 || (up_st.st_dev == st.st_dev && up_st.st_ino == st.st_ino)) {
+            if (up >= 0) close(up);
+            break;      // The root is its own parent
+        }
+        close(fd);
+        fd = up;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return within;
+}
+
+/*
+    Description: Copies the directory src to dst_name with the worker pool. The counters
+    of copy are set up here, the caller sets preserve.
+        Args:
+            tree_copy *copy : Copy to run
+            int src_parent, int dst_parent : Directories src and dst_name are relative to
+            const char *src, const char *dst_name : Source directory and its copy
+        Returns:
+            int : 0, or -1 if the copy couldn't start at all (copy->errors counts the rest)
+*/
+static int runCopy(tree_copy *copy, int src_parent, const char *src, int dst_parent, const char *dst_name) {
+    atomic_init(&copy->files, 0);
+    atomic_init(&copy->dirs, 0);
+    atomic_init(&copy->errors, 0);
+    atomic_init(&copy->bytes, 0);
+    if (queueInit(&copy->queue, TREE_QUEUE_SIZE) != 0) {
+        return -1;
+    }
+
+    pthread_t workers[TREE_THREADS];
+    int started = 0;
+    while (started < TREE_THREADS && pthread_create(&workers[started], NULL, copyWorker, copy) == 0) {
+        started++;
+    }
+
+    dir_pair *top = started > 0 ? openPair(copy, src_parent, src, dst_parent, dst_name) : NULL;
+    if (top != NULL) {
+        walkCopy(copy, top);
+        releaseDir(top);
+    }
+    queueClose(&copy->queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    queueFree(&copy->queue);
+    return top != NULL ? 0 : -1;
+}
+
+int updateFile(char *src, char *dst) {
+    int inFD = openat(cwdFd(), src, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (inFD < 0 || fstat(inFD, &st) != 0) {
+        if (inFD >= 0) close(inFD);
+        outPrint("Error! Can't open input file\n");
+        return -1;
+    }
+
+    // Same destination rules as copyFile: into a directory keeps the source's name
+    int into = openat(cwdFd(), dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_parent = into >= 0 ? into : cwdFd();
+    const char *dst_name = into >= 0 ? basename(src) : dst;
+    int outFD = -1;
+    if (into >= 0 || dst[strlen(dst) - 1] != '/') {
+        outFD = openat(dst_parent, dst_name, O_RDWR | O_CREAT | O_CLOEXEC, st.st_mode & 07777);
+    }
+    if (into >= 0) {
+        close(into);
+    }
+    if (outFD < 0) {
+        outPrint("Error! Can't open destination file\n");
+        close(inFD);
+        return -1;
+    }
+
+    copy_status status = updateFd(inFD, outFD, NULL);
+    if (status == COPY_WRITE_ERROR) {
+        outPrint("Error! write error\n");
+    } else if (status == COPY_READ_ERROR) {
+        outPrint("Error! read error\n");
+    }
+    close(inFD);
+    close(outFD);
+    return status == COPY_OK ? 0 : -1;
+}
+
+int copyTree(char *src, char *dst, int update) {
+    struct stat st;
+    if (fstatat(cwdFd(), src, &st, 0) != 0) {
+        outPrint("Error! Can't open input file\n");
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        // A single file copies the same with or without -r
+        if (update) {
+            return updateFile(src, dst);
+        }
+        copyFile(src, dst);
+        return 0;
+    }
+
+    // An existing directory receives a copy named after the source, anything else is the copy
+    int into = openat(cwdFd(), dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dst_parent = into >= 0 ? into : cwdFd();
+    const char *dst_name = into >= 0 ? basename(src) : dst;
+
+    // The directory the copy is written in must not be the source or below it, nor the copy the source
+    char *dst_dir = strdup(dst_name);
+    int target_parent = dst_dir != NULL ? openat(dst_parent, dirname(dst_dir), O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+    free(dst_dir);
+    struct stat target;
+    if (target_parent >= 0 && (isWithin(target_parent, &st) ||
+        (fstatat(dst_parent, dst_name, &target, 0) == 0 && target.st_dev == st.st_dev && target.st_ino == st.st_ino))) {
+        outPrint("Error! Can't copy a directory into itself\n");
+        close(target_parent);
+        if (into >= 0) close(into);
+        return -1;
+    }
+    if (target_parent >= 0) {
+        close(target_parent);
+    }
+
+    tree_copy copy;
+    copy.preserve = 0;
+    copy.update = update;
+    long long begin = nowNanos();
+    int started = runCopy(&copy, cwdFd(), src, dst_parent, dst_name);
+    double seconds = (nowNanos() - begin) / 1e9;
+    if (into >= 0) {
+        close(into);
+    }
+
+    if (started != 0) {
+        outPrint("Error! Can't create destination directory\n");
+        return -1;
+    }
+    long errors = atomic_load(&copy.errors);
+    if (errors > 0) {
+        outPrintf("Error! %ld entries could not be copied\n", errors);
+    }
+
+    long files = atomic_load(&copy.files);
+    double mb = atomic_load(&copy.bytes) / 1e6;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    if (update) {
+        outPrintf("Updated %ld files in %ld directories, %.1f MB written in %.3f s: %.0f files/s\n",
+                  files, atomic_load(&copy.dirs), mb, seconds, files / seconds);
+    } else {
+        outPrintf("Copied %ld files in %ld directories, %.1f MB in %.3f s: %.1f MB/s, %.0f files/s\n",
+                  files, atomic_load(&copy.dirs), mb, seconds, mb / seconds, files / seconds);
+    }
+    return errors > 0 ? -1 : 0;
+}
+
+/*
+    Description: Removes the directory name and everything below it with the worker pool.
+        Args:
+            int top_fd : Directory name is relative to
+            const char *name : Directory to remove
+        Returns:
+            long : Entries that could not be removed, or -1 if the removal couldn't start
+*/
+static long removeAt(int top_fd, const char *name) {
+    tree_remove rm;
+    rm.top_fd = top_fd;
+    rm.done = 0;
+    atomic_init(&rm.errors, 0);
+    if (queueInit(&rm.queue, TREE_QUEUE_SIZE) != 0) {
+        return -1;
+    }
+    pthread_mutex_init(&rm.lock, NULL);
+    pthread_cond_init(&rm.finished, NULL);
+
+    pthread_t workers[TREE_THREADS];
+    int started = 0;
+    while (started < TREE_THREADS && pthread_create(&workers[started], NULL, removeWorker, &rm) == 0) {
+        started++;
+    }
+
+    rm_node *top = newNode(NULL, name);
+    if (top == NULL || started == 0) {
+        free(top);
+        atomic_fetch_add(&rm.errors, 1);
+    } else {
+        queuePush(&rm.queue, top);
+        pthread_mutex_lock(&rm.lock);
+        while (!rm.done) {
+            pthread_cond_wait(&rm.finished, &rm.lock);
+        }
+        pthread_mutex_unlock(&rm.lock);
+    }
+
+    queueClose(&rm.queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    queueFree(&rm.queue);
+    pthread_mutex_destroy(&rm.lock);
+    pthread_cond_destroy(&rm.finished);
+    return atomic_load(&rm.errors);
+}
+
+int removeTree(char *path) {
+    struct stat st;
+    if (fstatat(cwdFd(), path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        outPrint("Error! can't delete file\n");
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        deleteFile(path);   // Files and links go the same way with or without -r
+        return 0;
+    }
+    char *name = basename(path);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        outPrint("Error! refusing to remove '.' or '..'\n");
+        return -1;
+    }
+
+    long errors = removeAt(cwdFd(), path);
+    if (errors < 0) {
+        outPrint("Error! out of memory\n");
+        return -1;
+    }
+    if (errors > 0) {
+        outPrintf("Error! %ld entries could not be removed\n", errors);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Description: Copies a file or link to a temporary name beside dst_name, flushes it and
+    renames it into place, so dst_name is never seen half written.
+        Args:
+            int src_parent, int dst_parent : Directories the names are relative to
+            const char *src_name, const char *dst_name : Source and destination
+            mode_t type : S_IFREG or S_IFLNK
+        Returns:
+            int : 0, or -1 with nothing left behind at the destination
+*/
+static int moveEntry(int src_parent, const char *src_name, int dst_parent, const char *dst_name, mode_t type) {
+    size_t len = strlen(dst_name);
+    char *temp = malloc(len + 32);
+    if (temp == NULL) {
+        return -1;
+    }
+    snprintf(temp, len + 32, "%s.mv-%ld", dst_name, (long)getpid());
+
+    off_t copied = 0;
+    int status = type == S_IFREG ? copyRegular(src_parent, src_name, dst_parent, temp, O_EXCL, 1, &copied)
+                                 : copyLink(src_parent, src_name, dst_parent, temp, 1);
+    if (status == 0 && renameat(dst_parent, temp, dst_parent, dst_name) != 0) {
+        status = -1;
+    }
+    if (status != 0) {
+        unlinkat(dst_parent, temp, 0);
+    }
+    free(temp);
+    return status;
+}
+
+// Flushes the directory holding dst_name (relative to dst_parent, which may be an O_PATH descriptor)
+static int syncParent(int dst_parent, const char *dst_name) {
+    char *dir = strdup(dst_name);
+    int fd = dir != NULL ? openat(dst_parent, dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    free(dir);
+    if (fd < 0) {
+        return -1;
+    }
+    int status = fsync(fd) != 0 && errno != EINVAL ? -1 : 0;
+    close(fd);
+    return status;
+}
+
+int moveAcross(int src_parent, const char *src_name, int dst_parent, const char *dst_name) {
+    struct stat st;
+    if (fstatat(src_parent, src_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        // Copied under a temporary name beside the destination and renamed into place whole
+        size_t len = strlen(dst_name);
+        char *temp = malloc(len + 32);
+        if (temp == NULL) {
+            return -1;
+        }
+        snprintf(temp, len + 32, "%s.mv-%ld", dst_name, (long)getpid());
+        tree_copy copy;
+        copy.preserve = 1;
+        copy.update = 0;
+        int status = runCopy(&copy, src_parent, src_name, dst_parent, temp) != 0 || atomic_load(&copy.errors) > 0 ||
+                     renameat(dst_parent, temp, dst_parent, dst_name) != 0 ? -1 : 0;
+        if (status != 0) {
+            removeAt(dst_parent, temp);
+        }
+        free(temp);
+        // The new name has to be on disk before the only other copy goes
+        if (status != 0 || syncParent(dst_parent, dst_name) != 0) {
+            return -1;
+        }
+        // Part of the source may be gone already, so the whole copy is what stays
+        return removeAt(src_parent, src_name) == 0 ? 0 : -2;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
+        return -1;
+    }
+    if (moveEntry(src_parent, src_name, dst_parent, dst_name, st.st_mode & S_IFMT) != 0) {
+        return -1;
+    }
+    if (syncParent(dst_parent, dst_name) != 0) {
+        return -1;
+    }
+    return unlinkat(src_parent, src_name, 0) == 0 ? 0 : -2;
+}
+
+// The longest remembered directory that path starts with, NULL if there is none
+static dir_prefix *findPrefix(prefix_cache *cache, const char *path) {
+    dir_prefix *best = NULL;
+    for (int i = 0; i < cache->count; i++) {
+        dir_prefix *entry = &cache->entries[i];
+        if ((best == NULL || entry->len > best->len) && strncmp(entry->path, path, entry->len) == 0 &&
+            (path[entry->len] == '/' || path[entry->len] == '\0')) {
+            best = entry;
+        }
+    }
+    return best;
+}
+
+// Hands fd, open on the first len bytes of path, to the cache. Returns the entry it went
+// into, or NULL if it stays the caller's.
+static dir_prefix *rememberPrefix(prefix_cache *cache, const char *path, size_t len, int fd) {
+    char *copy = strndup(path, len);
+    if (copy == NULL) {
+        return NULL;
+    }
+    dir_prefix *entry;
+    if (cache->count < TREE_PREFIX_CACHE) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % TREE_PREFIX_CACHE;
+        free(entry->path);
+        close(entry->fd);
+    }
+    entry->path = copy;
+    entry->len = len;
+    entry->fd = fd;
+    return entry;
+}
+
+/*
+    Description: Creates path and whatever is missing above it. The walk starts at the
+    longest prefix already in the cache (or the working directory), opens each component
+    that exists and creates the rest. Every directory reached goes into the cache.
+        Args:
+            prefix_cache *cache : Directories reached by earlier paths in the batch
+            const char *path : Path to create
+        Returns:
+            int : 0, or -1 with errno set
+*/
+static int makePath(prefix_cache *cache, const char *path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    if (len == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    dir_prefix *start = findPrefix(cache, path);
+    int owned = -1;             // The descriptor walked from when the cache couldn't take it
+    if (start == NULL && path[0] == '/') {
+        owned = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (owned < 0) {
+            return -1;
+        }
+        start = rememberPrefix(cache, path, 0, owned);
+        if (start != NULL) {
+            owned = -1;
+        }
+    }
+    int dirfd = owned >= 0 ? owned : start != NULL ? start->fd : cwdFd();
+    size_t pos = start != NULL ? start->len : 0;
+
+    int created = 0;
+    int status = 0;
+    char name[NAME_MAX + 1];
+    while (pos < len) {
+        while (pos < len && path[pos] == '/') pos++;
+        if (pos == len) {
+            break;
+        }
+        size_t end = pos;
+        while (end < len && path[end] != '/') end++;
+        if (end - pos > NAME_MAX) {
+            errno = ENAMETOOLONG;
+            status = -1;
+            break;
+        }
+        memcpy(name, path + pos, end - pos);
+        name[end - pos] = '\0';
+
+        // Below a directory just made nothing exists yet, so skip straight to mkdirat
+        int made = 0;
+        int fd = created ? -1 : openat(dirfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 && (created || errno == ENOENT)) {
+            if (mkdirat(dirfd, name, 0777) == 0) {
+                made = 1;
+            } else if (errno != EEXIST) {
+                status = -1;
+                break;
+            }
+            fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);   // "." and ".." come here too
+        }
+        if (fd < 0) {
+            status = -1;
+            break;
+        }
+        if (made) {
+            created = 1;
+            if (listCacheEnabled)
+                listCacheNote(dirfd, name, true);
+        }
+
+        if (owned >= 0) {
+            close(owned);
+            owned = -1;
+        }
+        if (rememberPrefix(cache, path, end, fd) == NULL) {
+            owned = fd;
+        }
+        dirfd = fd;
+        pos = end;
+    }
+
+    if (owned >= 0) {
+        int saved = errno;
+        close(owned);
+        errno = saved;
+    }
+    return status;
+}
+
+int makeDirs(char **paths, int count) {
+    prefix_cache cache;
+    cache.count = 0;
+    cache.next = 0;
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        if (makePath(&cache, paths[i]) != 0) {
+            outPrintf("Error! could not create %s\n", paths[i]);
+            status = -1;
+        }
+    }
+
+    for (int i = 0; i < cache.count; i++) {
+        free(cache.entries[i].path);
+        close(cache.entries[i].fd);
+    }
+    return status;
+}
@@ -0,0 +1,64 @@
+/*
+ * tree.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Recursive operations on directory trees. Directories are read with
+ *			 getdents64 and every entry is reached relative to its parent's
+ *			 descriptor, so no path is ever resolved twice. The file work is
+ *			 spread over a pool of threads fed through a bounded queue.
+ *
+ */
+
+#ifndef TREE_H_
+#define TREE_H_
+
+// Threads copying file contents, the work is bound by I/O latency
+#define TREE_THREADS 8
+
+// Jobs waiting between the walker and the workers, this bounds memory and open descriptors
+#define TREE_QUEUE_SIZE 256
+
+// Bytes asked of getdents64 per call, one buffer per directory level being walked
+#define TREE_DENTS_SIZE (64 * 1024)
+
+// Directories mkdir -p keeps open while it works through one command line
+#define TREE_PREFIX_CACHE 64
+
+//Copies the directory src (relative to the working directory) to dst, or into
+//dst if dst is an existing directory, like cp -r. Files keep their mode and
+//symbolic links are recreated. With update, files already in dst are brought
+//up to date in place by updateFd, so unchanged ones cost two statx calls.
+//Prints the throughput when done, or an error.
+//Returns 0, or -1 if anything could not be copied.
+int copyTree(char *src, char *dst, int update);
+
+//Single file version of the update, with copyFile's rules for dst. Prints an
+//error on failure. Returns 0, or -1.
+int updateFile(char *src, char *dst);
+
+//Removes path (relative to the working directory) and everything below it, like
+//rm -r. Directories are emptied in parallel and removed bottom up once their
+//subdirectories are gone. Memory stays bounded however big the tree is.
+//Returns 0, or -1 after printing an error.
+int removeTree(char *path);
+
+//Moves src_name to dst_name where rename can't, because they are on different
+//filesystems. The data goes through the copy engine (reflink, copy_file_range,
+//then a large buffer), keeps its mode and timestamps and is flushed to disk
+//before the source is removed, so a crash always leaves one whole copy.
+//Directories are moved recursively. Prints nothing.
+//Returns 0, -1 with the source still in place and nothing left at the destination,
+//or -2 with the destination complete but the source (or part of it) not removed.
+int moveAcross(int src_parent, const char *src_name, int dst_parent, const char *dst_name);
+
+//Creates each of the count paths (relative to the working directory) along with
+//any missing parents, like mkdir -p. Paths are walked one component at a time
+//with openat and mkdirat from the deepest directory known to exist, and the
+//directories reached are kept open so siblings later in the batch start where
+//the earlier ones left off. Paths that already exist are not errors.
+//Returns 0, or -1 if any path could not be created (after printing an error).
+int makeDirs(char **paths, int count);
+
+
+#endif /* TREE_H_ */
@@ -0,0 +1,141 @@
+/*
+ * workers.c
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Thread helpers. See workers.h.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "workers.h"
+
+typedef struct
+{
+    atomic_size_t next;     // First item nobody has claimed yet
+    size_t n;
+    size_t chunk;
+    range_fn fn;
+    void *ctx;
+}range_job;
+
+// Claims chunks until the range is used up
+static void *rangeWorker(void *arg) {
+    range_job *job = arg;
+    size_t begin;
+    while ((begin = atomic_fetch_add(&job->next, job->chunk)) < job->n) {
+        size_t end = begin + job->chunk < job->n ? begin + job->chunk : job->n;
+        job->fn(job->ctx, begin, end);
+    }
+    return NULL;
+}
+
+void parallelFor(size_t n, size_t chunk, int threads, range_fn fn, void *ctx) {
+    range_job job;
+    atomic_init(&job.next, 0);
+    job.n = n;
+    job.chunk = chunk > 0 ? chunk : 1;
+    job.fn = fn;
+    job.ctx = ctx;
+
+    // No point starting more threads than there are chunks
+    size_t chunks = (n + job.chunk - 1) / job.chunk;
+    if (threads > (int)chunks) {
+        threads = (int)chunks;
+    }
+
+    pthread_t *ids = NULL;
+    int started = 0;
+    if (threads > 1) {
+        ids = malloc((threads - 1) * sizeof(pthread_t));
+    }
+    if (ids != NULL) {
+        while (started < threads - 1 && pthread_create(&ids[started], NULL, rangeWorker, &job) == 0) {
+            started++;
+        }
+    }
+
+    rangeWorker(&job);  // The caller works too, and finishes everything if no thread started
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+}
+
+int queueInit(work_queue *queue, size_t cap) {
+    queue->items = malloc(cap * sizeof(void *));
+    if (queue->items == NULL) {
+        return -1;
+    }
+    queue->cap = cap;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+void queuePush(work_queue *queue, void *item) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->cap) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->items[(queue->head + queue->count) % queue->cap] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int queueTryPush(work_queue *queue, void *item) {
+    int pushed = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->cap) {
+        queue->items[(queue->head + queue->count) % queue->cap] = item;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+        pushed = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return pushed;
+}
+
+void *queuePop(work_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    void *item = NULL;
+    if (queue->count > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->cap;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+void queueClose(work_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queueFree(work_queue *queue) {
+    free(queue->items);
+    queue->items = NULL;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+long long nowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -0,0 +1,62 @@
+/*
+ * workers.h
+ *
+ *  Author: Ellison Schilling
+ *
+ *	Purpose: Small helpers for spreading blocking system calls over threads.
+ *			 Built-ins use these when the work is latency bound (metadata on
+ *			 network mounts, deep trees) rather than CPU bound.
+ *
+ */
+
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+//Work function for parallelFor, handles items [begin, end)
+typedef void (*range_fn)(void *ctx, size_t begin, size_t end);
+
+//Splits [0, n) into chunks of chunk items and hands them to up to threads
+//threads (the caller counts as one of them). Returns once every item is done.
+//Falls back to running everything on the caller if threads can't be started.
+void parallelFor(size_t n, size_t chunk, int threads, range_fn fn, void *ctx);
+
+//Fixed size queue of pointers between pipeline stages. Producers block while it
+//is full, so a fast stage can't run ahead of a slow one without bound.
+typedef struct
+{
+    void **items;
+    size_t cap;
+    size_t head;        // Next item to pop
+    size_t count;
+    int closed;         // No more pushes are coming
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+}work_queue;
+
+//Sets up a queue holding at most cap items. Returns 0, or -1 if memory ran out.
+int queueInit(work_queue *queue, size_t cap);
+
+//Adds item, waiting for room if the queue is full
+void queuePush(work_queue *queue, void *item);
+
+//Adds item only if there is room right now. Returns 0, or -1 if the queue is full.
+int queueTryPush(work_queue *queue, void *item);
+
+//Takes the oldest item, waiting for one. Returns NULL once the queue is closed and empty.
+void *queuePop(work_queue *queue);
+
+//Tells consumers nothing more is coming, they drain what is left and stop
+void queueClose(work_queue *queue);
+
+//Frees the queue, which must be empty and have no waiters
+void queueFree(work_queue *queue);
+
+//Monotonic clock in nanoseconds, for timing work
+long long nowNanos(void);
+
+
+#endif /* WORKERS_H_ */